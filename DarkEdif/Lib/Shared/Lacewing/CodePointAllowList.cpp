@@ -35,6 +35,7 @@ std::string lacewing::codepointsallowlist::setcodepointsallowedlist(std::string
 		codePointRanges.clear();
 		allAllowed = true;
 		list = acStr;
+		compile();
 		return std::string();
 	}
 
@@ -178,9 +179,72 @@ std::string lacewing::codepointsallowlist::setcodepointsallowedlist(std::string
 		/* go to next char */;
 	}
 
+	compile();
 	return std::string();
 }
 
+void lacewing::codepointsallowlist::compile()
+{
+	allowedBMP.assign(0x10000 / 64, 0);
+	allowedAstralRanges.clear();
+	printableASCIIAllowed = false;
+	if (allAllowed)
+		return;
+
+	const auto allow = [&](std::int32_t first, std::int32_t last) {
+		for (std::int32_t c = first; c <= std::min(last, 0xFFFF); ++c)
+			allowedBMP[c >> 6] |= 1ULL << (c & 63);
+		if (last > 0xFFFF)
+			allowedAstralRanges.push_back(std::make_pair(std::max(first, 0x10000), last));
+	};
+	for (const std::int32_t c : specificCodePoints)
+		allow(c, c);
+	for (const auto & range : codePointRanges)
+		allow(range.first, range.second);
+
+	// Categories are looked up once per BMP code point here; past the BMP, they're looked up when checked
+	if (!codePointCategories.empty())
+	{
+		for (std::int32_t c = 0; c <= 0xFFFF; ++c)
+		{
+			if (std::find(codePointCategories.cbegin(), codePointCategories.cend(), utf8proc_category(c)) != codePointCategories.cend())
+				allowedBMP[c >> 6] |= 1ULL << (c & 63);
+		}
+	}
+
+	// Sort and merge overlapping or adjacent ranges, so a check is one binary search
+	std::sort(allowedAstralRanges.begin(), allowedAstralRanges.end());
+	size_t merged = 0;
+	for (size_t i = 1; i < allowedAstralRanges.size(); ++i)
+	{
+		if (allowedAstralRanges[i].first <= allowedAstralRanges[merged].second + 1LL)
+			allowedAstralRanges[merged].second = std::max(allowedAstralRanges[merged].second, allowedAstralRanges[i].second);
+		else
+			allowedAstralRanges[++merged] = allowedAstralRanges[i];
+	}
+	if (!allowedAstralRanges.empty())
+		allowedAstralRanges.resize(merged + 1);
+
+	printableASCIIAllowed = true;
+	for (std::int32_t c = 0x20; c < 0x7F; ++c)
+		printableASCIIAllowed = printableASCIIAllowed && isallowed(c);
+}
+
+bool lacewing::codepointsallowlist::isallowed(std::int32_t codePoint) const
+{
+	if (codePoint <= 0xFFFF)
+		return (allowedBMP[codePoint >> 6] & (1ULL << (codePoint & 63))) != 0;
+
+	// First range starting after codePoint; the one before it is the only one that can contain it
+	const auto next = std::upper_bound(allowedAstralRanges.cbegin(), allowedAstralRanges.cend(), codePoint,
+		[](std::int32_t c, const std::pair<std::int32_t, std::int32_t> & range) { return c < range.first; });
+	if (next != allowedAstralRanges.cbegin() && codePoint <= std::prev(next)->second)
+		return true;
+
+	return !codePointCategories.empty() &&
+		std::find(codePointCategories.cbegin(), codePointCategories.cend(), utf8proc_category(codePoint)) != codePointCategories.cend();
+}
+
 int lacewing::codepointsallowlist::checkcodepointsallowed(const std::string_view toTest, int * const rejectedUTF32CodePoint /* = NULL */) const
 {
 	if (allAllowed)
@@ -190,24 +254,33 @@ int lacewing::codepointsallowlist::checkcodepointsallowed(const std::string_view
 	utf8proc_int32_t thisChar;
 	utf8proc_ssize_t numBytesInCodePoint, remainingBytes = toTest.size();
 	int codePointIndex = 0;
-	utf8proc_category_t category;
 	while (remainingBytes > 0)
 	{
-		numBytesInCodePoint = utf8proc_iterate(str, remainingBytes, &thisChar);
-		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
-			goto badChar;
+		// Skip a run of printable ASCII, if the list allows all of it
+		if (printableASCIIAllowed && *str >= 0x20 && *str < 0x7F)
+		{
+			const size_t run = lw_u8str_asciiprefix(std::string_view((const char *)str, remainingBytes), true);
+			codePointIndex += (int)run;
+			str += run;
+			remainingBytes -= run;
+			if (remainingBytes == 0)
+				break;
+		}
 
-		if (std::find(specificCodePoints.cbegin(), specificCodePoints.cend(), thisChar) != specificCodePoints.cend())
-			goto goodChar;
-		if (std::find_if(codePointRanges.cbegin(), codePointRanges.cend(),
-			[=](const std::pair<std::int32_t, std::int32_t> & range) {
-				return thisChar >= range.first && thisChar <= range.second;
-			}) != codePointRanges.cend())
+		// ASCII is always one valid code point, no need to decode it
+		if (*str < 0x80)
 		{
-			goto goodChar;
+			thisChar = *str;
+			numBytesInCodePoint = 1;
 		}
-		category = utf8proc_category(thisChar);
-		if (std::find(codePointCategories.cbegin(), codePointCategories.cend(), category) != codePointCategories.cend())
+		else
+		{
+			numBytesInCodePoint = utf8proc_iterate(str, remainingBytes, &thisChar);
+			if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
+				goto badChar;
+		}
+
+		if (isallowed(thisChar))
 			goto goodChar;
 
 		// ... fall through from above
@@ -12,6 +12,13 @@
 
 // TODO: This isn't an ideal workaround.
 extern "C" size_t lwp_stream_write(lw_stream ctx, const char* buffer, size_t size, int flags);
+typedef struct _lwp_sharedbuffer * lwp_sharedbuffer;
+extern "C" lwp_sharedbuffer lwp_sharedbuffer_new(const char* buffer, size_t length);
+extern "C" void lwp_sharedbuffer_retain(lwp_sharedbuffer shared);
+extern "C" void lwp_sharedbuffer_release(lwp_sharedbuffer shared);
+extern "C" size_t lwp_sharedbuffer_length(lwp_sharedbuffer shared);
+extern "C" void lwp_stream_write_shared(lw_stream ctx, lwp_sharedbuffer shared, int flags);
+extern "C" size_t lwp_stream_queued_count(lw_stream ctx);
 
 #ifndef lacewingframebuilder
 #define lacewingframebuilder
@@ -134,6 +141,7 @@ protected:
 	int tosendsize;
 	lw_ui32 origUDP;
 	lw_i8 wasWebLast;
+	lw_ui8 headertype;
 
 public:
 
@@ -144,11 +152,13 @@ public:
 		tosendsize = 0;
 		origUDP = UINT32_MAX;
 		wasWebLast = -1;
+		headertype = 0;
 	}
 
 	inline void addheader(lw_ui8 type, lw_ui8 variant, bool forudp = false, int udpclientid = -1)
 	{
 		assert(size == 0 && "lacewing framebuilder.addheader() error: adding header to message that already has one.");
+		headertype = type;
 
 		if (!forudp)
 		{
@@ -209,6 +219,29 @@ public:
 			framereset();
 	}
 
+	inline void send(lacewing::udp udp, lacewing::address * addresses, size_t count, bool clear = true)
+	{
+		udp->send(addresses, count, &buffer[isudpclient ? 5 : 7], size - (isudpclient ? 5 : 7));
+
+		if (clear)
+			framereset();
+	}
+
+	// Message type ID passed to addheader()
+	inline lw_ui8 messagetype() const
+	{
+		return headertype;
+	}
+
+	// Size of the message after its header, not counting any framing
+	inline lw_ui32 payloadsize() const
+	{
+		// Every header takes 8 bytes in the buffer; large WebSocket framing adds 3 more
+		if (size < 8)
+			return 0;
+		return size - 8 - (tosend == buffer && wasWebLast == 1 ? sizeof(zerothree) : 0);
+	}
+
 	inline void framereset()
 	{
 		reset();
@@ -217,6 +250,73 @@ public:
 		wasWebLast = -1;
 	}
 
+	friend class sharedframe;
+};
+
+/// <summary> A framebuilder's message serialized once per framing (raw TCP and WebSocket), for sending
+/// 		  the same message to many clients. Clients that can't take it all immediately queue a
+/// 		  reference to the shared buffer, instead of a copy. </summary>
+class sharedframe
+{
+	framebuilder& builder;
+	lwp_sharedbuffer tcp = nullptr, web = nullptr;
+
+	lwp_sharedbuffer frame(bool websocket)
+	{
+		builder.tosend = nullptr;
+		builder.preparefortransmission(websocket);
+		builder.wasWebLast = websocket;
+		return lwp_sharedbuffer_new(builder.tosend, builder.tosendsize);
+	}
+
+public:
+
+	// The builder must have its full message added, and not be changed while this is alive.
+	sharedframe(framebuilder& builder) : builder(builder)
+	{
+		// WebSocket framing of large messages moves the payload, so TCP framing must be done first.
+		// UDP-headered frames only go to TCP clients via the WebSocket framing.
+		if (builder.origUDP == UINT32_MAX)
+			tcp = frame(false);
+	}
+	~sharedframe()
+	{
+		lwp_sharedbuffer_release(tcp);
+		lwp_sharedbuffer_release(web);
+	}
+	sharedframe(const sharedframe&) = delete;
+	sharedframe& operator=(const sharedframe&) = delete;
+
+	// The framed message for a WebSocket or raw TCP client, or null if it can't go to that kind of client.
+	// Not retained for the caller.
+	inline lwp_sharedbuffer get(bool websocket)
+	{
+		if (websocket && !web)
+			web = frame(true);
+		return websocket ? web : tcp;
+	}
+
+	inline lw_ui8 messagetype() const
+	{
+		return builder.messagetype();
+	}
+	inline lw_ui32 payloadsize() const
+	{
+		return builder.payloadsize();
+	}
+
+	// Stream write flags to use with get()'s buffer
+	static inline int writeflags(bool websocket)
+	{
+		return websocket ? 2 /* lwp_stream_write_ignore_busy */ : 0;
+	}
+
+	inline void send(lacewing::server_client client)
+	{
+		const bool websocket = client->is_websocket();
+		if (lwp_sharedbuffer shared = get(websocket))
+			lwp_stream_write_shared((lw_stream)client, shared, writeflags(websocket));
+	}
 };
 
 #endif
@@ -25,6 +25,10 @@ protected:
 	lw_ui32	messagesize = 0;
 	lw_ui8  messagetype = 0;
 
+	// A message split over several reads is gathered in buffer, which is sized for the whole
+	// message up front, up to this; past it, buffer grows as the data actually arrives.
+	static constexpr lw_ui32 partialPreallocMax = 64 * 1024;
+
 public:
 
 	void  * tag = nullptr;
@@ -41,6 +45,34 @@ public:
 		const char *& data = *dataPtr;
 		size_t &size = *sizePtr;
 
+		// Whole header is here, so decode it in one go, rather than by the byte below
+		if (state == 0 && size >= 2)
+		{
+			const lw_ui8 sizebyte = (lw_ui8)data[1];
+			const size_t headersize = sizebyte == 255 ? 6 : (sizebyte == 254 ? 4 : 2);
+
+			if (size >= headersize)
+			{
+				messagetype = (lw_ui8)data[0];
+
+				if (sizebyte == 254)
+				{
+					lw_ui16 size16;
+					memcpy(&size16, &data[2], sizeof(size16));
+					messagesize = size16;
+				}
+				else if (sizebyte == 255)
+					memcpy(&messagesize, &data[2], sizeof(messagesize));
+				else
+					messagesize = sizebyte;
+
+				data += headersize;
+				size -= headersize;
+				state = 3;
+			}
+		}
+
+		// Header split over reads
 		while (state < 3 && size -- > 0)
 		{
 			lw_ui8 byte = *(data ++);
@@ -144,6 +176,10 @@ public:
 			}
 		}
 
+		// Start of a message split over reads; includes room for the null terminator
+		if (buffer.size == 0)
+			buffer.reserve(messagesize < partialPreallocMax ? messagesize + 1 : partialPreallocMax);
+
 		size_t thismessagebytes = messagesize - buffer.size;
 
 		if (size < thismessagebytes)
@@ -32,6 +32,7 @@ public:
 	{
 		nextID = 0;
 		borrowedCount = 0;
+		lock.setprofilename("IDPool::lock");
 	}
 
 	/// <summary> Gets the next ID available from the pool. </summary>
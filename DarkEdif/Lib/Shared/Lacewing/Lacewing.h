@@ -99,6 +99,7 @@
 #include <condition_variable>
 #include <mutex>
 #include <shared_mutex>
+#include <chrono>
 #include <thread>
 #include <cctype>
 #include <cstring>
@@ -372,6 +373,9 @@ typedef lw_i8 lw_bool;
 			void  (* read)			 (lw_stream, size_t bytes);
 			void  (* cleanup)		 (lw_stream);
 		  size_t  tail_size;
+
+		  /* Optional; sinks several buffers in one go (writev), returning the total sunk */
+		  size_t  (* sink_datav)	 (lw_stream, const char ** buffers, const size_t * lengths, int count);
 	} lw_streamdef;
 
 	lw_import			lw_stream	 lw_stream_new		 (const lw_streamdef *, lw_pump);
@@ -526,6 +530,7 @@ typedef lw_i8 lw_bool;
 	lw_import		void  lw_udp_unhost		 (lw_udp);
 	lw_import	 lw_ui16  lw_udp_port		 (lw_udp);
 	lw_import		void  lw_udp_send		 (lw_udp, lw_addr, const char * buffer, size_t size);
+	lw_import		void  lw_udp_send_batch	 (lw_udp, lw_addr *, size_t count, const char * buffer, size_t size);
 	lw_import	  void *  lw_udp_tag		 (lw_udp);
 	lw_import		void  lw_udp_set_tag	 (lw_udp, void *);
 
@@ -706,6 +711,10 @@ bool lw_u8str_icmp(const std::string_view first, const std::string_view second);
 ///			  Does not ensure strings are normalized; empty strings return true. </summary>
 bool lw_u8str_validate(const std::string_view toValidate);
 
+/// <summary> Returns the number of bytes at the start of the string that are ASCII, checking a block at a time.
+///			  If printableOnly is true, stops at control chars too, so only 0x20 to 0x7E count. </summary>
+size_t lw_u8str_asciiprefix(const std::string_view str, bool printableOnly);
+
 /// <summary> Normalizes the passed std::string to its least-bytes equivalent (using NFC), and returns true.
 ///			  Empty = true. Handles invalid UTF-8 strings by returning false. </summary>
 bool lw_u8str_normalize(std::string & input);
@@ -1230,6 +1239,9 @@ struct _udp
 
 	lw_import void send (address, const char * data, size_t size = -1);
 
+	/// <summary> Sends the same datagram to several addresses, in as few syscalls as possible. </summary>
+	lw_import void send (address *, size_t count, const char * data, size_t size = -1);
+
 	typedef void (lw_callback * hook_data)
 		(udp, address, char * buffer, size_t size);
 
@@ -1552,6 +1564,23 @@ struct readwritelock
 	// Debug breakpoint if readlock is not held by current thread.
 	bool checkHoldsRead(bool excIfNot = true) const;
 
+	// Lock profiling, off by default. When on, each lock records how long it waited to be taken and was held
+	// for, grouped by lock name and by the file and line that made the readlock/writelock. Works in release builds.
+	static void setprofiling(bool enabled);
+	static bool profiling();
+	// Text report of the recorded profile, busiest first, with wait and hold time histograms.
+	static std::string profiledump(bool reset = false);
+	// Recorded profile summed up per lock name, over all call sites; null lockName is unnamed locks.
+	struct profiletotal
+	{
+		const char * lockName;
+		bool write;
+		lw_ui64 count, waitNS, holdNS;
+	};
+	static std::vector<profiletotal> profiletotals();
+	// Name this lock is reported under in the profile; should be a string literal.
+	void setprofilename(const char * name);
+
 #ifdef _DEBUG
 #define lw_rwlock_debugParamNames const char * file, const char * func, int line
 #define lw_rwlock_debugParamDefs __FILE__, __FUNCTION__, __LINE__
@@ -1575,8 +1604,13 @@ protected:
 	void downgradeWriteLock(writelock &wl, readlock &rl, lw_rwlock_debugParamNames);
 
 #else
-	lacewing::readlock createReadLock();
-	lacewing::writelock createWriteLock();
+#define lw_rwlock_siteParamNames const char * file, int line
+#define lw_rwlock_siteParamDefs __FILE__, __LINE__
+
+	[[nodiscard]]
+	lacewing::readlock createReadLock(lw_rwlock_siteParamNames);
+	[[nodiscard]]
+	lacewing::writelock createWriteLock(lw_rwlock_siteParamNames);
 #endif
 
 protected:
@@ -1597,6 +1631,7 @@ private:
 	//std::condition_variable read, write;
 	::std::atomic<size_t> readers, writers, read_waiters, write_waiters;
 	mutable ::std::atomic<bool> metaLock = false;
+	const char * profilename = nullptr;
 
 	struct holder {
 #ifdef _DEBUG
@@ -1628,7 +1663,7 @@ struct readlock {
 	int writerOpenLine = 0;
 
 #else // !_DEBUG
-	readlock(readwritelock &lock);
+	readlock(readwritelock &lock, lw_rwlock_siteParamNames);
 	void unlock();
 	void relock();
 #ifdef LW_ESCALATION
@@ -1643,6 +1678,12 @@ protected:
 	readwritelock & lock;
 	std::shared_lock<decltype(readwritelock::lock)> locker;
 	bool locked = true;
+
+	// Where this was made, and timings of the current hold if it's being profiled
+	const char * siteFile;
+	int siteLine;
+	::std::chrono::steady_clock::time_point profileAcquired;
+	lw_ui64 profileWaitNS = 0;
 };
 
 struct writelock {
@@ -1659,7 +1700,7 @@ struct writelock {
 	void downgrade(lw_rwlock_debugParamNames, lacewing::readlock &wl);
 #endif // LW_ESCALATION
 #else // !_DEBUG
-	writelock(readwritelock &lock);
+	writelock(readwritelock &lock, lw_rwlock_siteParamNames);
 	void unlock();
 	void relock();
 #if LW_ESCALATION
@@ -1673,6 +1714,12 @@ protected:
 	readwritelock & lock;
 	std::unique_lock<decltype(readwritelock::lock)> locker;
 	bool locked = true;
+
+	// Where this was made, and timings of the current hold if it's being profiled
+	const char * siteFile;
+	int siteLine;
+	::std::chrono::steady_clock::time_point profileAcquired;
+	lw_ui64 profileWaitNS = 0;
 };
 
 #ifdef _DEBUG
@@ -1687,6 +1734,8 @@ protected:
 #else
 #define lw_unlock() unlock()
 #define lw_relock() relock()
+#define createReadLock() createReadLock(lw_rwlock_siteParamDefs)
+#define createWriteLock() createWriteLock(lw_rwlock_siteParamDefs)
 #define lw_upgrade() upgrade()
 #define lw_downgrade() downgrade()
 #define lw_upgrade_to(x) upgrade(x)
@@ -1914,10 +1963,21 @@ struct codepointsallowlist {
 	std::vector<std::int32_t> specificCodePoints;
 	std::vector<std::pair<std::int32_t, std::int32_t>> codePointRanges;
 
+	// The lists above compiled by setcodepointsallowedlist(), so checks don't search them: one bit per
+	// BMP code point, categories included, and sorted non-overlapping ranges for code points past the BMP.
+	std::vector<lw_ui64> allowedBMP;
+	std::vector<std::pair<std::int32_t, std::int32_t>> allowedAstralRanges;
+	// Set if all of printable ASCII is allowed, so checks can skip over it without decoding
+	bool printableASCIIAllowed = false;
+
 	// Updates the allowlisted Unicode code points in this struct, returns error or blank
 	std::string setcodepointsallowedlist(std::string codePointList);
 	// -1 if the string passed matches the allow list, otherwise index of failure.
 	int checkcodepointsallowed(const std::string_view toTest, int * const rejectedUTF32CodePoint = NULL) const;
+
+protected:
+	void compile();
+	bool isallowed(std::int32_t codePoint) const;
 };
 struct relayserverinternal;
 struct relayserver
@@ -2078,6 +2138,16 @@ struct relayserver
 		bool readonly() const;
 		bool istrusted() const;
 
+		// Bytes queued to send to this client that its socket hasn't taken yet
+		size_t outboundqueuedbytes() const;
+		// Messages queued to send to this client that its socket hasn't taken yet. Messages sent
+		// to it directly rather than through a channel are counted in 64KB chunks, not one by one.
+		size_t outboundqueuedmessages() const;
+		// Number of blasted messages this client missed because its outbound queue was past the blast limit
+		lw_ui64 outboundblastsdropped() const;
+		// True if this client went past the outbound disconnect limit, and is being kicked
+		bool outboundoverlimit() const;
+
 		// Internal use only!
 		client(relayserverinternal &server, lacewing::server_client socket) noexcept;
 		~client() noexcept;
@@ -2103,7 +2173,7 @@ struct relayserver
 
 		std::string clientImplStr;
 
-		bool pseudoUDP = true; // Is UDP not supported (e.g. HTML5, UWP JS) so "faked" by receiver
+		std::atomic<bool> pseudoUDP = true; // Is UDP not supported (e.g. HTML5, UWP JS) so "faked" by receiver
 
 		// Got opening null byte, indicating not a HTTP client.
 		bool gotfirstbyte = false;
@@ -2115,11 +2185,32 @@ struct relayserver
 		// Has a TCP ping request been sent by server, and was replied to.
 		// If false, next ping timer tick will consider a failed ping and kick the client, so it is true by default.
 		bool pongedOnTCP = true;
+		// How this client is counted in the server's per-IP connection table. Guarded by that table's lock.
+		enum class ipcountstate : lw_ui8 { none, pending, approved };
+		ipcountstate ipcounted = ipcountstate::none;
+
+		// When the last TCP ping request was sent, for timing the reply
+		std::chrono::steady_clock::time_point pingsenttime;
 
 		lacewing::address udpaddress;
 
 		lw_ui16 _id = 0xFFFF;
 
+		// See outboundblastsdropped() and outboundoverlimit()
+		std::atomic<lw_ui64> _outboundblastsdropped = 0;
+		std::atomic<bool> _outboundoverlimit = false;
+
+		// Channel messages queued to this client by senders that don't hold its lock.
+		// See relayserverinternal::client_queueoutbound.
+		struct outboundqueue;
+		std::unique_ptr<outboundqueue> outbound;
+
+		// Checks this client's outbound queue against the server limits before a message is sent
+		// to it. Returns false if the message should be skipped. Doesn't need the client lock, and
+		// may be called by several senders at once: it only reads the outbound queue's atomic counts,
+		// and if the client goes over the disconnect limit, only the first caller queues its kick.
+		bool outboundallowed(bool blasted);
+
 		void PeerToPeer(relayserver &server, std::shared_ptr<relayserver::channel> viachannel, std::shared_ptr<relayserver::client> receivingclient,
 			bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message);
 
@@ -2134,6 +2225,9 @@ struct relayserver
 	size_t clientcount() const;
 	//client * firstclient();
 
+	// Finds a connected client by name, case-insensitively as in name checks, or null if none has it.
+	std::shared_ptr<lacewing::relayserver::client> clientbyname(std::string_view name) const;
+
 	// Creates channel and adds to server list, accepts no master for the channel.
 	// Expects you have already checked channel with that name does not exist.
 	std::shared_ptr<relayserver::channel> createchannel(std::string_view channelName, std::shared_ptr<lacewing::relayserver::client> master, bool hidden, bool autoclose);
@@ -2180,6 +2274,49 @@ struct relayserver
 	// Plain MS value. Note that 0 or negatives are not usable values.
 	void setinactivitytimer(long milliSeconds);
 
+	// Limits on bytes and on messages queued to one client that it hasn't read yet; 0 disables a limit.
+	// Past a blast limit, blasted messages sent to it over TCP (WebSocket and pseudo-UDP clients) are dropped.
+	// Past a disconnect limit, the client is kicked instead of queuing more. All are 0 by default.
+	// For example, 1MB and 64MB stop one stalled client from holding much of the server's memory; message
+	// limits catch a client falling behind on many small messages. See client::outboundqueuedmessages().
+	void setoutboundlimits(size_t blastDropBytes, size_t disconnectBytes,
+		size_t blastDropMessages = 0, size_t disconnectMessages = 0);
+
+	// Limits connections from one IP (one /64 for IPv6): maxClients in total, of which maxPending have not
+	// had their Connect Request approved yet. Excess connections are closed. 0 for no limit, the default.
+	void setconnectlimitsperip(size_t maxClients, size_t maxPending);
+
+	// Limits how often new connections are accepted from one IP (one /64 for IPv6), as a token bucket:
+	// up to burst connections at once, refilling at connectsPerSecond. 0 connectsPerSecond disables it, the default.
+	void setconnectratelimit(double connectsPerSecond, double burst);
+
+	// Disconnects, channel joins/leaves and such are queued and run by the server's action timer.
+	struct actionqueuestats
+	{
+		// Actions waiting to run
+		size_t depth;
+		// Actions run since the server was created
+		lw_ui64 run;
+		// How long the most recently run action waited in the queue, in microseconds
+		lw_ui64 lastwaitus;
+		// Longest wait of any action, in microseconds, since the max was last reset
+		lw_ui64 maxwaitus;
+	};
+	actionqueuestats getactionqueuestats(bool resetMaxWait = false);
+
+	// Turns lock profiling on or off, for all lacewing::readwritelock in the process, not just this server's.
+	// Off by default, as it timestamps every lock and unlock.
+	void setlockprofiling(bool enabled);
+	// Text report of lock wait/hold times and histograms per lock and call site, worst wait first.
+	std::string dumplockprofile(bool reset = false);
+
+	// Turns on serving Prometheus-style metrics at /metrics on the WebSocket webserver (see host_websocket()).
+	// Off by default; message and ping counters only count while it's on. Lock wait times are only
+	// included while lock profiling is on. Anyone who can reach the WebSocket port can read them.
+	void setmetricsenabled(bool enabled);
+	// The text served at /metrics, in Prometheus text exposition format.
+	std::string metricstext();
+
 	// Used in setcodepointsallowedlist() only.
 	enum class codepointsallowlistindex : int {
 		ClientNames = 0,
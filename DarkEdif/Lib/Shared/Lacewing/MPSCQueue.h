@@ -0,0 +1,160 @@
+/* vim: set et ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <atomic>
+#include <utility>
+
+#ifndef LacewingMPSCQueue
+#define LacewingMPSCQueue
+
+/// <summary> A first-in first-out queue that any number of threads can push to without locking,
+/// 		  and a single thread pops from. Based on Dmitry Vyukov's intrusive MPSC node queue. </summary>
+template<typename T>
+class MPSCQueue
+{
+
+protected:
+
+	struct node
+	{
+		std::atomic<node *> next;
+		T value;
+	};
+
+	std::atomic<node *> head;		// Most recently pushed node; producers swap themselves in here.
+	node * tail;					// Oldest node, only touched by the consumer.
+	node stub;						// Placeholder, so head and tail are never null.
+	std::atomic<size_t> count;		// Number of values pushed and not yet popped.
+
+	// Nodes freed by pop() are kept for push() on the same thread to reuse, saving a new and delete
+	// per value whenever the pushing and popping threads are the same, as with a single-thread pump.
+	class nodecache
+	{
+		static constexpr size_t maxNodes = 64;
+		node * nodes[maxNodes];
+		size_t count = 0;
+
+		// Stays readable after the cache's destructor runs, for queues used later in thread exit
+		static inline thread_local bool threadExited = false;
+
+	public:
+
+		~nodecache()
+		{
+			while (count > 0)
+				delete nodes[--count];
+			threadExited = true;
+		}
+
+		// Returns null if this thread has exited
+		static nodecache * forthread()
+		{
+			if (threadExited)
+				return nullptr;
+			static thread_local nodecache cache;
+			return &cache;
+		}
+
+		node * take()
+		{
+			return count > 0 ? nodes[--count] : new node();
+		}
+
+		void give(node * n)
+		{
+			if (count < maxNodes)
+				nodes[count++] = n;
+			else
+				delete n;
+		}
+	};
+
+	void pushnode(node * n)
+	{
+		n->next.store(nullptr, std::memory_order_relaxed);
+		node * prev = head.exchange(n, std::memory_order_acq_rel);
+		// Between the exchange and this store, the consumer sees the queue as ending at prev
+		prev->next.store(n, std::memory_order_release);
+	}
+
+public:
+
+	/// <summary> Creates an empty queue. </summary>
+	MPSCQueue() : head(&stub), tail(&stub), count(0)
+	{
+		stub.next.store(nullptr, std::memory_order_relaxed);
+	}
+	~MPSCQueue()
+	{
+		T discard;
+		while (pop(discard))
+			;
+	}
+	MPSCQueue(const MPSCQueue &) = delete;
+	MPSCQueue & operator = (const MPSCQueue &) = delete;
+
+	/// <summary> Adds a value to the back of the queue. Safe to call from any thread. </summary>
+	void push(T && value)
+	{
+		nodecache * cache = nodecache::forthread();
+		node * n = cache ? cache->take() : new node();
+		n->value = std::move(value);
+		// Counted first, so a pop racing with this can't take count below zero
+		count.fetch_add(1, std::memory_order_relaxed);
+		pushnode(n);
+	}
+
+	/// <summary> Removes the value at the front of the queue. Only one thread may pop at a time. </summary>
+	/// <returns> False if the queue is empty, or the next value is still being pushed by another thread. </returns>
+	bool pop(T & out)
+	{
+		node * t = tail;
+		node * next = t->next.load(std::memory_order_acquire);
+
+		if (t == &stub)
+		{
+			if (!next)
+				return false;
+			tail = t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+
+		if (!next)
+		{
+			// t is the last node; it can't be freed while it's head, so put the stub behind it
+			if (t != head.load(std::memory_order_acquire))
+				return false; // a push is partway done
+			pushnode(&stub);
+			next = t->next.load(std::memory_order_acquire);
+			if (!next)
+				return false;
+		}
+
+		tail = next;
+		out = std::move(t->value);
+		if (nodecache * cache = nodecache::forthread())
+			cache->give(t);
+		else
+			delete t;
+		count.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/// <summary> Number of values in the queue. Approximate while other threads are pushing. </summary>
+	size_t size() const
+	{
+		return count.load(std::memory_order_relaxed);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+};
+
+#endif
@@ -14,6 +14,53 @@
 #ifndef LacewingMessageBuilder
 #define LacewingMessageBuilder
 
+// Per-thread cache of messagebuilder buffers of the starting size. Most messages are built in
+// a short-lived builder and fit in one, so this saves a malloc and free per message sent.
+class messagebuilderpool
+{
+	static constexpr size_t maxBlocks = 32;
+	char * blocks[maxBlocks];
+	size_t count = 0;
+
+	// Stays readable after the pool's destructor runs, for builders destroyed later in thread exit
+	static inline thread_local bool threadExited = false;
+
+public:
+
+	static constexpr lw_ui32 blockSize = 1024 * 4;
+
+	~messagebuilderpool()
+	{
+		while (count > 0)
+			free(blocks[--count]);
+		threadExited = true;
+	}
+
+	// Returns null if this thread has exited
+	static messagebuilderpool * forthread()
+	{
+		if (threadExited)
+			return nullptr;
+		static thread_local messagebuilderpool pool;
+		return &pool;
+	}
+
+	// Returns a malloc'd block of blockSize bytes
+	char * take()
+	{
+		return count > 0 ? blocks[--count] : (char *)malloc(blockSize);
+	}
+
+	// Takes a malloc'd block of blockSize bytes back, or frees it if the pool is full
+	void give(char * block)
+	{
+		if (count < maxBlocks)
+			blocks[count++] = block;
+		else
+			free(block);
+	}
+};
+
 class messagebuilder
 {
 
@@ -21,6 +68,23 @@ protected:
 
 	lw_ui32 allocated = 0;
 
+	// Allocates the first buffer, of at least sizeP bytes
+	void firstalloc(lw_ui32 sizeP)
+	{
+		messagebuilderpool * pool;
+		if (sizeP <= messagebuilderpool::blockSize && (pool = messagebuilderpool::forthread()) != nullptr)
+		{
+			buffer = pool->take();
+			allocated = messagebuilderpool::blockSize;
+		}
+		else
+		{
+			buffer = (char *)malloc(sizeP);
+			allocated = sizeP;
+		}
+		assert(buffer && "could not allocate buffer for message.");
+	}
+
 public:
 
 	char * buffer = nullptr;
@@ -32,10 +96,17 @@ public:
 
 	~ messagebuilder()
 	{
-		free(buffer);
+		messagebuilderpool * pool;
+		if (allocated == messagebuilderpool::blockSize && (pool = messagebuilderpool::forthread()) != nullptr)
+			pool->give(buffer);
+		else
+			free(buffer);
 		buffer = nullptr;
 	}
 
+	messagebuilder(const messagebuilder &) = delete;
+	messagebuilder & operator = (const messagebuilder &) = delete;
+
 	void add(const char * const buffer, size_t sizeP)
 	{
 		if (sizeP == SIZE_MAX)
@@ -46,12 +117,12 @@ public:
 
 		lw_ui32 size = (lw_ui32)sizeP;
 
+		if (!allocated)
+			firstalloc(size > messagebuilderpool::blockSize ? size : messagebuilderpool::blockSize);
+
 		if (this->size + size > allocated)
 		{
-			if (!allocated)
-				allocated = 1024 * 4;
-			else
-				allocated *= 3;
+			allocated *= 3;
 
 			if (this->size + size > allocated)
 				allocated += size;
@@ -65,6 +136,27 @@ public:
 		this->size += size;
 	}
 
+	// Makes room for sizeP bytes in total, so adding up to that doesn't reallocate.
+	void reserve(size_t sizeP)
+	{
+		if constexpr (sizeof(sizeP) > 4)
+			assert(sizeP < 0xFFFFFFFF);
+
+		if (sizeP <= allocated)
+			return;
+
+		if (!allocated)
+		{
+			firstalloc((lw_ui32)sizeP);
+			return;
+		}
+
+		char * test = (char *) realloc(this->buffer, sizeP);
+		assert(test && "could not reallocate buffer for message.");
+		this->buffer = test;
+		allocated = (lw_ui32)sizeP;
+	}
+
 	template<typename t>
 	inline void add (t value)
 	{
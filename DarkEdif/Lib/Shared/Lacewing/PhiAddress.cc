@@ -8,6 +8,13 @@
 */
 
 #include "Lacewing.h"
+#include <list>
+#include <unordered_map>
+// Define LACEWING_NO_SSE2 to use the portable 64-bit blocks instead, e.g. to test them on x86
+#if !defined(LACEWING_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define lw_u8str_sse2
+#include <emmintrin.h>
+#endif
 
 // Comments for all the below functions can be found in the header file.
 // IntelliSense should display them anyway.
@@ -74,28 +81,175 @@ bool lw_u8str_icmp(const std::string_view first, const std::string_view second)
 	return lw_u8str_simplify(first, false, false) == lw_u8str_simplify(second, false, false);
 }
 
+size_t lw_u8str_asciiprefix(const std::string_view str, bool printableOnly)
+{
+	const unsigned char * const start = (const unsigned char *)str.data(), * const end = start + str.size();
+	const unsigned char * s = start;
+
+	// Most text is ASCII, so check a block at a time, then find where in the block it stopped byte by byte.
+	// SSE2 is part of every x64 CPU, so there's no need to detect it at runtime.
+#ifdef lw_u8str_sse2
+	const __m128i belowPrintable = _mm_set1_epi8(0x20), aboveAscii = _mm_set1_epi8(0x7E);
+	for (; end - s >= 16; s += 16)
+	{
+		const __m128i block = _mm_loadu_si128((const __m128i *)s);
+		int mask = _mm_movemask_epi8(block); // top bit of each byte, set if not ASCII
+		if (printableOnly)
+		{
+			// Compared as signed, so non-ASCII is below 0x20 as well
+			mask |= _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(block, belowPrintable), _mm_cmpgt_epi8(block, aboveAscii)));
+		}
+		if (mask != 0)
+			break;
+	}
+#else
+	constexpr lw_ui64 ones = 0x0101010101010101ULL, tops = 0x8080808080808080ULL;
+	for (lw_ui64 block; end - s >= 8; s += 8)
+	{
+		memcpy(&block, s, sizeof(block));
+		lw_ui64 mask = block & tops;
+		// Once all are ASCII, a byte under 0x20, or 0x7F (found as a zero after XOR), borrows into its top bit
+		if (printableOnly && mask == 0)
+			mask = ((block - ones * 0x20) | ((block ^ (ones * 0x7F)) - ones)) & ~block & tops;
+		if (mask != 0)
+			break;
+	}
+#endif
+
+	for (; s < end; ++s)
+		if (*s >= 0x80 || (printableOnly && (*s < 0x20 || *s == 0x7F)))
+			break;
+	return s - start;
+}
+
+// Printable ASCII, no control chars; utf8proc leaves these as-is, aside from case folding
+static bool lw_u8str_isprintableascii(const std::string_view str)
+{
+	return lw_u8str_asciiprefix(str, true) == str.size();
+}
+
+// Recently simplified non-ASCII strings, as utf8proc's pass is the slow part of simplifying, and lobby
+// servers see the same names over and over. The least recently used are dropped past maxEntries.
+class lw_u8str_simplifycache
+{
+	struct key
+	{
+		std::string_view text;
+		int options;
+		bool operator == (const key &k) const {
+			return options == k.options && text == k.text;
+		}
+	};
+	struct keyhash
+	{
+		size_t operator()(const key &k) const {
+			return std::hash<std::string_view>()(k.text) ^ (size_t)k.options;
+		}
+	};
+	struct entry
+	{
+		std::string text, simplified;
+		int options;
+	};
+
+	std::mutex lock;
+	// Most recently used first; index keys point into these entries' text
+	std::list<entry> entries;
+	std::unordered_map<key, std::list<entry>::iterator, keyhash> index;
+
+public:
+	static constexpr size_t maxEntries = 2048;
+	// Longer strings aren't cached, to bound the cache's memory; names are at most 255 bytes
+	static constexpr size_t maxTextSize = 255;
+
+	static lw_u8str_simplifycache &get()
+	{
+		static lw_u8str_simplifycache cache;
+		return cache;
+	}
+
+	bool find(const std::string_view text, int options, std::string &simplified)
+	{
+		std::lock_guard<std::mutex> cacheLock(lock);
+		const auto it = index.find(key { text, options });
+		if (it == index.end())
+			return false;
+		entries.splice(entries.begin(), entries, it->second);
+		simplified = it->second->simplified;
+		return true;
+	}
+
+	void add(const std::string_view text, int options, const std::string &simplified)
+	{
+		std::lock_guard<std::mutex> cacheLock(lock);
+		// Another thread simplified it at the same time
+		if (index.find(key { text, options }) != index.end())
+			return;
+
+		entries.push_front(entry { std::string(text), simplified, options });
+		index.emplace(key { entries.front().text, options }, entries.begin());
+		if (entries.size() > maxEntries)
+		{
+			index.erase(key { entries.back().text, entries.back().options });
+			entries.pop_back();
+		}
+	}
+};
+
+static std::string lw_u8str_simplify_uncached(const std::string_view first, bool destructive, bool extralumping);
+
 std::string lw_u8str_simplify(const std::string_view first, bool destructive, bool extralumping)
+{
+	// ASCII skips utf8proc, so it's quick enough without the cache
+	if (first.size() > lw_u8str_simplifycache::maxTextSize || lw_u8str_isprintableascii(first))
+		return lw_u8str_simplify_uncached(first, destructive, extralumping);
+
+	const int options = (destructive ? 1 : 0) | (extralumping ? 2 : 0);
+	std::string u8str;
+	if (lw_u8str_simplifycache::get().find(first, options, u8str))
+		return u8str;
+
+	u8str = lw_u8str_simplify_uncached(first, destructive, extralumping);
+	lw_u8str_simplifycache::get().add(first, options, u8str);
+	return u8str;
+}
+
+static std::string lw_u8str_simplify_uncached(const std::string_view first, bool destructive, bool extralumping)
 {
 	if (first.empty())
 		return std::string();
 
-	// Effectively call utf8proc_tolower(), but without null terminator, and return value is more
-	// obviously not the input value.
+	std::string u8str;
+	if (lw_u8str_isprintableascii(first))
+	{
+		u8str.assign(first);
+		if (destructive)
+		{
+			for (char & c : u8str)
+				if (c >= 'A' && c <= 'Z')
+					c += 'a' - 'A';
+		}
+	}
+	else
+	{
+		// Effectively call utf8proc_tolower(), but without null terminator, and return value is more
+		// obviously not the input value.
 
-	// This is an NFKC transformation, a stripping transformation, and by use of casefold,
-	// optionally a lowercase transformation.
-	const utf8proc_option_t nfkc = (utf8proc_option_t)(UTF8PROC_STABLE | UTF8PROC_COMPOSE | UTF8PROC_COMPAT |
-		UTF8PROC_NLF2LS | UTF8PROC_STRIPCC | UTF8PROC_REJECTNA |
-		(destructive ? (UTF8PROC_CASEFOLD | UTF8PROC_LUMP | UTF8PROC_STRIPMARK) : 0));
+		// This is an NFKC transformation, a stripping transformation, and by use of casefold,
+		// optionally a lowercase transformation.
+		const utf8proc_option_t nfkc = (utf8proc_option_t)(UTF8PROC_STABLE | UTF8PROC_COMPOSE | UTF8PROC_COMPAT |
+			UTF8PROC_NLF2LS | UTF8PROC_STRIPCC | UTF8PROC_REJECTNA |
+			(destructive ? (UTF8PROC_CASEFOLD | UTF8PROC_LUMP | UTF8PROC_STRIPMARK) : 0));
 
-	utf8proc_uint8_t * retval;
-	utf8proc_ssize_t resultSizeBytes = utf8proc_map((utf8proc_uint8_t *)first.data(), first.size(), &retval, nfkc);
+		utf8proc_uint8_t * retval;
+		utf8proc_ssize_t resultSizeBytes = utf8proc_map((utf8proc_uint8_t *)first.data(), first.size(), &retval, nfkc);
 
-	if (resultSizeBytes <= 0)
-		return std::string();
+		if (resultSizeBytes <= 0)
+			return std::string();
 
-	std::string u8str((char *)retval, resultSizeBytes);
-	free(retval);
+		u8str.assign((char *)retval, resultSizeBytes);
+		free(retval);
+	}
 
 	// Skip additional lumping
 	if (!destructive || !extralumping)
@@ -190,20 +344,51 @@ extern "C" bool lw_u8str_validate(const char* toValidate, size_t size)
 }
 bool lw_u8str_validate(const std::string_view toValidate)
 {
-	if (toValidate.empty())
-		return true;
-
-	const utf8proc_uint8_t * str = (utf8proc_uint8_t *)toValidate.data();
-	utf8proc_int32_t thisChar;
-	utf8proc_ssize_t numBytesInCodePoint, remainder = toValidate.size();
-	while (remainder > 0)
+	// Same rules as utf8proc_iterate() and utf8proc_codepoint_valid(), without decoding: no overlong forms,
+	// surrogates, or code points past U+10FFFF. ASCII runs are skipped a block at a time.
+	const unsigned char * str = (const unsigned char *)toValidate.data();
+	const unsigned char * const end = str + toValidate.size();
+	while (str < end)
 	{
-		numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
-		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
+		if (*str < 0x80)
+		{
+			str += lw_u8str_asciiprefix(std::string_view((const char *)str, end - str), false);
+			continue;
+		}
+
+		// Valid range of the byte after the lead byte, narrower than 80 to BF where needed to rule out
+		// overlong forms (E0, F0), surrogates (ED), and past U+10FFFF (F4)
+		const unsigned char lead = *str;
+		size_t numBytesInCodePoint;
+		unsigned char secondMin = 0x80, secondMax = 0xBF;
+		if (lead >= 0xC2 && lead <= 0xDF)
+			numBytesInCodePoint = 2;
+		else if (lead >= 0xE0 && lead <= 0xEF)
+		{
+			numBytesInCodePoint = 3;
+			if (lead == 0xE0)
+				secondMin = 0xA0;
+			else if (lead == 0xED)
+				secondMax = 0x9F;
+		}
+		else if (lead >= 0xF0 && lead <= 0xF4)
+		{
+			numBytesInCodePoint = 4;
+			if (lead == 0xF0)
+				secondMin = 0x90;
+			else if (lead == 0xF4)
+				secondMax = 0x8F;
+		}
+		else // continuation byte without a lead, or a lead byte that's always invalid
 			return false;
 
+		if ((size_t)(end - str) < numBytesInCodePoint || str[1] < secondMin || str[1] > secondMax)
+			return false;
+		for (size_t i = 2; i < numBytesInCodePoint; ++i)
+			if ((str[i] & 0xC0) != 0x80)
+				return false;
+
 		str += numBytesInCodePoint;
-		remainder -= numBytesInCodePoint;
 	}
 
 	return true;
@@ -243,9 +428,18 @@ std::string_view lw_u8str_trim(std::string_view toTrim, bool abortOnTrimNeeded)
 	bool lnpMarkSymbol = false;
 	while (remainder > 0)
 	{
-		numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
-		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
-			return std::string_view();
+		// ASCII is always one valid code point, no need to decode it
+		if (*str < 0x80)
+		{
+			thisChar = *str;
+			numBytesInCodePoint = 1;
+		}
+		else
+		{
+			numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
+			if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
+				return std::string_view();
+		}
 
 		// Allow only 1-5, 9-18 on first one; that includes letters, numbers, punctuation.
 		const utf8proc_category_t thisCharCat = utf8proc_category(thisChar);
@@ -276,6 +470,24 @@ std::string_view lw_u8str_trim(std::string_view toTrim, bool abortOnTrimNeeded)
 		// It's not inStart here. It's either middle of string (anything goes) or end of string.
 		// Unicode allowlist worries about the middle of string.
 
+		// Printable ASCII is all letters, numbers, punctuation and symbols except space, so a run of it
+		// needs no category lookups; the last good end char is its last non-space
+		if (thisChar >= 0x20 && thisChar < 0x7F)
+		{
+			numBytesInCodePoint = lw_u8str_asciiprefix(std::string_view((const char *)str, remainder), true);
+			lnpMarkSymbol = str[numBytesInCodePoint - 1] != ' ';
+			for (utf8proc_ssize_t i = numBytesInCodePoint - 1; i >= 0; --i)
+			{
+				if (str[i] != ' ')
+				{
+					lastGoodEndChar = str + i;
+					lastGoodEndCharLen = 1;
+					break;
+				}
+			}
+			goto cont;
+		}
+
 		// End of string allows letters, numbers, punc (as above), plus marks, symbols.
 		lnpMarkSymbol = letterNumPunc || ((thisCharCat >= 6 && thisCharCat <= 8) || (thisCharCat >= 19 && thisCharCat <= 22));
 		if (lnpMarkSymbol)
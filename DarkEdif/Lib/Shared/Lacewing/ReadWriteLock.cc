@@ -8,6 +8,9 @@
 */
 
 #include "Lacewing.h"
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
 
 bool lacewing::readlock::isEnabled() const
 {
@@ -82,7 +85,7 @@ lacewing::writelock::~writelock()
 
 #ifdef _DEBUG
 lacewing::readlock::readlock(readwritelock &lock, lw_rwlock_debugParamNames)
-	: lock(lock), locker(lock.lock, std::defer_lock)
+	: lock(lock), locker(lock.lock, std::defer_lock), siteFile(file), siteLine(line)
 {
 	lock.openReadLock(*this, file, func, line);
 }
@@ -124,8 +127,8 @@ void lacewing::readlock::upgrade(lw_rwlock_debugParamNames, lacewing::writelock
 }
 #endif
 #else
-lacewing::readlock::readlock(readwritelock &lock)
-	: lock(lock), locker(lock.lock, std::defer_lock) {
+lacewing::readlock::readlock(readwritelock &lock, lw_rwlock_siteParamNames)
+	: lock(lock), locker(lock.lock, std::defer_lock), siteFile(file), siteLine(line) {
 	lock.openReadLock(*this);
 }
 void lacewing::readlock::relock()
@@ -143,7 +146,7 @@ void lacewing::readlock::unlock()
 
 #ifdef _DEBUG
 lacewing::writelock::writelock(readwritelock &lock, const char * file, const char * func, int line)
-	: lock(lock), locker(lock.lock, std::defer_lock)
+	: lock(lock), locker(lock.lock, std::defer_lock), siteFile(file), siteLine(line)
 {
 	lock.openWriteLock(*this, file, func, line);
 }
@@ -169,8 +172,8 @@ void lacewing::writelock::unlockDebug(const char * file, const char * func, int
 	locked = false;
 }
 #else
-lacewing::writelock::writelock(readwritelock &lock)
-	: lock(lock), locker(lock.lock, std::defer_lock) {
+lacewing::writelock::writelock(readwritelock &lock, lw_rwlock_siteParamNames)
+	: lock(lock), locker(lock.lock, std::defer_lock), siteFile(file), siteLine(line) {
 	lock.openWriteLock(*this);
 }
 void lacewing::writelock::relock()
@@ -188,6 +191,155 @@ void lacewing::writelock::unlock()
 #endif
 
 
+// Lock profiling: stats per lock name + call site + read/write, spread over a few
+// separately locked tables so recording doesn't become the contention point itself.
+// Histograms are by power of two microseconds; bucket 0 is under 1us, the last is 2^20us (~1s) and over.
+typedef std::chrono::steady_clock lockprofileclock;
+static std::atomic<bool> lockprofilingenabled = false;
+static constexpr int lockprofilebuckets = 22, lockprofileshards = 16;
+
+struct lockprofilekey
+{
+	const char * lockName;
+	const char * file;
+	int line;
+	bool write;
+
+	bool operator == (const lockprofilekey &k) const {
+		return lockName == k.lockName && file == k.file && line == k.line && write == k.write;
+	}
+};
+struct lockprofilekeyhash
+{
+	size_t operator()(const lockprofilekey &k) const {
+		return std::hash<const void *>()(k.lockName) ^ (std::hash<const void *>()(k.file) << 1) ^ ((size_t)k.line << 2) ^ (size_t)k.write;
+	}
+};
+struct lockprofilestats
+{
+	lw_ui64 count = 0;
+	lw_ui64 waitTotalNS = 0, waitMaxNS = 0;
+	lw_ui64 holdTotalNS = 0, holdMaxNS = 0;
+	lw_ui64 waitHist[lockprofilebuckets] = {};
+	lw_ui64 holdHist[lockprofilebuckets] = {};
+};
+static struct lockprofileshard
+{
+	std::mutex lock;
+	std::unordered_map<lockprofilekey, lockprofilestats, lockprofilekeyhash> stats;
+} lockprofiletable[lockprofileshards];
+
+static lw_ui64 lockprofile_ns(lockprofileclock::duration d)
+{
+	return (lw_ui64)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+static int lockprofile_bucket(lw_ui64 ns)
+{
+	int bucket = 0;
+	for (lw_ui64 us = ns / 1000; us > 0 && bucket < lockprofilebuckets - 1; us >>= 1)
+		++bucket;
+	return bucket;
+}
+static void lockprofile_record(const char * lockName, const char * file, int line, bool write, lw_ui64 waitNS, lw_ui64 holdNS)
+{
+	const lockprofilekey key { lockName, file, line, write };
+	lockprofileshard &shard = lockprofiletable[lockprofilekeyhash()(key) % lockprofileshards];
+
+	std::lock_guard<std::mutex> shardLock(shard.lock);
+	lockprofilestats &stats = shard.stats[key];
+	++stats.count;
+	stats.waitTotalNS += waitNS;
+	stats.waitMaxNS = std::max(stats.waitMaxNS, waitNS);
+	stats.holdTotalNS += holdNS;
+	stats.holdMaxNS = std::max(stats.holdMaxNS, holdNS);
+	++stats.waitHist[lockprofile_bucket(waitNS)];
+	++stats.holdHist[lockprofile_bucket(holdNS)];
+}
+
+void lacewing::readwritelock::setprofiling(bool enabled)
+{
+	lockprofilingenabled = enabled;
+}
+bool lacewing::readwritelock::profiling()
+{
+	return lockprofilingenabled;
+}
+void lacewing::readwritelock::setprofilename(const char * name)
+{
+	profilename = name;
+}
+
+std::string lacewing::readwritelock::profiledump(bool reset)
+{
+	std::vector<std::pair<lockprofilekey, lockprofilestats>> all;
+	for (auto &shard : lockprofiletable)
+	{
+		std::lock_guard<std::mutex> shardLock(shard.lock);
+		all.insert(all.end(), shard.stats.begin(), shard.stats.end());
+		if (reset)
+			shard.stats.clear();
+	}
+
+	// Most time spent waiting first
+	std::sort(all.begin(), all.end(), [](const auto &a, const auto &b) {
+		return a.second.waitTotalNS > b.second.waitTotalNS;
+	});
+
+	std::stringstream str;
+	str << "Lock profile, " << all.size() << " call sites" << (lockprofilingenabled ? "" : " (profiling is off)") << ":\n";
+	const auto hist = [&](const char * title, const lw_ui64 (&buckets)[lockprofilebuckets]) {
+		str << "\t" << title << " us:";
+		for (int i = 0; i < lockprofilebuckets; ++i)
+		{
+			if (buckets[i] != 0)
+			{
+				if (i == lockprofilebuckets - 1)
+					str << " >=" << (1ULL << (i - 1)) << ": " << buckets[i];
+				else
+					str << " <" << (1ULL << i) << ": " << buckets[i];
+			}
+		}
+		str << '\n';
+	};
+	for (const auto &s : all)
+	{
+		const char * file = s.first.file ? s.first.file : "?";
+		// Just the file name, not the full path
+		for (const char * c = file; *c; ++c)
+			if (*c == '/' || *c == '\\')
+				file = c + 1;
+
+		str << (s.first.lockName ? s.first.lockName : "(unnamed lock)") << (s.first.write ? " write" : " read")
+			<< " at " << file << ':' << s.first.line << ": " << s.second.count << " acquired"
+			<< ", wait total " << s.second.waitTotalNS / 1000 << "us max " << s.second.waitMaxNS / 1000 << "us"
+			<< ", hold total " << s.second.holdTotalNS / 1000 << "us max " << s.second.holdMaxNS / 1000 << "us\n";
+		hist("wait", s.second.waitHist);
+		hist("hold", s.second.holdHist);
+	}
+	return str.str();
+}
+
+std::vector<lacewing::readwritelock::profiletotal> lacewing::readwritelock::profiletotals()
+{
+	std::vector<profiletotal> totals;
+	for (auto &shard : lockprofiletable)
+	{
+		std::lock_guard<std::mutex> shardLock(shard.lock);
+		for (const auto &s : shard.stats)
+		{
+			auto t = std::find_if(totals.begin(), totals.end(), [&](const profiletotal &t) {
+				return t.lockName == s.first.lockName && t.write == s.first.write;
+			});
+			if (t == totals.end())
+				t = totals.insert(totals.end(), profiletotal { s.first.lockName, s.first.write, 0, 0, 0 });
+			t->count += s.second.count;
+			t->waitNS += s.second.waitTotalNS;
+			t->holdNS += s.second.holdTotalNS;
+		}
+	}
+	return totals;
+}
+
 lacewing::readwritelock::readwritelock()
 {
 	readers = writers = read_waiters = write_waiters = 0;
@@ -287,10 +439,19 @@ void lacewing::readwritelock::openReadLock(readlock &rl)
 		return;
 	}
 
+	const bool profile = lockprofilingenabled.load(std::memory_order_relaxed);
+	const auto waitStart = profile ? lockprofileclock::now() : lockprofileclock::time_point();
+
 	read_waiters++;
 	rl.locker.lock();
 	rl.locked = true;
 
+	if (profile)
+	{
+		rl.profileAcquired = lockprofileclock::now();
+		rl.profileWaitNS = lockprofile_ns(rl.profileAcquired - waitStart);
+	}
+
 	if (writers)
 		LacewingFatalErrorMsgBox(); // Shouldn't have a writer still locking while we're reading
 
@@ -353,10 +514,19 @@ void lacewing::readwritelock::openWriteLock(writelock &wl)
 		return;
 	}
 
+	const bool profile = lockprofilingenabled.load(std::memory_order_relaxed);
+	const auto waitStart = profile ? lockprofileclock::now() : lockprofileclock::time_point();
+
 	++write_waiters;
 	wl.locker.lock();
 	wl.locked = true;
 
+	if (profile)
+	{
+		wl.profileAcquired = lockprofileclock::now();
+		wl.profileWaitNS = lockprofile_ns(wl.profileAcquired - waitStart);
+	}
+
 	// No extra writers pls
 	if (writers || readers)
 		LacewingFatalErrorMsgBox();
@@ -435,8 +605,15 @@ void lacewing::readwritelock::closeReadLock(readlock &rl)
 	this->metaLock = false;
 
 	--readers;
+	const auto released = rl.profileAcquired != lockprofileclock::time_point() ? lockprofileclock::now() : lockprofileclock::time_point();
 	rl.locker.unlock();
 	rl.locked = false;
+
+	if (released != lockprofileclock::time_point())
+	{
+		lockprofile_record(profilename, rl.siteFile, rl.siteLine, false, rl.profileWaitNS, lockprofile_ns(released - rl.profileAcquired));
+		rl.profileAcquired = lockprofileclock::time_point();
+	}
 }
 
 #ifdef _DEBUG
@@ -498,21 +675,28 @@ void lacewing::readwritelock::closeWriteLock(writelock &wl)
 	this->metaLock = false;
 
 	--writers;
+	const auto released = wl.profileAcquired != lockprofileclock::time_point() ? lockprofileclock::now() : lockprofileclock::time_point();
 	wl.locker.unlock();
 	wl.locked = false;
+
+	if (released != lockprofileclock::time_point())
+	{
+		lockprofile_record(profilename, wl.siteFile, wl.siteLine, true, wl.profileWaitNS, lockprofile_ns(released - wl.profileAcquired));
+		wl.profileAcquired = lockprofileclock::time_point();
+	}
 }
 
-#ifdef _DEBUG
 #undef createReadLock
 #undef createWriteLock
+#ifdef _DEBUG
 [[nodiscard]]
 lacewing::readlock lacewing::readwritelock::createReadLock(const char *file, const char * func, int line) {
 	return lacewing::readlock(*this, file, func, line);
 }
 #else
 [[nodiscard]]
-lacewing::readlock lacewing::readwritelock::createReadLock() {
-	return lacewing::readlock(*this);
+lacewing::readlock lacewing::readwritelock::createReadLock(lw_rwlock_siteParamNames) {
+	return lacewing::readlock(*this, file, line);
 }
 #endif
 
@@ -523,7 +707,7 @@ lacewing::writelock lacewing::readwritelock::createWriteLock(const char *file, c
 }
 #else
 [[nodiscard]]
-lacewing::writelock lacewing::readwritelock::createWriteLock() {
-	return lacewing::writelock(*this);
+lacewing::writelock lacewing::readwritelock::createWriteLock(lw_rwlock_siteParamNames) {
+	return lacewing::writelock(*this, file, line);
 }
 #endif
@@ -13,6 +13,9 @@
 #include "MessageReader.h"
 #include <vector>
 #include <algorithm>
+#if !defined(_WIN32) && !defined(__APPLE__) && !defined(__ANDROID__)
+	#include <sys/utsname.h> // uname() for the implementation response
+#endif
 
 namespace lacewing
 {
@@ -13,6 +13,8 @@
 
 #include "deps/utf8proc.h"
 #include "IDPool.h"
+#include "MPSCQueue.h"
+#include "TimerWheel.h"
 #include "FrameReader.h"
 #include "FrameBuilder.h"
 #include "MessageReader.h"
@@ -24,6 +26,7 @@
 #include <time.h>
 #include <ctime>
 #include <map>
+#include <unordered_map>
 #include <iostream>
 
 #define lwp_stream_write_ignore_filters  1
@@ -40,6 +43,26 @@ extern "C" {
 
 namespace lacewing
 {
+// Channel messages for one client, pushed by any sender without the client lock, and written
+// to the socket in order by relayserverinternal::client_flushoutbound under the client lock.
+struct relayserver::client::outboundqueue
+{
+	struct message
+	{
+		lwp_sharedbuffer buffer = nullptr;
+		int flags = 0;
+	};
+	MPSCQueue<message> messages;
+	// Bytes and number of messages in messages
+	std::atomic<size_t> pendingBytes = 0;
+	std::atomic<size_t> pendingMessages = 0;
+	// Bytes and messages the socket had queued as of the last flush, so limits can be checked without the client lock
+	std::atomic<size_t> socketQueuedBytes = 0;
+	std::atomic<size_t> socketQueuedMessages = 0;
+	// Set while the client is in relayserverinternal::outboundpending, waiting for a flush
+	std::atomic<bool> flushPending = false;
+};
+
 void serverpingtimertick(lacewing::timer timer);
 void serveractiontimertick(lacewing::timer timer);
 
@@ -50,6 +73,7 @@ struct relayserverinternal
 	friend relayserver::client;
 
 	relayserver &server;
+	lacewing::pump pump;
 	timer pingtimer;
 	timer actiontimer;
 
@@ -64,8 +88,9 @@ struct relayserverinternal
 	relayserver::handler_channel_close	  handlerchannel_close;
 	relayserver::handler_nameset		  handlernameset;
 
-	relayserverinternal(relayserver &_server, pump pump) noexcept
-		: server(_server), pingtimer(lacewing::timer_new(pump)), actiontimer(lacewing::timer_new(pump))
+	relayserverinternal(relayserver &_server, lacewing::pump pump) noexcept
+		: server(_server), pump(pump), pingtimer(lacewing::timer_new(pump)), actiontimer(lacewing::timer_new(pump)),
+		pingwheel(std::chrono::milliseconds(pingTickMS))
 	{
 		handlerconnect			= 0;
 		handlerdisconnect		= 0;
@@ -78,17 +103,21 @@ struct relayserverinternal
 		handlerchannel_close	= 0;
 		handlernameset			= 0;
 
-		numTotalClientsPerIP = 5;
-		numPendingConnectsPerIP = 2;
+		// Off by default; see relayserver::setconnectlimitsperip()
+		numTotalClientsPerIP = 0;
+		numPendingConnectsPerIP = 0;
 
 		welcomemessage = std::string();
 
 		actiontimer->tag(this);
 		actiontimer->on_tick(serveractiontimertick);
 
-		// Every 100 ms, check for actions queued up, and run up to x of them
+		// Every 100 ms, check for actions queued up, and run them until the queue is empty or
+		// 10 ms has been spent. If some are left over, tick every 1 ms until they're done.
 		actionThreadMS = 100;
-		numActionsPerTick = 20;
+		actionBacklogMS = 1;
+		actionTickBudgetMS = 10;
+		actionBacklogged = false;
 
 		pingtimer->tag(this);
 		pingtimer->on_tick(serverpingtimertick);
@@ -114,7 +143,16 @@ struct relayserverinternal
 		// alive. We can't force them to close, but we can disconnect them.
 		maxInactivityMS = 10 * 60 * 1000;
 
+		// No limit on what's queued to a client that stops reading, as before; see setoutboundlimits()
+		outboundBlastDropBytes = 0;
+		outboundDisconnectBytes = 0;
+		outboundBlastDropMessages = 0;
+		outboundDisconnectMessages = 0;
+
 		channellistingenabled = true;
+
+		// Client IDs are 0 to 0xFFFE; 0xFFFF is a placeholder, see IDPool
+		clientsbyid.resize(0xFFFF);
 	}
 	~relayserverinternal() noexcept
 	{
@@ -124,7 +162,8 @@ struct relayserverinternal
 		auto serverCliListWriteLock = server.lock_clientlist.createWriteLock();
 		auto serverChListWriteLock = server.lock_channellist.createWriteLock();
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-		auto actionWriteTimer = lock_queueaction.createWriteLock();
+
+		*outboundflushtarget = nullptr;
 
 		// TODO: Will this ever be non-empty?
 		for (auto& c : clients)
@@ -134,6 +173,8 @@ struct relayserverinternal
 			//delete c;
 		}
 		clients.clear();
+		clientsbyid.clear();
+		clientsbyname.clear();
 
 		for (auto& c : channels)
 		{
@@ -142,6 +183,9 @@ struct relayserverinternal
 		//	delete c;
 		}
 		channels.clear();
+		channelsbyname.clear();
+		channelsbyid.clear();
+		channelsindex.clear();
 
 		lacewing::timer_delete(pingtimer);
 		pingtimer = nullptr;
@@ -153,19 +197,255 @@ struct relayserverinternal
 	IDPool clientids;
 	IDPool channelids;
 
-	// Max number of Connect Request Approved and Pending allowed per IP.
+	// Max number of Connect Request Approved and Pending allowed per IP; 0 for no limit.
 	// Excess will be disconnected without On Connect being fired for them.
 	size_t numTotalClientsPerIP;
 	// Max number of Connect Request pending (on TCP level, or with Connect Request
-	// events fired but not responded to)
+	// events fired but not responded to); 0 for no limit.
 	// Excess will be disconnected without On Connect being fired for them.
 	size_t numPendingConnectsPerIP;
 
+	// Connections per IP, or per /64 for IPv6, so connect can check the limits above without
+	// looking at every other connection. IPv4 is kept as IPv4-mapped IPv6.
+	struct ipcountkey
+	{
+		lw_ui64 high, low;
+		bool operator == (const ipcountkey &k) const {
+			return high == k.high && low == k.low;
+		}
+	};
+	struct ipcountkeyhash
+	{
+		size_t operator()(const ipcountkey &k) const {
+			return std::hash<lw_ui64>()(k.high ^ (k.low * 0x9E3779B97F4A7C15ULL));
+		}
+	};
+	struct ipcounts
+	{
+		size_t total = 0;
+		size_t pending = 0;
+		// Connect rate limit token bucket; see relayserver::setconnectratelimit
+		double tokens = 0;
+		std::chrono::steady_clock::time_point refilled;
+	};
+	std::mutex lock_ipcounts;
+	std::unordered_map<ipcountkey, ipcounts, ipcountkeyhash> ipcounttable;
+	// Idle entries are swept out when the table grows to this size
+	size_t ipcountSweepSize = 1024;
+	double connectRatePerSec = 0, connectRateBurst = 0;
+
+	static ipcountkey ipcount_keyof(const in6_addr &ip)
+	{
+		ipcountkey key;
+		memcpy(&key.high, &ip, sizeof(key.high));
+		memcpy(&key.low, ((const char *)&ip) + sizeof(key.high), sizeof(key.low));
+		// Not IPv4-mapped (::ffff:0:0/96), so keep only the /64 prefix; one host usually has the whole /64
+		const lw_ui8 * bytes = (const lw_ui8 *)&ip;
+		if (key.high != 0 || bytes[8] != 0 || bytes[9] != 0 || bytes[10] != 0xFF || bytes[11] != 0xFF)
+			key.low = 0;
+		return key;
+	}
+
+	// Refills an IP's connect rate token bucket; returns true if it's full. Expects lock_ipcounts.
+	bool ipcount_refill(ipcounts &counts, std::chrono::steady_clock::time_point now)
+	{
+		if (connectRatePerSec <= 0)
+			return true;
+		if (counts.refilled == std::chrono::steady_clock::time_point())
+			counts.tokens = connectRateBurst;
+		else
+		{
+			const double elapsedSec = std::chrono::duration<double>(now - counts.refilled).count();
+			counts.tokens = std::min(connectRateBurst, counts.tokens + elapsedSec * connectRatePerSec);
+		}
+		counts.refilled = now;
+		return counts.tokens >= connectRateBurst;
+	}
+
+	// Counts a new connection against its IP's limits. Returns the reason to refuse it, or null if it's
+	// accepted, in which case it's counted as pending; the caller should then set its client's ipcounted.
+	const char * ipcount_admit(const in6_addr &ip)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> ipCountsLock(lock_ipcounts);
+
+		if (ipcounttable.size() >= ipcountSweepSize)
+		{
+			for (auto it = ipcounttable.begin(); it != ipcounttable.end(); )
+			{
+				if (it->second.total == 0 && ipcount_refill(it->second, now))
+					it = ipcounttable.erase(it);
+				else
+					++it;
+			}
+			ipcountSweepSize = std::max<size_t>(1024, ipcounttable.size() * 2);
+		}
+
+		ipcounts &counts = ipcounttable[ipcount_keyof(ip)];
+		ipcount_refill(counts, now);
+
+		// Attempts use up the connect rate, even if refused for the other limits
+		if (connectRatePerSec > 0)
+		{
+			if (counts.tokens < 1)
+				return "recent ";
+			counts.tokens -= 1;
+		}
+		if (numTotalClientsPerIP != 0 && counts.total >= numTotalClientsPerIP)
+			return "";
+		if (numPendingConnectsPerIP != 0 && counts.pending >= numPendingConnectsPerIP)
+			return "pending ";
+
+		++counts.total;
+		++counts.pending;
+		return nullptr;
+	}
+
+	// Moves an accepted client from pending to approved in the per-IP table
+	void ipcount_approve(relayserver::client &client)
+	{
+		std::lock_guard<std::mutex> ipCountsLock(lock_ipcounts);
+		if (client.ipcounted != relayserver::client::ipcountstate::pending)
+			return;
+		client.ipcounted = relayserver::client::ipcountstate::approved;
+		--ipcounttable[ipcount_keyof(client.addressInt)].pending;
+	}
+
+	// Takes a disconnecting client out of the per-IP table
+	void ipcount_remove(relayserver::client &client)
+	{
+		std::lock_guard<std::mutex> ipCountsLock(lock_ipcounts);
+		if (client.ipcounted == relayserver::client::ipcountstate::none)
+			return;
+
+		const auto it = ipcounttable.find(ipcount_keyof(client.addressInt));
+		if (it != ipcounttable.end())
+		{
+			--it->second.total;
+			if (client.ipcounted == relayserver::client::ipcountstate::pending)
+				--it->second.pending;
+			// Kept while it's rate limited, or reconnecting would reset the limit
+			if (it->second.total == 0 && ipcount_refill(it->second, std::chrono::steady_clock::now()))
+				ipcounttable.erase(it);
+		}
+		client.ipcounted = relayserver::client::ipcountstate::none;
+	}
+
 	std::string welcomemessage;
 
 	std::vector<std::shared_ptr<relayserver::client>> clients;
 	std::vector<std::shared_ptr<relayserver::channel>> channels;
 
+	// Same clients as above, but indexed by client ID, so message dispatch doesn't have to search
+	// the client list. Guarded by lock_clientlist, same as clients.
+	std::vector<std::shared_ptr<relayserver::client>> clientsbyid;
+
+	// Adds client to server's client list. Expects lock_clientlist write lock.
+	void clientlist_add(std::shared_ptr<relayserver::client> client)
+	{
+		clients.push_back(client);
+		clientsbyid[client->_id] = client;
+	}
+	// Drops client from server's client list. Expects lock_clientlist write lock.
+	void clientlist_erase(std::vector<std::shared_ptr<relayserver::client>>::iterator clientIt)
+	{
+		if (clientsbyid[(*clientIt)->_id] == *clientIt)
+			clientsbyid[(*clientIt)->_id].reset();
+		{
+			std::lock_guard<std::mutex> clientNamesLock(lock_clientnames);
+			clientnames_erase(**clientIt);
+		}
+		clients.erase(clientIt);
+	}
+	// Looks up client by ID, or null if not in server's client list. Expects lock_clientlist read lock.
+	std::shared_ptr<relayserver::client> clientbyid(lw_ui16 id) const
+	{
+		return id < clientsbyid.size() ? clientsbyid[id] : nullptr;
+	}
+
+	// Named clients in the server's client list by simplified name, so name checks don't have to search
+	// the list. A name can have more than one client, if the server set it directly. Guarded by
+	// lock_clientnames, which is taken after any other lock; a client's _namesimplified is only changed
+	// while holding it as well as the client's write lock.
+	// The pointers aren't owning, so every client is erased from here under lock_clientnames before it's
+	// freed: by clientlist_erase, or failing that, by ~client. Only use them while holding the lock.
+	mutable std::mutex lock_clientnames;
+	std::unordered_multimap<std::string, relayserver::client *> clientsbyname;
+
+	// Sets client's simplified name, moving it in clientsbyname. Expects client write lock.
+	void clientnames_set(relayserver::client &client, std::string namesimplified)
+	{
+		std::lock_guard<std::mutex> clientNamesLock(lock_clientnames);
+		clientnames_erase(client);
+		client._namesimplified = std::move(namesimplified);
+		// Read-only clients are on their way out of the client list, and so out of here
+		if (!client._readonly && !client._name.empty())
+			clientsbyname.emplace(client._namesimplified, &client);
+	}
+	// Drops client from clientsbyname. Expects lock_clientnames.
+	void clientnames_erase(relayserver::client &client)
+	{
+		const auto range = clientsbyname.equal_range(client._namesimplified);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second == &client)
+			{
+				clientsbyname.erase(it);
+				break;
+			}
+		}
+	}
+	// Finds a client using the simplified name, other than except, or null. Expects lock_clientnames,
+	// and the result is only valid while it's held.
+	relayserver::client * clientnames_find(const std::string &namesimplified, const relayserver::client * except) const
+	{
+		const auto range = clientsbyname.equal_range(namesimplified);
+		for (auto it = range.first; it != range.second; ++it)
+			if (it->second != except && !it->second->_readonly)
+				return it->second;
+		return nullptr;
+	}
+
+	// Same channels as above, indexed by simplified name and by ID, so join and close requests don't
+	// have to search the channel list. Guarded by lock_channellist, same as channels.
+	std::unordered_map<std::string, std::shared_ptr<relayserver::channel>> channelsbyname;
+	std::unordered_map<lw_ui16, std::shared_ptr<relayserver::channel>> channelsbyid;
+	// Index of each channel in channels, by channel ID, so it can be erased without a search
+	std::unordered_map<lw_ui16, size_t> channelsindex;
+
+	// Adds channel to server's channel list, if it's not already on it. Expects lock_channellist write lock.
+	void channellist_add(std::shared_ptr<relayserver::channel> channel)
+	{
+		if (!channelsbyid.emplace(channel->_id, channel).second)
+			return;
+		channelsindex.emplace(channel->_id, channels.size());
+		channels.push_back(channel);
+		channelsbyname.emplace(channel->_namesimplified, channel);
+	}
+	// Drops channel from server's channel list, if it's on it. Expects lock_channellist write lock.
+	void channellist_erase(std::shared_ptr<relayserver::channel> channel)
+	{
+		const auto idIt = channelsbyid.find(channel->_id);
+		if (idIt == channelsbyid.end() || idIt->second != channel)
+			return;
+		channelsbyid.erase(idIt);
+
+		const auto nameIt = channelsbyname.find(channel->_namesimplified);
+		if (nameIt != channelsbyname.end() && nameIt->second == channel)
+			channelsbyname.erase(nameIt);
+
+		// Swap with last rather than erase in place, so closing a channel doesn't shift the rest
+		const auto indexIt = channelsindex.find(channel->_id);
+		const size_t index = indexIt->second;
+		channelsindex.erase(indexIt);
+		if (index != channels.size() - 1)
+		{
+			channels[index] = std::move(channels.back());
+			channelsindex[channels[index]->_id] = index;
+		}
+		channels.pop_back();
+	}
+
 	bool channellistingenabled;
 
 	long tcpPingMS;
@@ -173,8 +453,94 @@ struct relayserverinternal
 	long udpKeepAliveMS;
 	long maxInactivityMS;
 
+	// How often the ping timer ticks; clients are checked on the first tick after they're due.
+	static constexpr long pingTickMS = 250;
+
+	// Each client is in here once, keyed on when pingtimertick next needs to look at it. Guarded by lock_pingwheel.
+	std::mutex lock_pingwheel;
+	TimerWheel<std::weak_ptr<relayserver::client>> pingwheel;
+	// Reused by pingtimertick, only touched by the ping timer
+	std::vector<std::weak_ptr<relayserver::client>> pingdue;
+
+	// Adds a client to the ping wheel, due at its next ping, keep-alive or inactivity deadline.
+	void pingwheel_schedule(const std::shared_ptr<relayserver::client> &client, std::chrono::steady_clock::time_point currentTime)
+	{
+		using namespace std::chrono;
+		steady_clock::time_point due;
+		if (!client->connectRequestApproved)
+			due = client->lasttcpmessagetime + milliseconds(maxNoConnectApprovedMS);
+		else if (!client->pongedOnTCP)
+			due = currentTime + milliseconds(tcpPingMS); // ping sent, check for the reply
+		else
+		{
+			due = client->lasttcpmessagetime + milliseconds(tcpPingMS);
+			if (!client->pseudoUDP)
+				due = std::min(due, client->lastudpmessagetime + milliseconds(udpKeepAliveMS));
+			due = std::min(due, client->lastchannelorpeermessagetime + milliseconds(maxInactivityMS));
+
+			// Already overdue, e.g. keep-alive was just sent but the client doesn't reply to it;
+			// check again a ping period later, same as when every client was checked on each tick
+			if (due <= currentTime)
+				due = currentTime + milliseconds(tcpPingMS);
+		}
+
+		std::lock_guard<std::mutex> pingWheelLock(lock_pingwheel);
+		pingwheel.insert(client, due);
+	}
+
 	long actionThreadMS;
-	std::size_t numActionsPerTick;
+	long actionBacklogMS;
+	long actionTickBudgetMS;
+	// Set if the last action tick ran out of time, and the timer is on actionBacklogMS
+	bool actionBacklogged;
+
+	// Outbound queue limits per client, in bytes and in messages; 0 for no limit. See relayserver::setoutboundlimits.
+	std::atomic<std::size_t> outboundBlastDropBytes;
+	std::atomic<std::size_t> outboundDisconnectBytes;
+	std::atomic<std::size_t> outboundBlastDropMessages;
+	std::atomic<std::size_t> outboundDisconnectMessages;
+
+	// IDs of clients past a disconnect limit. They can't be closed while the sender
+	// is looping a client list, so the action timer kicks them.
+	std::mutex lock_outboundoverlimit;
+	std::vector<lw_ui16> outboundOverLimitIDs;
+
+	void kickoutboundoverlimit()
+	{
+		std::vector<lw_ui16> ids;
+		{
+			std::lock_guard<std::mutex> overLimitLock(lock_outboundoverlimit);
+			if (outboundOverLimitIDs.empty())
+				return;
+			ids.swap(outboundOverLimitIDs);
+		}
+
+		for (const lw_ui16 id : ids)
+		{
+			auto serverClientListReadLock = server.lock_clientlist.createReadLock();
+			const std::shared_ptr<relayserver::client> client = clientbyid(id);
+			serverClientListReadLock.lw_unlock();
+
+			// ID was freed and reused since
+			if (!client || !client->_outboundoverlimit)
+				continue;
+
+			auto clientWriteLock = client->lock.createWriteLock();
+			if (!client->socket->valid())
+				continue;
+
+			auto error = lacewing::error_new();
+			const relayserver::client::outboundqueue &q = *client->outbound;
+			error->add("Disconnecting client ID %hu, as it isn't reading its messages; its outbound queue went past "
+				"the disconnect limit, with %zu bytes in %zu messages queued.", client->_id,
+				(size_t)(q.pendingBytes + q.socketQueuedBytes), (size_t)(q.pendingMessages + q.socketQueuedMessages));
+			handlererror(this->server, error);
+			lacewing::error_delete(error);
+
+			// Close immediately, as a graceful close would wait on the queue draining
+			client->socket->close(lw_true);
+		}
+	}
 
 	/// <summary> Lacewing timer function for pinging and inactivity tests. </summary>
 	///	<remarks> There are three things this function does:
@@ -189,9 +555,20 @@ struct relayserverinternal
 	///				 within a period of maxInactivityMS, then the client will be messaged and disconnected, and the server notified
 	///				 via error handler.
 	///				 Worth noting channel messages when there is no other peers, and serve messages when there is no server message
-	///				 handler, and channel join/leave requests as well as other messages, do not qualify as activity. </remarks>
+	///				 handler, and channel join/leave requests as well as other messages, do not qualify as activity.
+	///			  Clients are kept in pingwheel by when they're next due, so a tick only looks at the clients due then,
+	///			  rather than the whole client list. </remarks>
 	void pingtimertick()
 	{
+		std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
+		pingdue.clear();
+		{
+			std::lock_guard<std::mutex> pingWheelLock(lock_pingwheel);
+			pingwheel.advance(currentTime, pingdue);
+		}
+		if (pingdue.empty())
+			return;
+
 		std::vector<std::shared_ptr<relayserver::client>> pingUnresponsivesToDisconnect;
 		std::vector<std::shared_ptr<relayserver::client>> inactivesToDisconnects;
 
@@ -199,12 +576,12 @@ struct relayserverinternal
 		msgBuilderTCP.addheader(11, 0);			/* ping header */
 		msgBuilderUDP.addheader(11, 0, true);	/* ping header, true for UDP */
 
-		std::chrono::steady_clock::time_point currentTime = std::chrono::steady_clock::now();
-		auto serverClientListReadLock = server.lock_clientlist.createReadLock();
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-		for (const auto& client : clients)
+		for (const auto& dueClient : pingdue)
 		{
-			if (client->_readonly)
+			// Disconnected since it was scheduled; dropped from the wheel
+			const std::shared_ptr<relayserver::client> client = dueClient.lock();
+			if (!client || client->_readonly)
 				continue;
 
 			auto msElapsedTCP = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - client->lasttcpmessagetime).count();
@@ -262,7 +639,8 @@ struct relayserverinternal
 			if (msElapsedTCP >= tcpPingMS)
 			{
 				client->pongedOnTCP = false;
-				msgBuilderTCP.send(client->socket, false);
+				client->pingsenttime = currentTime;
+				client_send(*client, msgBuilderTCP, false);
 			}
 
 			// Keep UDP alive by sending a UDP message.
@@ -272,14 +650,26 @@ struct relayserverinternal
 			// enough to keep the UDP psuedo-connections open in routers... assuming, of course, that the UDP packet
 			// goes all the way to the client and thus through all the routers.
 			if (!client->socket->is_websocket() && msElapsedUDP >= udpKeepAliveMS)
+			{
+				metrics_count(true, true, msgBuilderUDP.messagetype(), msgBuilderUDP.payloadsize());
 				msgBuilderUDP.send(server.udp, client->udpaddress, false);
+			}
+		}
+		serverUDPWriteLock.lw_unlock();
+
+		// Put the due clients back in by their next deadline. Ones being disconnected below go back
+		// in too; they're skipped once read-only, and drop out when freed.
+		for (const auto& dueClient : pingdue)
+		{
+			const std::shared_ptr<relayserver::client> client = dueClient.lock();
+			if (client && !client->_readonly)
+				pingwheel_schedule(client, currentTime);
 		}
 
 		if (pingUnresponsivesToDisconnect.empty() && inactivesToDisconnects.empty())
 			return;
 
-		serverClientListReadLock.lw_unlock();
-		serverUDPWriteLock.lw_unlock();
+		auto serverClientListReadLock = server.lock_clientlist.createReadLock();
 
 		// Loop all pending ping disconnects
 		for (auto& client : pingUnresponsivesToDisconnect)
@@ -293,7 +683,7 @@ struct relayserverinternal
 			if (!serverClientListReadLock.isEnabled())
 				serverClientListReadLock.lw_relock();
 
-			if (std::find(clients.begin(), clients.end(), client) != clients.end())
+			if (clientbyid(client->_id) == client)
 			{
 				serverClientListReadLock.lw_unlock();
 				auto clientWriteLock = client->lock.createWriteLock();
@@ -338,7 +728,7 @@ struct relayserverinternal
 
 			if (!serverClientListReadLock.isEnabled())
 				serverClientListReadLock.lw_relock();
-			if (std::find(clients.begin(), clients.end(), client) != clients.end())
+			if (clientbyid(client->_id) == client)
 			{
 				serverClientListReadLock.lw_unlock();
 
@@ -367,6 +757,133 @@ struct relayserverinternal
 		}
 	}
 
+	// Clients with messages in their outbound queue, waiting for outboundflush() on the pump
+	MPSCQueue<std::weak_ptr<relayserver::client>> outboundpending;
+	std::atomic<bool> outboundflushposted = false;
+	// Posted flushes can't be taken back out of the pump, so they hold this instead of this relayserverinternal,
+	// and the destructor nulls it
+	std::shared_ptr<std::atomic<relayserverinternal *>> outboundflushtarget =
+		std::make_shared<std::atomic<relayserverinternal *>>(this);
+
+	// Queues a framed message to a client without taking its lock, so channel sends to the same
+	// clients don't serialize on client locks. The pump writes it shortly after, in order.
+	// The caller's shared_ptr keeps the client and its socket alive, and whether the socket is
+	// WebSocket is set when the socket is created, so reading it here without the client lock is safe.
+	void client_queueoutbound(const std::shared_ptr<relayserver::client> &client, sharedframe &frame)
+	{
+		const bool websocket = client->socket->is_websocket();
+		const lwp_sharedbuffer buffer = frame.get(websocket);
+		if (!buffer)
+			return;
+		metrics_count(true, false, frame.messagetype(), frame.payloadsize());
+
+		relayserver::client::outboundqueue &q = *client->outbound;
+		lwp_sharedbuffer_retain(buffer);
+		q.pendingBytes += lwp_sharedbuffer_length(buffer);
+		++q.pendingMessages;
+		q.messages.push({ buffer, sharedframe::writeflags(websocket) });
+
+		if (q.flushPending.exchange(true))
+			return;
+		outboundpending.push(client);
+		if (!outboundflushposted.exchange(true))
+			lw_pump_post((lw_pump)pump, (void *)outboundflush, new std::shared_ptr<std::atomic<relayserverinternal *>>(outboundflushtarget));
+	}
+
+	// Writes out a client's outbound queue. Expects client write lock, which also makes this the only reader
+	// of the queue. Anything written straight to the client's socket should call this first, to keep order.
+	void client_flushoutbound(relayserver::client &client)
+	{
+		relayserver::client::outboundqueue &q = *client.outbound;
+		q.flushPending = false;
+
+		// Nagle is off, so a few messages in one go are held until the last, and sent together
+		const bool corked = q.pendingMessages > 1 && !client._readonly;
+		if (corked)
+			client.socket->cork();
+
+		relayserver::client::outboundqueue::message msg;
+		while (q.messages.pop(msg))
+		{
+			q.pendingBytes -= lwp_sharedbuffer_length(msg.buffer);
+			--q.pendingMessages;
+			if (!client._readonly)
+				lwp_stream_write_shared((lw_stream)client.socket, msg.buffer, msg.flags);
+			lwp_sharedbuffer_release(msg.buffer);
+		}
+
+		if (corked)
+			client.socket->uncork();
+		if (!client._readonly)
+		{
+			q.socketQueuedBytes = client.socket->queued();
+			q.socketQueuedMessages = lwp_stream_queued_count((lw_stream)client.socket);
+		}
+	}
+
+	// Sends a message straight to a client, after anything in its outbound queue. Expects client write lock.
+	void client_send(relayserver::client &client, framebuilder &builder, bool clear = true)
+	{
+		client_flushoutbound(client);
+		metrics_count(true, false, builder.messagetype(), builder.payloadsize());
+		builder.send(client.socket, clear);
+	}
+
+	// Counters for relayserver::metricstext(), only counted while metricsEnabled is set
+	std::atomic<bool> metricsEnabled = false;
+	struct messagecounter
+	{
+		std::atomic<lw_ui64> messages = 0;
+		std::atomic<lw_ui64> bytes = 0;
+	};
+	// Indexed by [outbound][UDP][message type ID]
+	messagecounter metricsMessages[2][2][16];
+	// Ping reply times; bucket i counts replies under pingRTTBucketsMS[i], the extra last one the rest
+	static constexpr lw_ui32 pingRTTBucketsMS[] = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 };
+	std::atomic<lw_ui64> metricsPingRTT[std::size(pingRTTBucketsMS) + 1] = {};
+	std::atomic<lw_ui64> metricsPingRTTSumUS = 0;
+
+	// Counts a message sent or received; recipients is for one message sent to several at once.
+	// Bytes are the message after its header, not counting framing.
+	void metrics_count(bool outbound, bool udp, lw_ui8 type, size_t bytes, size_t recipients = 1)
+	{
+		if (!metricsEnabled.load(std::memory_order_relaxed))
+			return;
+		messagecounter &counter = metricsMessages[outbound][udp][type & 0xF];
+		counter.messages.fetch_add(recipients, std::memory_order_relaxed);
+		counter.bytes.fetch_add(bytes * recipients, std::memory_order_relaxed);
+	}
+	void metrics_countping(std::chrono::steady_clock::duration rtt)
+	{
+		if (!metricsEnabled.load(std::memory_order_relaxed))
+			return;
+		const lw_ui64 us = (lw_ui64)std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+		size_t bucket = 0;
+		while (bucket < std::size(pingRTTBucketsMS) && us >= pingRTTBucketsMS[bucket] * 1000ULL)
+			++bucket;
+		metricsPingRTT[bucket].fetch_add(1, std::memory_order_relaxed);
+		metricsPingRTTSumUS.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	static void outboundflush(std::shared_ptr<std::atomic<relayserverinternal *>> * target)
+	{
+		relayserverinternal * const internal = **target;
+		delete target;
+		if (!internal)
+			return;
+		internal->outboundflushposted = false;
+
+		std::weak_ptr<relayserver::client> pending;
+		while (internal->outboundpending.pop(pending))
+		{
+			const std::shared_ptr<relayserver::client> client = pending.lock();
+			if (!client)
+				continue;
+			auto clientWriteLock = client->lock.createWriteLock();
+			internal->client_flushoutbound(*client);
+		}
+	}
+
 	// Data for a delayed action that may interfere with disconnect processing events;
 	// not used for actions that rely on consistent client lists, e.g. channel message,
 	// as those have the channel lock to work with
@@ -386,13 +903,18 @@ struct relayserverinternal
 		std::shared_ptr<lacewing::relayserver::client> cli;
 		std::string reason;
 		lw_event event = NULL;
+		std::chrono::steady_clock::time_point queuedtime;
 	};
 
-	// handles actionqueue
-	mutable lacewing::readwritelock lock_queueaction;
 	std::thread::id actiontickerthreadid;
 
-	std::vector<action> actions;
+	// Pushed to by any thread, popped only by the action timer
+	MPSCQueue<action> actions;
+
+	// Action queue metrics; see relayserver::getactionqueuestats
+	std::atomic<lw_ui64> actionsRun = 0;
+	std::atomic<lw_ui64> actionLastWaitUS = 0;
+	std::atomic<lw_ui64> actionMaxWaitUS = 0;
 
 	// Internal usage only. Returns true if action was queued for action thread to run later. False if it should be run now, or was already run now.
 	bool queue_or_run_action(bool directCall, action::type typ, std::shared_ptr<lacewing::relayserver::channel>, std::shared_ptr<lacewing::relayserver::client>, std::string_view);
@@ -402,13 +924,37 @@ struct relayserverinternal
 		if (actiontickerthreadid == std::thread::id())
 			actiontickerthreadid = std::this_thread::get_id();
 
-		auto actionLock = lock_queueaction.createWriteLock();
-		for (std::size_t i = 0, j = std::min<std::size_t>(numActionsPerTick, actions.size()); i < j; ++i) {
-			if (queue_or_run_action(true, actions[0].typ, actions[0].ch, actions[0].cli, actions[0].reason))
+		kickoutboundoverlimit();
+
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(actionTickBudgetMS);
+		action act;
+		while (actions.pop(act))
+		{
+			const auto now = std::chrono::steady_clock::now();
+			const lw_ui64 waitUS = (lw_ui64)std::chrono::duration_cast<std::chrono::microseconds>(now - act.queuedtime).count();
+			actionLastWaitUS = waitUS;
+			if (waitUS > actionMaxWaitUS)
+				actionMaxWaitUS = waitUS;
+
+			if (queue_or_run_action(true, act.typ, act.ch, act.cli, act.reason))
 				assert(1 == 0);
-			if (actions[0].event)
-				lw_event_signal(actions[0].event);
-			actions.erase(actions.cbegin());
+			if (act.event)
+				lw_event_signal(act.event);
+			++actionsRun;
+
+			// Drop our refs now, rather than holding them until the next pop
+			act = action();
+
+			if (now >= deadline)
+				break;
+		}
+
+		// Tick faster while there's a backlog. Unhost stops the timer, so leave it stopped.
+		const bool backlogged = !actions.empty();
+		if (backlogged != actionBacklogged && actiontimer->started())
+		{
+			actionBacklogged = backlogged;
+			actiontimer->start(backlogged ? actionBacklogMS : actionThreadMS);
 		}
 	}
 
@@ -467,69 +1013,73 @@ void relayserverinternal::generic_handlerudpreceive(lacewing::udp udp, lacewing:
 	data.remove_prefix(sizeof(type) + sizeof(id));
 
 	auto serverClientListReadLock = server.lock_clientlist.createReadLock();
-	for (const auto& clientsocket : clients)
+	const std::shared_ptr<relayserver::client> clientsocket = clientbyid(id);
+	serverClientListReadLock.lw_unlock();
+
+	if (clientsocket)
 	{
-		if (clientsocket->_id == id)
+		// Pay close attention to this * here. You can do
+		// lacewing::address == lacewing::_address, but
+		// not any other combo.
+		if (*clientsocket->udpaddress != address)
 		{
-			serverClientListReadLock.lw_unlock();
-			// Pay close attention to this * here. You can do
-			// lacewing::address == lacewing::_address, but
-			// not any other combo.
-			if (*clientsocket->udpaddress != address)
-			{
-				// A client ID was used by the wrong IP... hack attempt?
-				// Can occasionally occur during legitimate disconnects, but rarely (?)
+			// A client ID was used by the wrong IP... hack attempt?
+			// Can occasionally occur during legitimate disconnects, but rarely (?)
 #if false
 
-				// faulty clients can use ID 0xFFFF and 0x0000
-
-				auto rl = lock.createReadLock();
+			// faulty clients can use ID 0xFFFF and 0x0000
 
-				std::shared_ptr<relayserver::client> realSender = nullptr;
-				for (const auto& cs : clients)
-				{
-					if (*cs->udpaddress == address)
-					{
-						realSender = cs;
-						break;
-					}
-				}
+			auto rl = lock.createReadLock();
 
-				error error = error_new();
-				error->add("Received a UDP message (supposedly) from Client ID %i, but message doesn't have that client's IP. ", id);
-				if (realSender)
+			std::shared_ptr<relayserver::client> realSender = nullptr;
+			for (const auto& cs : clients)
+			{
+				if (*cs->udpaddress == address)
 				{
-					error->add("Message ACTUALLY originated from client ID %i, on IP %s. Disconnecting client for impersonation attempt. ",
-						realSender->id, realSender->address);
-					realSender->socket->close();
+					realSender = cs;
+					break;
 				}
-				error->add("Dropping message");
-				handlerudperror(udp, error);
-				error_delete(error);
-#endif
-				return;
 			}
 
-			if (clientsocket->pseudoUDP)
+			error error = error_new();
+			error->add("Received a UDP message (supposedly) from Client ID %i, but message doesn't have that client's IP. ", id);
+			if (realSender)
 			{
-				// A client ID is set to only have "fake UDP" but used real UDP.
-				// Pseudo setting is wrong, which means server didn't init client properly, not good.
-				lacewing::error error = lacewing::error_new();
-				error->add("Client ID %i is set to pseudo-UDP, but received a real UDP packet"
-					" on matching address. Correcting pseudo-UDP; please check your config.", id);
-				lacewing::handlerudperror(udp, error);
-				lacewing::error_delete(error);
-				clientsocket->pseudoUDP = false;
+				error->add("Message ACTUALLY originated from client ID %i, on IP %s. Disconnecting client for impersonation attempt. ",
+					realSender->id, realSender->address);
+				realSender->socket->close();
 			}
+			error->add("Dropping message");
+			handlerudperror(udp, error);
+			error_delete(error);
+#endif
+			return;
+		}
 
-			clientsocket->udpaddress->port(address->port());
-			client_messagehandler(clientsocket, type, data, true);
+		if (clientsocket->pseudoUDP)
+		{
+			// A client ID is set to only have "fake UDP" but used real UDP.
+			// Pseudo setting is wrong, which means server didn't init client properly, not good.
+			lacewing::error error = lacewing::error_new();
+			error->add("Client ID %i is set to pseudo-UDP, but received a real UDP packet"
+				" on matching address. Correcting pseudo-UDP; please check your config.", id);
+			lacewing::handlerudperror(udp, error);
+			lacewing::error_delete(error);
+			clientsocket->pseudoUDP = false;
+		}
 
-			return;
+		// Senders read udpaddress holding lock_udp, not the client lock, so change it under that.
+		// This is the only thread that changes it, so it can be compared without the lock.
+		if (clientsocket->udpaddress->port() != address->port())
+		{
+			auto serverUDPWriteLock = server.lock_udp.createWriteLock();
+			clientsocket->udpaddress->port(address->port());
 		}
+		client_messagehandler(clientsocket, type, data, true);
+
+		return;
 	}
 
-	serverClientListReadLock.lw_unlock();
 #if 0
 	// http://web.archive.org/web/20020609030916/http://www.gamehigh.net/document/netdocs/docs/ping_src.htm
 
@@ -703,9 +1253,10 @@ bool relayserverinternal::tcpmessagehandler (void * tag, lw_ui8 type, const char
 {
 	auto clientPtr = ((relayserver::client *) tag);
 	auto& server = clientPtr->server;
-	auto clientIt = std::find_if(server.clients.cbegin(), server.clients.cend(),
-		[=](auto const &p) { return p.get() == clientPtr; });
-	if (clientIt == server.clients.cend())
+	auto serverClientListReadLock = server.server.lock_clientlist.createReadLock();
+	const std::shared_ptr<relayserver::client> client = server.clientbyid(clientPtr->_id);
+	serverClientListReadLock.lw_unlock();
+	if (client.get() != clientPtr)
 	{
 		lacewing::error error = lacewing::error_new();
 		error->add("Dropped TCP message, shared client ptr not found");
@@ -714,7 +1265,7 @@ bool relayserverinternal::tcpmessagehandler (void * tag, lw_ui8 type, const char
 		return false;
 	}
 
-	return clientPtr->server.client_messagehandler(*clientIt, type, std::string_view(message, size), false);
+	return clientPtr->server.client_messagehandler(client, type, std::string_view(message, size), false);
 }
 
 void serveractiontimertick(lacewing::timer timer)
@@ -798,10 +1349,11 @@ void relayserver::client::PeerToPeer(relayserver &server, std::shared_ptr<relays
 	if (blasted && !receivingClient->pseudoUDP)
 	{
 		auto serverUDPWriteLock = server.lock_udp.createWriteLock();
+		serverinternal.metrics_count(true, true, builder.messagetype(), builder.payloadsize());
 		builder.send(server.udp, receivingClient->udpaddress);
 	}
-	else
-		builder.send(receivingClient->socket);
+	else if (receivingClient->outboundallowed(blasted))
+		serverinternal.client_send(*receivingClient, builder);
 }
 
 
@@ -881,56 +1433,26 @@ void handlerreceive(lacewing::server server, lacewing::server_client clientsocke
 
 void relayserverinternal::generic_handlerconnect(lacewing::server server, lacewing::server_client clientsocket)
 {
-	// Check num of pending/active connections. Pending connections may not be in RelayServer's list.
-	size_t numMatchIPTotal = 0U, numMatchIPFullyConnected = 0U;
-	size_t numMatchIPPending = 0U;
-	const char * bootReason = nullptr;
-	for (auto c = server->client_first(); c; c = c->next())
-	{
-		if (c == clientsocket)
-			continue;
-
-		if (c->address() == clientsocket->address())
-		{
-			++numMatchIPTotal;
-			if (numTotalClientsPerIP < numMatchIPTotal)
-			{
-				bootReason = "";
-				break;
-			}
-
-			// Client fully established connection
-			if (c->tag() != nullptr &&
-				((relayserver::client *)c->tag())->connectRequestApproved)
-			{
-				++numMatchIPFullyConnected;
-			}
-			else
-			{
-				++numMatchIPPending;
-				if (numPendingConnectsPerIP < numMatchIPPending)
-				{
-					bootReason = "pending ";
-					break;
-				}
-			}
-		}
-	}
-
-	if (bootReason)
+	// Check num of pending/active connections from this IP, and the connect rate
+	if (const char * bootReason = ipcount_admit(clientsocket->address()->toin6_addr()))
 	{
 		clientsocket->writef("Too many %sconnections from your IP.", bootReason);
 		clientsocket->close();
 		return;
 	}
 
+	// Replies are small and mostly one at a time, so don't hold them back waiting for an ACK
+	clientsocket->nagle(false);
+
 	// Add client to server's client list
 	auto newClient = std::make_shared<relayserver::client>(*this, clientsocket);
+	newClient->ipcounted = relayserver::client::ipcountstate::pending;
 	lw_server_client_set_relay_tag((lw_server_client)clientsocket, newClient.get());
 	{
 		auto serverClientListWriteLock = this->server.lock_clientlist.createWriteLock();
-		this->clients.push_back(newClient);
+		clientlist_add(newClient);
 	}
+	pingwheel_schedule(newClient, std::chrono::steady_clock::now());
 
 	// Do not call handlerconnect on relayserverinternal.
 	// That will be called when we get a Connect Request message, in Lacewing style.
@@ -953,6 +1475,8 @@ void relayserverinternal::generic_handlerdisconnect(lacewing::server server, lac
 		return;
 	}
 
+	ipcount_remove(*client);
+
 	// Find shared pointer.
 	lacewing::writelock cliWriteLock = client->lock.createWriteLock();
 	client->_readonly = true;
@@ -977,7 +1501,7 @@ void relayserverinternal::generic_handlerdisconnect(lacewing::server server, lac
 	{
 		// We want count of clients to be accurate for the ondisconnect handler.
 		// Note close_client() will also remove it, if it's the else block.
-		clients.erase(clientIt);
+		clientlist_erase(clientIt);
 		serverClientListWriteLock.lw_unlock();
 
 		handlerdisconnect(this->server, clientShd);
@@ -1230,6 +1754,17 @@ void handlerwebserverget(lacewing::webserver webserver, lacewing::webserver_requ
 	relayserverinternal& internal = *(relayserverinternal*)webserver->tag();
 	std::string error;
 
+	// Metrics scrape; answered before the WebSocket checks, so it's not reported as a bad connection
+	if (internal.metricsEnabled && !strcasecmp(req->url(), "metrics"))
+	{
+		const std::string metrics = internal.server.metricstext();
+		req->set_mimetype("text/plain; version=0.0.4", "UTF-8");
+		req->disable_cache();
+		req->write(metrics.data(), metrics.size());
+		req->finish();
+		return;
+	}
+
 	// According to spec Connection must only *include* Upgrade.
 	// Firefox sends Keep-Alive as well, for some reason.
 	if (strstr(req->header("Connection"), "Upgrade") != NULL)
@@ -1388,15 +1923,17 @@ relayserver::relayserver(lacewing::pump pump) noexcept :
 	websocket->on_websocket_message (lacewing::handlerwebsocketmessage);
 	websocket->on_disconnect (lacewing::handlerwebserverdisconnect);
 
+	lock_meta.setprofilename("relayserver::lock_meta");
+	lock_channellist.setprofilename("relayserver::lock_channellist");
+	lock_clientlist.setprofilename("relayserver::lock_clientlist");
+	lock_udp.setprofilename("relayserver::lock_udp");
+
 	auto s = new relayserverinternal(*this, pump);
 	internaltag = s;
 	socket->tag(s);
 	websocket->tag(s);
 	udp->tag(s);
 	flash->tag(s);
-
-	// TODO: Disable Nagle here, but nothing in 0.5.4 to match?
- //   socket->nagle ();
 }
 
 relayserver::~relayserver() noexcept
@@ -1457,7 +1994,7 @@ void relayserver::host(lacewing::filter &_filter)
 	lacewing::filter_delete(filter);
 
 	relayserverinternal * serverInternal = (relayserverinternal *)internaltag;
-	serverInternal->pingtimer->start(serverInternal->tcpPingMS);
+	serverInternal->pingtimer->start(relayserverinternal::pingTickMS);
 	serverInternal->actiontimer->start(serverInternal->actionThreadMS);
 }
 
@@ -1478,7 +2015,7 @@ void relayserver::host_websocket(lw_ui16 portNonSecure, lw_ui16 portSecure)
 	}
 
 	relayserverinternal* serverInternal = (relayserverinternal*)internaltag;
-	serverInternal->pingtimer->start(serverInternal->tcpPingMS);
+	serverInternal->pingtimer->start(relayserverinternal::pingTickMS);
 	serverInternal->actiontimer->start(serverInternal->actionThreadMS);
 }
 void relayserver::host_websocket(lacewing::filter& filterNonSecure, lacewing::filter& filterSecure)
@@ -1498,7 +2035,7 @@ void relayserver::host_websocket(lacewing::filter& filterNonSecure, lacewing::fi
 	}
 
 	relayserverinternal* serverInternal = (relayserverinternal*)internaltag;
-	serverInternal->pingtimer->start(serverInternal->tcpPingMS);
+	serverInternal->pingtimer->start(relayserverinternal::pingTickMS);
 	serverInternal->actiontimer->start(serverInternal->actionThreadMS);
 }
 
@@ -1636,16 +2173,7 @@ void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> ch
 	// Remove the channel from server's list (if it exists)
 	{
 		auto serverChannelListWriteLock = server.lock_channellist.createWriteLock();
-		for (auto e3 = channels.begin(); e3 != channels.end(); e3++)
-		{
-			if (*e3 == channel)
-			{
-				// LW_ESCALATION_NOTE
-				// auto serverChannelListWriteLock = serverChannelListReadLock.lw_upgrade();
-				channels.erase(e3);
-				break;
-			}
-		}
+		channellist_erase(channel);
 	}
 
 	// Message and remove channel from all clients
@@ -1662,7 +2190,7 @@ void relayserverinternal::close_channel(std::shared_ptr<relayserver::channel> ch
 			auto cli = channel->clients[0];
 			auto cliWriteLock = cli->lock.createWriteLock();
 			if (!cli->_readonly)
-				builder.send(cli->socket, false);
+				client_send(*cli, builder, false);
 
 			// Go through client's channel list and remove this channel
 			for (auto cliJoinedCh = cli->channels.begin(); cliJoinedCh != cli->channels.end(); cliJoinedCh++)
@@ -1712,7 +2240,7 @@ void relayserverinternal::close_client (std::shared_ptr<lacewing::relayserver::c
 		{
 			// LW_ESCALATION_NOTE
 			// auto serverClientListWriteLock = serverClientListReadLock.lw_upgrade();
-			clients.erase(cli);
+			clientlist_erase(cli);
 			break;
 		}
 	}
@@ -1772,7 +2300,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 	{
 		// LW_ESCALATION_NOTE
 		// auto joiningCliWriteLock = joiningClientReadLock.lw_upgrade();
-		builder.send(client->socket); // Send list of peers to joining client
+		client_send(*client, builder); // Send list of peers to joining client
 		// LW_ESCALATION_NOTE
 		// joiningCliWriteLock.lw_downgrade_to(joiningClientReadLock);
 	}
@@ -1802,7 +2330,7 @@ void relayserverinternal::channel_addclient(std::shared_ptr<relayserver::channel
 			auto peerWriteLock = cli->lock.createWriteLock();
 
 			if (!cli->_readonly)
-				builder.send(cli->socket, false);
+				client_send(*cli, builder, false);
 		}
 	}
 
@@ -1829,21 +2357,17 @@ bool relayserverinternal::queue_or_run_action(bool wasDequeued, action::type act
 	// In single-threaded server scenarios, this will be true on main thread.
 	if (!isactiontimerthread())
 	{
-		auto aqWriteLock = lock_queueaction.createWriteLock();
 		// If unhosting, set up for blocking wait
 		lw_event evt = NULL;
 		if (act == action::type::unhost)
 			evt = lw_event_new();
 
-		actions.push_back(action{ act, ch, cli, std::string(reason), evt });
+		actions.push(action{ act, ch, cli, std::string(reason), evt, std::chrono::steady_clock::now() });
 
 		// We're unhosting; this is a blocking call, so we pause and wait for action applying thread to shut down everything.
 		// We don't want the main thread starting to read and write like usual and fight with action thread.
 		if (evt && actiontimer->started())
-		{
-			aqWriteLock.lw_unlock();
 			lw_event_wait(evt, -1);
-		}
 		return true;
 	}
 
@@ -1956,7 +2480,7 @@ void relayserverinternal::channel_removeclient(std::shared_ptr<relayserver::chan
 			builder.add <lw_ui8>(1);			 /* success */
 			builder.add <lw_ui16>(channel->_id); /* channel ID */
 
-			builder.send(client->socket);
+			client_send(*client, builder);
 
 			builder.framereset();
 
@@ -1993,7 +2517,7 @@ void relayserverinternal::channel_removeclient(std::shared_ptr<relayserver::chan
 	{
 		auto joinedCliWriteLock = joinedCli->lock.createWriteLock();
 		if (!joinedCli->_readonly)
-			builder.send(joinedCli->socket, false);
+			client_send(*joinedCli, builder, false);
 	}
 
 	builder.framereset();
@@ -2023,7 +2547,7 @@ bool relayserver::client::checkname(std::string_view name)
 
 		// LW_ESCALATION_NOTE
 		// auto cliWriteLock = cliReadLock.lw_upgrade();
-		builder.send(socket);
+		server.client_send(*this, builder);
 
 		return false;
 	}
@@ -2058,51 +2582,36 @@ bool relayserver::client::checkname(std::string_view name)
 
 		// LW_ESCALATION_NOTE
 		// auto srvCliWriteLock = srvCliReadLock.lw_upgrade();
-		builder.send(socket);
+		server.client_send(*this, builder);
 		return false;
 	}
 
 	const std::string nameSimplified = lw_u8str_simplify(name);
-	auto serverClientListReadLock = server.server.lock_clientlist.createReadLock();
-
-	// const auto breaks on Unix - the lock doesn't destruct
-	for (auto& e2 : server.clients)
+	bool nameTaken;
 	{
-		if (e2->_readonly)
-			continue;
-
-		// Client is this one, don't check if it's already in use
-		// OR other client has no name
-
-		// LW_ESCALATION_NOTE
-		// auto srvCliReadLock = e2->lock.createReadLock();
-		lacewing::readlock srvCliReadLock = e2->lock.createReadLock();
-		if (e2.get() == this || e2->_readonly || e2->_name.empty())
-			continue;
-
 		// Note: case insensitive.
-		// Due to self being skipped above, a client is still allowed to rename
+		// Self is skipped, so a client is still allowed to rename
 		// to a different capitalisation of its current name.
-		if (lw_sv_cmp(e2->_namesimplified, nameSimplified))
-		{
-			srvCliReadLock.lw_unlock();
-			framebuilder builder(true);
+		std::lock_guard<std::mutex> clientNamesLock(server.lock_clientnames);
+		nameTaken = server.clientnames_find(nameSimplified, this) != nullptr;
+	}
 
-			builder.addheader (0, 0);  /* response */
-			builder.add <lw_ui8> (1);  /* setname */
-			builder.add <lw_ui8> (0);  /* failed */
+	if (nameTaken)
+	{
+		framebuilder builder(true);
 
-			builder.add <lw_ui8> ((lw_ui8)name.size());
-			builder.add (name);
+		builder.addheader (0, 0);  /* response */
+		builder.add <lw_ui8> (1);  /* setname */
+		builder.add <lw_ui8> (0);  /* failed */
 
-			builder.add ("name already taken"sv);
+		builder.add <lw_ui8> ((lw_ui8)name.size());
+		builder.add (name);
 
-			// LW_ESCALATION_NOTE
-			// auto srvCliWriteLock = srvCliReadLock.lw_upgrade();
-			builder.send(socket);
+		builder.add ("name already taken"sv);
 
-			return false;
-		}
+		server.client_send(*this, builder);
+
+		return false;
 	}
 
 	return true;
@@ -2114,6 +2623,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 
 	lw_ui8 messagetypeid = (lw_ui8)(type >> 4);
 	lw_ui8 variant		 = (type & 0xF);
+	metrics_count(false, blasted, messagetypeid, messageP.size());
 
 	messagereader reader (messageP.data(), messageP.size());
 	framebuilder builder(true);
@@ -2227,7 +2737,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 						cliReadLock.lw_unlock();
 						auto cliWriteLock = client->lock.createWriteLock();
 
-						builder.send(client->socket);
+						client_send(*client, builder);
 
 						reader.failed = true;
 						errStr << "Version mismatch in connect request"sv;
@@ -2319,14 +2829,11 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					const std::string channelnamesimplified = lw_u8str_simplify(channelnametrimmed);
 					std::shared_ptr<relayserver::channel> channel;
 
-					//auto cliReadLock = client->lock.createReadLock();
-					for (const auto& e : channels)
 					{
-						if (lw_sv_cmp (e->_namesimplified, channelnamesimplified))
-						{
-							channel = e;
-							break;
-						}
+						auto serverChannelListReadLock = server.lock_channellist.createReadLock();
+						const auto channelIt = channelsbyname.find(channelnamesimplified);
+						if (channelIt != channelsbyname.end())
+							channel = channelIt->second;
 					}
 					cliReadLock.lw_unlock();
 
@@ -2396,7 +2903,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 						builder.add("Channel ID is not in your client's joined channel list."sv);
 
 						auto cliWriteLock = client->lock.createWriteLock();
-						builder.send(client->socket);
+						client_send(*client, builder);
 
 						break;
 					}
@@ -2425,7 +2932,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 						{
 							auto cliWriteLock = client->lock.createWriteLock();
 							if (!client->_readonly)
-								builder.send(client->socket);
+								client_send(*client, builder);
 						}
 
 						break;
@@ -2450,7 +2957,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 					{
 						auto cliWriteLock = client->lock.createWriteLock();
 						if (!client->_readonly)
-							builder.send(client->socket);
+							client_send(*client, builder);
 					}
 
 					break;
@@ -2660,6 +3167,7 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 			client->pseudoUDP = false;
 
 			builder.addheader (10, 0, true); /* udpwelcome */
+			metrics_count(true, true, builder.messagetype(), builder.payloadsize());
 			builder.send	  (server.udp, client->udpaddress);
 
 			break;
@@ -2670,7 +3178,11 @@ bool relayserverinternal::client_messagehandler(std::shared_ptr<relayserver::cli
 
 		case 9: /* ping */
 			if (!blasted)
+			{
+				if (!client->pongedOnTCP)
+					metrics_countping(::std::chrono::steady_clock::now() - client->pingsenttime);
 				client->pongedOnTCP = true;
+			}
 			break;
 
 		case 10: /* implementation response */
@@ -2784,8 +3296,8 @@ void relayserver::client::send(lw_ui8 subchannel, std::string_view message, lw_u
 	builder.add (message);
 
 	auto clientWriteLock = lock.createWriteLock();
-	if (!_readonly)
-		builder.send (socket);
+	if (!_readonly && outboundallowed(false))
+		server.client_send(*this, builder);
 }
 
 void relayserver::client::blast(lw_ui8 subchannel, std::string_view message, lw_ui8 variant)
@@ -2797,13 +3309,19 @@ void relayserver::client::blast(lw_ui8 subchannel, std::string_view message, lw_
 	builder.add (message);
 
 	auto serverUDPWriteLock = server.server.lock_udp.createWriteLock();
-	auto clientReadLock = lock.createReadLock();
+	auto clientWriteLock = lock.createWriteLock();
 	if (!_readonly)
 	{
 		if (pseudoUDP)
-			builder.send(this->socket);
+		{
+			if (outboundallowed(true))
+				server.client_send(*this, builder);
+		}
 		else
+		{
+			server.metrics_count(true, true, builder.messagetype(), builder.payloadsize());
 			builder.send(server.server.udp, udpaddress);
+		}
 	}
 }
 
@@ -2820,15 +3338,12 @@ void relayserver::channel::send(lw_ui8 subchannel, std::string_view message, lw_
 	if (_readonly)
 		return;
 
+	// Queued to each client without taking its lock; see relayserverinternal::client_queueoutbound
+	sharedframe frame(builder);
 	for (const auto& e : clients)
 	{
-		// Can have a deadlock where ping timer has client lock and is waiting on channel lock,
-		// so check for readonly before locking
-		if (e->_readonly)
-			continue;
-		auto clientWriteLock = e->lock.createWriteLock();
-		if (!e->_readonly)
-			builder.send(e->socket, false);
+		if (!e->_readonly && e->outboundallowed(false))
+			server.client_queueoutbound(e, frame);
 	}
 }
 
@@ -2845,40 +3360,50 @@ void relayserver::channel::blast(lw_ui8 subchannel, std::string_view message, lw
 	if (_readonly)
 		return;
 
+	// UDP recipients are collected and sent in one batch; the list is kept per thread
+	// so blasting doesn't allocate once it's grown
+	static thread_local std::vector<lacewing::address> udpaddresses;
+	udpaddresses.clear();
+
 	auto serverClientListReadLock = server.server.lock_clientlist.createReadLock();
-	for (const auto& e : clients)
+	// For the shared lw_udp socket, and for reading the recipients' udpaddress
+	auto serverUDPWriteLock = server.server.lock_udp.createWriteLock();
 	{
-		// Can have a deadlock where ping timer has client lock and is waiting on channel lock,
-		// so check for readonly before locking
-		if (e->_readonly)
-			continue;
-		auto clientWriteLock = e->lock.createWriteLock();
-		if (!e->_readonly)
+		// WebSocket clients get the frame as TCP; it's framed once on first use
+		sharedframe frame(builder);
+		for (const auto& e : clients)
 		{
-			if (e->socket->is_websocket())
-			{
-				builder.send(e->socket, false);
-				builder.revert();
-			}
-			else
-				builder.send(server.server.udp, e->udpaddress, false);
+			if (e->_readonly)
+				continue;
+			if (!e->socket->is_websocket())
+				udpaddresses.push_back(e->udpaddress);
+			else if (e->outboundallowed(true))
+				server.client_queueoutbound(e, frame);
 		}
 	}
+
+	if (!udpaddresses.empty())
+	{
+		// Undo the WebSocket header written over the UDP one, if any
+		builder.revert();
+		server.metrics_count(true, true, builder.messagetype(), builder.payloadsize(), udpaddresses.size());
+		builder.send(server.server.udp, udpaddresses.data(), udpaddresses.size(), false);
+	}
 }
 
 /// <summary> Throw all clients off this channel, sending Leave Request Success. </summary>
 void relayserver::channel::close()
 {
 	auto serverChannelListReadLock = server.server.lock_channellist.createReadLock();
-	auto ch = std::find_if(server.channels.begin(), server.channels.end(),
-		[=](const auto &p) { return p.get() == this; });
+	const auto chIt = server.channelsbyid.find(_id);
 
 	// Assume channel is already closed, as it's not on server channel list.
-	if (ch == server.channels.end())
+	if (chIt == server.channelsbyid.end() || chIt->second.get() != this)
 		return;
 
+	const std::shared_ptr<relayserver::channel> ch = chIt->second;
 	serverChannelListReadLock.lw_unlock();
-	server.close_channel(*ch);
+	server.close_channel(ch);
 }
 
 relayserver::client::client(relayserverinternal &internal, lacewing::server_client _socket) noexcept
@@ -2887,6 +3412,8 @@ relayserver::client::client(relayserverinternal &internal, lacewing::server_clie
 {
 	//public_.internaltag = this;
 	tag = 0;
+	lock.setprofilename("relayserver::client::lock");
+	outbound = std::make_unique<outboundqueue>();
 	address = socket->address()->tostring();
 	addressInt = socket->address()->toin6_addr();
 
@@ -2911,6 +3438,7 @@ relayserver::client::client(relayserverinternal &internal, lacewing::server_clie
 	server(_server), _name(_name), _namesimplified(lw_u8str_simplify(_name))
 {
 	_id = server.channelids.borrow();
+	lock.setprofilename("relayserver::channel::lock");
 }
 
 relayserver::channel::~channel() noexcept
@@ -2975,8 +3503,21 @@ void relayserver::channel::name(std::string_view name)
 	if (_readonly)
 		return;
 	lacewing::writelock wl = lock.createWriteLock();
+	std::string namesimplified = lw_u8str_simplify(name);
+
+	// Keep server's channel name index in step, if the channel is listed already
+	lacewing::writelock serverChannelListWriteLock = server.server.lock_channellist.createWriteLock();
+	const auto chIt = server.channelsbyid.find(_id);
+	if (chIt != server.channelsbyid.end() && chIt->second.get() == this)
+	{
+		const auto nameIt = server.channelsbyname.find(_namesimplified);
+		if (nameIt != server.channelsbyname.end() && nameIt->second.get() == this)
+			server.channelsbyname.erase(nameIt);
+		server.channelsbyname.emplace(namesimplified, chIt->second);
+	}
+
 	_name = name;
-	_namesimplified = lw_u8str_simplify(name);
+	_namesimplified = std::move(namesimplified);
 }
 
 bool relayserver::channel::hidden() const
@@ -3034,12 +3575,10 @@ void relayserver::client::disconnect(std::shared_ptr<relayserver::client> cli, i
 
 	if (cli == nullptr && !server.isactiontimerthread())
 	{
-		const auto readLock = server.server.lock_clientlist.createReadLock();
-		const auto cliIt = std::find_if(server.clients.cbegin(), server.clients.cend(), [=](auto a) {
-			return this == &*cli;
-		});
-		assert(cliIt != server.clients.cend());
-		cli = *cliIt;
+		auto readLock = server.server.lock_clientlist.createReadLock();
+		cli = server.clientbyid(_id);
+		readLock.lw_unlock();
+		assert(cli.get() == this);
 
 		if (server.queue_or_run_action(false, relayserverinternal::action::type::disconnect, nullptr, cli, std::string_view((char *)&websocketReasonCode, sizeof(int))))
 			return;
@@ -3073,7 +3612,7 @@ void relayserver::client::name(std::string_view name)
 	lacewing::writelock clientWriteLock = lock.createWriteLock();
 	_prevname = _name;
 	_name = name;
-	_namesimplified = lw_u8str_simplify(name);
+	server.clientnames_set(*this, lw_u8str_simplify(name));
 }
 
 bool relayserver::client::readonly() const
@@ -3085,6 +3624,67 @@ bool relayserver::client::istrusted() const
 	return trustedClient;
 }
 
+size_t relayserver::client::outboundqueuedbytes() const
+{
+	lacewing::readlock clientReadLock = lock.createReadLock();
+	return outbound->pendingBytes + (socket->valid() ? socket->queued() : 0);
+}
+
+size_t relayserver::client::outboundqueuedmessages() const
+{
+	lacewing::readlock clientReadLock = lock.createReadLock();
+	return outbound->pendingMessages + (socket->valid() ? lwp_stream_queued_count((lw_stream)socket) : 0);
+}
+
+lw_ui64 relayserver::client::outboundblastsdropped() const
+{
+	return _outboundblastsdropped;
+}
+
+bool relayserver::client::outboundoverlimit() const
+{
+	return _outboundoverlimit;
+}
+
+bool relayserver::client::outboundallowed(bool blasted)
+{
+	if (_outboundoverlimit)
+		return false;
+
+	const size_t blastLimit = server.outboundBlastDropBytes, disconnectLimit = server.outboundDisconnectBytes;
+	const size_t blastMessageLimit = server.outboundBlastDropMessages, disconnectMessageLimit = server.outboundDisconnectMessages;
+	if (blastLimit == 0 && disconnectLimit == 0 && blastMessageLimit == 0 && disconnectMessageLimit == 0)
+		return true;
+
+	// Callers may not hold the client lock, so use the counts kept by the outbound queue
+	const size_t queued = outbound->pendingBytes + outbound->socketQueuedBytes;
+	const size_t queuedMessages = outbound->pendingMessages + outbound->socketQueuedMessages;
+
+	if ((disconnectLimit != 0 && queued >= disconnectLimit) ||
+		(disconnectMessageLimit != 0 && queuedMessages >= disconnectMessageLimit))
+	{
+		// Stop anything else being sent or processed; the action timer does the actual kick
+		_readonly = true;
+
+		// Other senders may get here at the same time; only the first queues the kick
+		if (_outboundoverlimit.exchange(true))
+			return false;
+
+		std::lock_guard<std::mutex> overLimitLock(server.lock_outboundoverlimit);
+		server.outboundOverLimitIDs.push_back(_id);
+		return false;
+	}
+
+	if (blasted && ((blastLimit != 0 && queued >= blastLimit) ||
+		(blastMessageLimit != 0 && queuedMessages >= blastMessageLimit)))
+	{
+		++_outboundblastsdropped;
+		return false;
+	}
+
+	return true;
+}
+
 std::vector<std::shared_ptr<lacewing::relayserver::channel>> & relayserver::client::getchannels()
 {
 	lock.checkHoldsRead();
@@ -3103,6 +3703,133 @@ void relayserver::setinactivitytimer(long MS)
 	((relayserverinternal *)internaltag)->maxInactivityMS = MS;
 }
 
+relayserver::actionqueuestats relayserver::getactionqueuestats(bool resetMaxWait)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	actionqueuestats stats;
+	stats.depth = serverinternal.actions.size();
+	stats.run = serverinternal.actionsRun;
+	stats.lastwaitus = serverinternal.actionLastWaitUS;
+	stats.maxwaitus = resetMaxWait ? serverinternal.actionMaxWaitUS.exchange(0) : serverinternal.actionMaxWaitUS.load();
+	return stats;
+}
+
+void relayserver::setmetricsenabled(bool enabled)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	serverinternal.metricsEnabled = enabled;
+}
+
+std::string relayserver::metricstext()
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::stringstream str;
+
+	str << "# HELP lacewing_relay_clients Connected clients.\n"
+		"# TYPE lacewing_relay_clients gauge\n"
+		"lacewing_relay_clients " << clientcount() << "\n"
+		"# HELP lacewing_relay_channels Open channels.\n"
+		"# TYPE lacewing_relay_channels gauge\n"
+		"lacewing_relay_channels " << channelcount() << '\n';
+
+	// Message type IDs mean different things in and out; see the Lacewing Relay protocol
+	str << "# HELP lacewing_relay_messages_total Messages received and sent, by message type ID.\n"
+		"# TYPE lacewing_relay_messages_total counter\n";
+	for (int outbound = 0; outbound < 2; ++outbound)
+		for (int udp = 0; udp < 2; ++udp)
+			for (int type = 0; type < 16; ++type)
+				if (lw_ui64 messages = serverinternal.metricsMessages[outbound][udp][type].messages)
+					str << "lacewing_relay_messages_total{direction=\"" << (outbound ? "out" : "in") << "\",transport=\""
+						<< (udp ? "udp" : "tcp") << "\",type=\"" << type << "\"} " << messages << '\n';
+	str << "# HELP lacewing_relay_message_bytes_total Message bytes received and sent, excluding headers and framing.\n"
+		"# TYPE lacewing_relay_message_bytes_total counter\n";
+	for (int outbound = 0; outbound < 2; ++outbound)
+		for (int udp = 0; udp < 2; ++udp)
+			for (int type = 0; type < 16; ++type)
+				if (serverinternal.metricsMessages[outbound][udp][type].messages)
+					str << "lacewing_relay_message_bytes_total{direction=\"" << (outbound ? "out" : "in") << "\",transport=\""
+						<< (udp ? "udp" : "tcp") << "\",type=\"" << type << "\"} "
+						<< serverinternal.metricsMessages[outbound][udp][type].bytes << '\n';
+
+	const actionqueuestats actions = getactionqueuestats();
+	str << "# HELP lacewing_relay_action_queue_depth Disconnects, channel joins and such waiting to run.\n"
+		"# TYPE lacewing_relay_action_queue_depth gauge\n"
+		"lacewing_relay_action_queue_depth " << actions.depth << "\n"
+		"# HELP lacewing_relay_actions_run_total Queued actions run.\n"
+		"# TYPE lacewing_relay_actions_run_total counter\n"
+		"lacewing_relay_actions_run_total " << actions.run << "\n"
+		"# HELP lacewing_relay_action_max_wait_seconds Longest time an action has waited in the queue.\n"
+		"# TYPE lacewing_relay_action_max_wait_seconds gauge\n"
+		"lacewing_relay_action_max_wait_seconds " << actions.maxwaitus / 1e6 << '\n';
+
+	str << "# HELP lacewing_relay_ping_rtt_seconds Time for clients to reply to TCP pings.\n"
+		"# TYPE lacewing_relay_ping_rtt_seconds histogram\n";
+	lw_ui64 pings = 0;
+	for (size_t i = 0; i < std::size(serverinternal.pingRTTBucketsMS); ++i)
+	{
+		pings += serverinternal.metricsPingRTT[i];
+		str << "lacewing_relay_ping_rtt_seconds_bucket{le=\"" << serverinternal.pingRTTBucketsMS[i] / 1000.0 << "\"} " << pings << '\n';
+	}
+	pings += serverinternal.metricsPingRTT[std::size(serverinternal.pingRTTBucketsMS)];
+	str << "lacewing_relay_ping_rtt_seconds_bucket{le=\"+Inf\"} " << pings << "\n"
+		"lacewing_relay_ping_rtt_seconds_sum " << serverinternal.metricsPingRTTSumUS / 1e6 << "\n"
+		"lacewing_relay_ping_rtt_seconds_count " << pings << '\n';
+
+	// Process-wide, as lock profiling is
+	if (lacewing::readwritelock::profiling())
+	{
+		const auto locks = lacewing::readwritelock::profiletotals();
+		str << "# HELP lacewing_lock_wait_seconds_total Time spent waiting to take locks, while lock profiling is on.\n"
+			"# TYPE lacewing_lock_wait_seconds_total counter\n";
+		for (const auto &l : locks)
+			str << "lacewing_lock_wait_seconds_total{lock=\"" << (l.lockName ? l.lockName : "unnamed") << "\",mode=\""
+				<< (l.write ? "write" : "read") << "\"} " << l.waitNS / 1e9 << '\n';
+		str << "# HELP lacewing_lock_acquired_total Locks taken, while lock profiling is on.\n"
+			"# TYPE lacewing_lock_acquired_total counter\n";
+		for (const auto &l : locks)
+			str << "lacewing_lock_acquired_total{lock=\"" << (l.lockName ? l.lockName : "unnamed") << "\",mode=\""
+				<< (l.write ? "write" : "read") << "\"} " << l.count << '\n';
+	}
+
+	return str.str();
+}
+
+void relayserver::setlockprofiling(bool enabled)
+{
+	lacewing::readwritelock::setprofiling(enabled);
+}
+
+std::string relayserver::dumplockprofile(bool reset)
+{
+	return lacewing::readwritelock::profiledump(reset);
+}
+
+void relayserver::setoutboundlimits(size_t blastDropBytes, size_t disconnectBytes,
+	size_t blastDropMessages, size_t disconnectMessages)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	serverinternal.outboundBlastDropBytes = blastDropBytes;
+	serverinternal.outboundDisconnectBytes = disconnectBytes;
+	serverinternal.outboundBlastDropMessages = blastDropMessages;
+	serverinternal.outboundDisconnectMessages = disconnectMessages;
+}
+
+void relayserver::setconnectlimitsperip(size_t maxClients, size_t maxPending)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> ipCountsLock(serverinternal.lock_ipcounts);
+	serverinternal.numTotalClientsPerIP = maxClients;
+	serverinternal.numPendingConnectsPerIP = maxPending;
+}
+
+void relayserver::setconnectratelimit(double connectsPerSecond, double burst)
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	std::lock_guard<std::mutex> ipCountsLock(serverinternal.lock_ipcounts);
+	serverinternal.connectRatePerSec = connectsPerSecond;
+	serverinternal.connectRateBurst = std::max(burst, 1.0);
+}
+
 // Updates the allowlisted Unicode code point sused in text messages, channel names and peer names.
 std::string relayserver::setcodepointsallowedlist(codepointsallowlistindex type, std::string acStr) {
 	// String should be format:
@@ -3160,6 +3887,17 @@ lw_i64 relayserver::client::getconnecttime() const
 	return duration_cast<seconds>(time).count();
 }
 
+std::shared_ptr<lacewing::relayserver::client> relayserver::clientbyname(std::string_view name) const
+{
+	relayserverinternal &serverinternal = *(relayserverinternal *)internaltag;
+	const std::string nameSimplified = lw_u8str_simplify(name);
+
+	auto serverClientListReadLock = lock_clientlist.createReadLock();
+	std::lock_guard<std::mutex> clientNamesLock(serverinternal.lock_clientnames);
+	const relayserver::client * const client = serverinternal.clientnames_find(nameSimplified, nullptr);
+	return client ? serverinternal.clientbyid(client->_id) : nullptr;
+}
+
 size_t relayserver::clientcount() const
 {
 	lacewing::readlock serverClientListReadLock = lock_clientlist.createReadLock();
@@ -3171,9 +3909,19 @@ relayserver::client::~client() noexcept
 	lacewing::writelock clientWriteLock = lock.createWriteLock();
 	//lw_trace("~relayserver::client called for address %p, name %s, ID %hu\n", this, _name.c_str(), _id);
 
+	// Usually already gone with clientlist_erase, but a name set after that would be indexed again
+	{
+		std::lock_guard<std::mutex> clientNamesLock(server.lock_clientnames);
+		server.clientnames_erase(*this);
+	}
+
 	channels.clear();
 	clientImplStr.clear();
 
+	outboundqueue::message msg;
+	while (outbound->messages.pop(msg))
+		lwp_sharedbuffer_release(msg.buffer);
+
 	server.clientids.returnID(_id);
 
 	lacewing::address_delete(udpaddress);
@@ -3230,8 +3978,7 @@ std::shared_ptr<relayserver::channel> relayserver::createchannel(std::string_vie
 	else
 	{
 		lacewing::writelock serverChannelListWriteLock = lock_channellist.createWriteLock();
-		if (std::find(serverinternal.channels.cbegin(), serverinternal.channels.cend(), channel) == serverinternal.channels.cend())
-			serverinternal.channels.push_back(channel);
+		serverinternal.channellist_add(channel);
 	}
 
 	channelWriteLock.lw_unlock();
@@ -3281,7 +4028,7 @@ void relayserver::connect_response(
 		builder.add <lw_ui8>(0);  /* failed */
 		builder.add(denyReason);
 
-		builder.send(client->socket);
+		serverI.client_send(*client, builder);
 		client->disconnect(client, 1003);
 
 		//delete client;
@@ -3292,6 +4039,7 @@ void relayserver::connect_response(
 
 	lwp_trace("Connect request accepted in relayserver::connectresponse");
 	client->connectRequestApproved = true;
+	serverI.ipcount_approve(*client);
 	client->connectRequestApprovedTime = decltype(client->connectRequestApprovedTime)::clock::now();
 	client->clientImpl = relayserver::client::clientimpl::Unknown;
 
@@ -3302,7 +4050,7 @@ void relayserver::connect_response(
 	builder.add <lw_ui16>(client->_id);
 	builder.add(serverI.welcomemessage);
 
-	builder.send(client->socket);
+	serverI.client_send(*client, builder);
 
 	// Now accepted earlier
 	// serverI.clients.push_back(client);
@@ -3314,7 +4062,7 @@ void relayserver::connect_response(
 		builder.framereset();
 
 		builder.addheader(12, 0);  /* request implementation */
-		builder.send(client->socket);
+		serverI.client_send(*client, builder);
 		// response type 10. Only responded to by Bluewing Client b70+, Relay just ignores it
 	}
 }
@@ -3423,7 +4171,7 @@ void relayserver::joinchannel_response(std::shared_ptr<relayserver::channel> cha
 		builder.add <lw_ui8>((lw_ui8)channel->_name.size());
 		builder.add(channel->_name);
 		builder.add(denyReason);
-		builder.send(client->socket);
+		serverinternal.client_send(*client, builder);
 
 		// A shared pointer will be destroyed upon close?
 		lw_trace("Channel %s should be auto-destroyed...\n", channel->_name.c_str());
@@ -3436,8 +4184,7 @@ void relayserver::joinchannel_response(std::shared_ptr<relayserver::channel> cha
 	}
 
 	lacewing::writelock serverChannelListWriteLock = lock_channellist.createWriteLock();
-	if (std::find(serverinternal.channels.cbegin(), serverinternal.channels.cend(), channel) == serverinternal.channels.cend())
-		serverinternal.channels.push_back(channel);
+	serverinternal.channellist_add(channel);
 	serverChannelListWriteLock.lw_unlock();
 
 	// LW_ESCALATION_NOTE
@@ -3478,7 +4225,9 @@ void relayserver::leavechannel_response(std::shared_ptr<relayserver::channel> ch
 		// Blank reason replaced with "it was unspecified" message
 		builder.add(denyReason);
 
-		builder.send(client->socket);
+		auto clientWriteLock = client->lock.createWriteLock();
+		if (!client->_readonly)
+			serverinternal.client_send(*client, builder);
 
 		return;
 	}
@@ -3592,7 +4341,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 		// LW_ESCALATION_NOTE
 		// auto clientWriteLock = clientReadLock.lw_upgrade();
 		if (!client->_readonly)
-			builder.send(client->socket);
+			serverinternal.client_send(*client, builder);
 		return;
 	}
 
@@ -3618,7 +4367,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 			// LW_ESCALATION_NOTE
 			// auto clientWriteLock = clientReadLock.lw_upgrade();
 			if (!client->_readonly)
-				builder.send(client->socket);
+				serverinternal.client_send(*client, builder);
 		}
 
 		auto error = lacewing::error_new();
@@ -3641,7 +4390,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 	{
 		// LW_ESCALATION_NOTE
 		// auto clientWriteLock = clientReadLock.lw_upgrade();
-		builder.send(client->socket);
+		serverinternal.client_send(*client, builder);
 
 		// Should keep read lock for peer messaging
 		// LW_ESCALATION_NOTE
@@ -3671,7 +4420,7 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 
 			auto peerWriteLock = e2->lock.createWriteLock();
 			if (!e2->_readonly)
-				builder.send(e2->socket, false);
+				serverinternal.client_send(*e2, builder, false);
 		}
 
 		builder.framereset();
@@ -3681,8 +4430,9 @@ void relayserver::nameset_response(std::shared_ptr<relayserver::client> client,
 void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<relayserver::client> client,
 	bool blasted, lw_ui8 subchannel, lw_ui8 variant, std::string_view message)
 {
-	//auto channelReadLock = lock.createReadLock();
-	auto channelWriteLock = lock.createWriteLock();
+	// Read lock only; recipients are queued to without their locks, so sends to a channel don't
+	// block each other, or sends to other channels
+	auto channelReadLock = lock.createReadLock();
 
 	// Sending to no one or just self, no point
 	if (clients.size() <= 1)
@@ -3724,24 +4474,46 @@ void relayserver::channel::PeerToChannel(relayserver &server, std::shared_ptr<re
 
 	// Loop through and send message to all clients that aren't this one
 
+	relayserverinternal &serverinternal = *(relayserverinternal *)server.internaltag;
+	if (!blasted)
+	{
+		sharedframe frame(builder);
+		for (const auto& e : clients)
+		{
+			if (e != client && !e->_readonly && e->outboundallowed(false))
+				serverinternal.client_queueoutbound(e, frame);
+		}
+		return;
+	}
+
 	// Only need server write lock for shared lw_udp socket
 	auto serverUDPWriteLock = server.lock_udp.createWriteLock();
-	if (!blasted)
-		serverUDPWriteLock.lw_unlock();
 
-	for (const auto& e : clients)
+	// UDP recipients are collected and sent in one batch, see channel::blast
+	static thread_local std::vector<lacewing::address> udpaddresses;
+	udpaddresses.clear();
+
 	{
-		if (e == client)
-			continue;
+		// Pseudo-UDP clients are WebSocket, and get the frame as TCP; it's framed once on first use
+		sharedframe frame(builder);
+		for (const auto& e : clients)
+		{
+			if (e == client || e->_readonly)
+				continue;
 
-		auto cliWriteLock = e->lock.createWriteLock();
-		if (e->_readonly)
-			continue;
+			if (!e->pseudoUDP)
+				udpaddresses.push_back(e->udpaddress);
+			else if (e->outboundallowed(true))
+				serverinternal.client_queueoutbound(e, frame);
+		}
+	}
 
-		if (blasted && !e->pseudoUDP)
-			builder.send(server.udp, e->udpaddress, false);
-		else
-			builder.send(e->socket, false);
+	if (!udpaddresses.empty())
+	{
+		// Undo any TCP header written over the UDP one by the pseudo-UDP sends above
+		builder.revert();
+		serverinternal.metrics_count(true, true, builder.messagetype(), builder.payloadsize(), udpaddresses.size());
+		builder.send(server.udp, udpaddresses.data(), udpaddresses.size(), false);
 	}
 
 	builder.framereset();
@@ -0,0 +1,111 @@
+/* vim: set et ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * https://opensource.org/licenses/mit-license.php
+*/
+#include <vector>
+#include <chrono>
+
+#ifndef LacewingTimerWheel
+#define LacewingTimerWheel
+
+/// <summary> A two-level hierarchical timing wheel. Values are inserted with a due time, and
+/// 		  advance() hands back the ones that have come due, only visiting the slots passed
+/// 		  since the last advance, so the cost doesn't depend on how many values are waiting.
+/// 		  Not thread-safe; callers should lock around it. </summary>
+template<typename T>
+class TimerWheel
+{
+
+protected:
+
+	static constexpr lw_ui64 slotCount = 64;
+
+	struct entry
+	{
+		T value;
+		lw_ui64 dueTick;
+	};
+
+	std::chrono::steady_clock::time_point start;
+	std::chrono::milliseconds slotMS;
+	lw_ui64 currentTick;						// Last tick advance() has handed back.
+	std::vector<entry> near[slotCount];			// Due within slotCount ticks, one slot per tick.
+	std::vector<entry> far[slotCount];			// Due later, one slot per slotCount ticks; cascaded into near.
+	size_t count;
+
+	lw_ui64 tickof(std::chrono::steady_clock::time_point time) const
+	{
+		if (time <= start)
+			return 0;
+		return (lw_ui64)((time - start) / slotMS);
+	}
+
+	void place(entry && e)
+	{
+		const lw_ui64 delta = e.dueTick - currentTick;
+		if (delta < slotCount)
+			near[e.dueTick % slotCount].push_back(std::move(e));
+		else
+			far[(e.dueTick / slotCount) % slotCount].push_back(std::move(e));
+	}
+
+public:
+
+	/// <summary> Creates a timing wheel with the given slot length. </summary>
+	TimerWheel(std::chrono::milliseconds slotLength)
+		: start(std::chrono::steady_clock::now()), slotMS(slotLength), currentTick(0), count(0)
+	{
+	}
+
+	/// <summary> Adds a value to be handed back by advance() once due has passed. Values due
+	/// 		  past the wheel's range are handed back early, at the end of its range. </summary>
+	void insert(T value, std::chrono::steady_clock::time_point due)
+	{
+		// Round up, so the value isn't handed back before due
+		lw_ui64 dueTick = tickof(due) + 1;
+		if (dueTick <= currentTick)
+			dueTick = currentTick + 1;
+		else if (dueTick - currentTick >= slotCount * slotCount)
+			dueTick = currentTick + slotCount * slotCount - 1;
+
+		place(entry { std::move(value), dueTick });
+		++count;
+	}
+
+	/// <summary> Moves all values due by now into the given vector. </summary>
+	void advance(std::chrono::steady_clock::time_point now, std::vector<T> &due)
+	{
+		const lw_ui64 target = tickof(now);
+		while (currentTick < target)
+		{
+			++currentTick;
+
+			// Start of a new far slot; spread its values over the near slots
+			if (currentTick % slotCount == 0)
+			{
+				std::vector<entry> cascade;
+				cascade.swap(far[(currentTick / slotCount) % slotCount]);
+				for (auto &e : cascade)
+					place(std::move(e));
+			}
+
+			std::vector<entry> &slot = near[currentTick % slotCount];
+			for (auto &e : slot)
+				due.push_back(std::move(e.value));
+			count -= slot.size();
+			slot.clear();
+		}
+	}
+
+	/// <summary> Number of values waiting in the wheel. </summary>
+	size_t size() const
+	{
+		return count;
+	}
+};
+
+#endif
@@ -137,17 +137,12 @@ lw_addr lwp_addr_new_sockaddr (struct sockaddr * sockaddr)
 
 void lwp_addr_set_sockaddr (lw_addr ctx, struct sockaddr * sockaddr)
 {
-	if (!ctx->info)
-	{
-		ctx->info = ctx->info_to_free =
-			(struct addrinfo *) calloc (sizeof (*ctx->info), 1);
-	}
+	ctx->info = &ctx->info_inline;
+	ctx->info->ai_addr = (struct sockaddr *) &ctx->sockaddr_inline;
+	ctx->info->ai_next = NULL;
 
 	ctx->info->ai_family = sockaddr->sa_family;
 
-	free (ctx->info->ai_addr);
-	ctx->info->ai_addr = (struct sockaddr *) malloc (sizeof (struct sockaddr_storage));
-
 	switch (sockaddr->sa_family)
 	{
 		case AF_INET:
@@ -186,13 +181,17 @@ lw_addr lw_addr_clone (lw_addr ctx)
 		return 0;
 	}
 
-	addr->info = addr->info_to_free = (struct addrinfo *) malloc (sizeof (*addr->info));
+	addr->info = &addr->info_inline;
 	memcpy (addr->info, ctx->info, sizeof (*addr->info));
 
 	addr->info->ai_addrlen = ctx->info->ai_addrlen;
 
 	addr->info->ai_next = 0;
-	addr->info->ai_addr = (struct sockaddr *) malloc (addr->info->ai_addrlen);
+	addr->info->ai_canonname = 0;
+
+	// sockaddr_storage fits any address family
+	assert (addr->info->ai_addrlen <= sizeof (addr->sockaddr_inline));
+	addr->info->ai_addr = (struct sockaddr *) &addr->sockaddr_inline;
 
 	memcpy (addr->info->ai_addr, ctx->info->ai_addr, addr->info->ai_addrlen);
 
@@ -419,18 +418,16 @@ void lw_addr_set_port (lw_addr ctx, long port)
 	if ((!lw_addr_ready (ctx)) || !ctx->info || !ctx->info->ai_addr)
 		return;
 
-	*ctx->buffer = 0;
+	// Called with the same port for every datagram by the relay, so keep to_string cached
+	unsigned short * port_ptr = ctx->info->ai_family == AF_INET6 ?
+		&((struct sockaddr_in6 *) ctx->info->ai_addr)->sin6_port :
+		&((struct sockaddr_in *) ctx->info->ai_addr)->sin_port;
 
-	if (ctx->info->ai_family == AF_INET6)
-	{
-		((struct sockaddr_in6 *) ctx->info->ai_addr)
-			->sin6_port = htons ((unsigned short) port);
-	}
-	else
-	{
-		((struct sockaddr_in *) ctx->info->ai_addr)
-			->sin_port = htons ((unsigned short) port);
-	}
+	if (*port_ptr == htons ((unsigned short) port))
+		return;
+
+	*ctx->buffer = 0;
+	*port_ptr = htons ((unsigned short) port);
 }
 
 lw_error lw_addr_resolve (lw_addr ctx)
@@ -22,6 +22,12 @@ struct _lw_addr
 
 	struct addrinfo * info_list, * info, * info_to_free;
 
+	/* Inline storage that info points to for addresses built from a sockaddr,
+	 * so accepted clients, clones and received datagrams don't allocate.
+	 */
+	struct addrinfo info_inline;
+	struct sockaddr_storage sockaddr_inline;
+
 	lw_error error;
 
 	char buffer [64]; /* for to_string */
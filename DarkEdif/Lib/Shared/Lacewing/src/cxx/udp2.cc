@@ -55,6 +55,11 @@ void _udp::send (lacewing::address address, const char * data, size_t size)
 	lw_udp_send ((lw_udp) this, (lw_addr) address, data, size);
 }
 
+void _udp::send (lacewing::address * addresses, size_t count, const char * data, size_t size)
+{
+	lw_udp_send_batch ((lw_udp) this, (lw_addr *) addresses, count, data, size);
+}
+
 void _udp::on_data (_udp::hook_data hook)
 {
 	lw_udp_on_data ((lw_udp) this, (lw_udp_hook_data) hook);
@@ -262,7 +262,11 @@ lwp_socket lwp_create_server_socket (lw_filter filter, int type,
 	if (ipv6)
 	  lwp_disable_ipv6_only (s);
 
-	reuse = lw_filter_reuse (filter) ? 1 : 0;
+	/* Only for a fixed port. Bound to port 0, SO_REUSEADDR lets Linux hand out an ephemeral UDP
+	 * port that another SO_REUSEADDR socket already has, and the datagrams for one then go to the
+	 * other; with a few hundred relay clients in a process, some never get their UDP welcome.
+	 */
+	reuse = lw_filter_reuse (filter) && lw_filter_local_port (filter) ? 1 : 0;
 	lwp_setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse, sizeof(reuse));
 
 	memset (&addr, 0, sizeof (addr));
@@ -152,14 +152,23 @@ void lw_stream_delete (lw_stream ctx)
 	// Clear queues
 
 	list_each (struct _lwp_stream_queued, ctx->front_queue, queued)
+	{
 		lwp_heapbuffer_free (&queued.buffer);
+		lwp_sharedbuffer_release (queued.shared);
+	}
 
 	list_each (struct _lwp_stream_queued, ctx->back_queue, queued)
+	{
 		lwp_heapbuffer_free (&queued.buffer);
+		lwp_sharedbuffer_release (queued.shared);
+	}
 
 	list_clear (ctx->front_queue);
 	list_clear (ctx->back_queue);
 
+	ctx->back_queue_bytes = 0;
+	ctx->back_queue_streams = 0;
+
 	if (ctx->watch)
 	{
 		lw_pump_post_remove(ctx->pump, ctx->watch);
@@ -202,10 +211,19 @@ void lw_stream_writev (lw_stream ctx, const char * format, va_list args)
 
 // Convenience queue functions for lwp_stream_write
 
+// Whether queued data can be appended to the chunk at the back of a queue
+static lw_bool can_append (lwp_stream_queued queued, size_t size)
+{
+	if (!queued || queued->type != lwp_stream_queued_data)
+		return lw_false;
+
+	const size_t length = lwp_heapbuffer_length (&queued->buffer);
+	return length == 0 || length + size <= lwp_stream_queue_chunk_size;
+}
+
 static void queue_back (lw_stream ctx, const char * buffer, size_t size)
 {
-	if ( (!list_length (ctx->back_queue)) ||
-		 list_back (struct _lwp_stream_queued, ctx->back_queue).type != lwp_stream_queued_data)
+	if (!can_append (list_elem_back (struct _lwp_stream_queued, ctx->back_queue), size))
 	{
 		struct _lwp_stream_queued queued = {0};
 
@@ -215,12 +233,12 @@ static void queue_back (lw_stream ctx, const char * buffer, size_t size)
 	}
 
 	lwp_heapbuffer_add (&list_elem_back (struct _lwp_stream_queued, ctx->back_queue)->buffer, buffer, size);
+	ctx->back_queue_bytes += size;
 }
 
 static void queue_front (lw_stream ctx, const char * buffer, size_t size)
 {
-	if ( (!list_length (ctx->front_queue)) ||
-		 list_back (struct _lwp_stream_queued, ctx->front_queue).type != lwp_stream_queued_data)
+	if (!can_append (list_elem_back (struct _lwp_stream_queued, ctx->front_queue), size))
 	{
 		struct _lwp_stream_queued queued = {0};
 
@@ -377,6 +395,8 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 
 				list_push_front (struct _lwp_stream_queued, ctx->back_queue, queued);
 			}
+
+			ctx->back_queue_bytes += size - written;
 		}
 		else
 		{
@@ -416,6 +436,79 @@ size_t lwp_stream_write (lw_stream ctx, const char * buffer, size_t size, int fl
 	return size;
 }
 
+lwp_sharedbuffer lwp_sharedbuffer_new (const char * buffer, size_t length)
+{
+	lwp_sharedbuffer shared = (lwp_sharedbuffer) malloc (sizeof (*shared) + length);
+
+	if (!shared)
+		return NULL;
+
+	memset (&shared->refcount, 0, sizeof (shared->refcount));
+	lwp_retain (shared, "sharedbuffer_new");
+
+	shared->length = length;
+	memcpy (shared->buffer, buffer, length);
+
+	return shared;
+}
+
+void lwp_sharedbuffer_retain (lwp_sharedbuffer shared)
+{
+	lwp_retain (shared, "sharedbuffer");
+}
+
+void lwp_sharedbuffer_release (lwp_sharedbuffer shared)
+{
+	if (shared)
+		lwp_release (shared, "sharedbuffer"); // frees at zero
+}
+
+size_t lwp_sharedbuffer_length (lwp_sharedbuffer shared)
+{
+	return shared->length;
+}
+
+void lwp_stream_write_shared (lw_stream ctx, lwp_sharedbuffer shared, int flags)
+{
+	if (ctx->flags & (lwp_stream_flag_dead | lwp_stream_flag_closing | lwp_stream_flag_closeASAP))
+		return;
+
+	// Filters and busy streams have their own queueing rules, so just copy as usual
+	if (ctx->head_upstream || list_length (ctx->prev) > 0)
+	{
+		lwp_stream_write (ctx, shared->buffer, shared->length, flags);
+		return;
+	}
+
+	size_t written = 0;
+
+	if (! ((ctx->flags & lwp_stream_flag_queuing) || list_length (ctx->back_queue) > 0))
+	{
+		written = lwp_stream_write (ctx, shared->buffer, shared->length,
+			flags | lwp_stream_write_partial);
+
+		if (written >= shared->length || (ctx->flags & lwp_stream_flag_dead))
+			return;
+	}
+
+	lwp_trace ("%p : Adding shared buffer %p to back queue at offset " lwp_fmt_size,
+		ctx, shared, written);
+
+	struct _lwp_stream_queued queued = {0};
+
+	queued.type = lwp_stream_queued_shared;
+	queued.shared = shared;
+	queued.shared_offset = written;
+
+	lwp_retain (shared, "stream queued");
+
+	list_push (struct _lwp_stream_queued, ctx->back_queue, queued);
+	ctx->back_queue_bytes += shared->length - written;
+
+	if (ctx->retry == lw_stream_retry_more_data)
+		lw_stream_retry (ctx, lw_stream_retry_now);
+}
+
 void lw_stream_write_stream (lw_stream ctx, lw_stream source,
 								size_t size, lw_bool delete_when_finished)
 {
@@ -463,6 +556,7 @@ void lwp_stream_write_stream (lw_stream ctx, lw_stream source,
 		queued.delete_stream = (flags & lwp_stream_write_delete_stream);
 
 		list_push (struct _lwp_stream_queued, ctx->back_queue, queued);
+		++ ctx->back_queue_streams;
 
 		return;
 	}
@@ -775,15 +869,100 @@ void lwp_stream_push (lw_stream ctx, const char * buffer, size_t size)
 	}
 }
 
+/* Writes the run of data/shared entries at the front of the queue with one
+ * sink_datav call, removing whatever was fully written. Returns false if the
+ * stream didn't take all of it. back is set if first is in the back queue.
+ */
+static lw_bool write_queue_gathered (lw_stream ctx, lwp_stream_queued first, lw_bool back)
+{
+	const char * buffers [lwp_stream_max_gather];
+	size_t lengths [lwp_stream_max_gather];
+	int count = 0;
+	size_t total = 0;
+
+	for (lwp_stream_queued queued = first; queued && count < lwp_stream_max_gather;
+		queued = list_elem_next (struct _lwp_stream_queued, queued))
+	{
+		if (queued->type == lwp_stream_queued_data)
+		{
+			buffers [count] = lwp_heapbuffer_buffer (&queued->buffer);
+			lengths [count] = lwp_heapbuffer_length (&queued->buffer);
+		}
+		else if (queued->type == lwp_stream_queued_shared)
+		{
+			buffers [count] = queued->shared->buffer + queued->shared_offset;
+			lengths [count] = queued->shared->length - queued->shared_offset;
+		}
+		else
+			break;
+
+		total += lengths [count ++];
+	}
+
+	// Same as lwp_stream_write refusing data
+	if (ctx->flags & (lwp_stream_flag_dead | lwp_stream_flag_closing | lwp_stream_flag_closeASAP))
+		total = 0;
+
+	size_t written = total > 0 ? ctx->def->sink_datav (ctx, buffers, lengths, count) : 0;
+
+	lwp_trace ("%p : Gathered write sank " lwp_fmt_size " of " lwp_fmt_size " from %d entries",
+		ctx, written, total, count);
+
+	if (back)
+		ctx->back_queue_bytes -= written;
+
+	for (int i = 0; i < count; ++ i)
+	{
+		lwp_stream_queued queued = first;
+		first = list_elem_next (struct _lwp_stream_queued, first);
+
+		if (written < lengths [i])
+		{
+			if (queued->type == lwp_stream_queued_data)
+				lwp_heapbuffer_trim_left (&queued->buffer, written);
+			else
+				queued->shared_offset += written;
+
+			return lw_false; /* couldn't write everything */
+		}
+
+		written -= lengths [i];
+
+		if (queued->type == lwp_stream_queued_data)
+			lwp_heapbuffer_free (&queued->buffer);
+		else
+			lwp_sharedbuffer_release (queued->shared);
+
+		list_elem_remove (queued);
+	}
+
+	return lw_true;
+}
+
 list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
-	lw_list (struct _lwp_stream_queued, queue))
+	lw_list (struct _lwp_stream_queued, queue), lw_bool back)
 {
 	lwp_trace ("%p : WriteQueued : %zu to write", ctx, list_length (queue));
 
+	/* Queued data goes straight to sink_data when there's no filter and the
+	 * stream isn't transparent, so several entries can be sunk at once.
+	 */
+	const lw_bool can_gather = ctx->def->sink_datav && !ctx->head_upstream
+		&& ! (ctx->def->is_transparent && ctx->def->is_transparent (ctx));
+
 	while (list_length (queue) > 0)
 	{
 		lwp_stream_queued queued = list_elem_front (struct _lwp_stream_queued, queue);
 
+		if (can_gather && list_length (queue) > 1 &&
+			(queued->type == lwp_stream_queued_data || queued->type == lwp_stream_queued_shared))
+		{
+			if (!write_queue_gathered (ctx, queued, back))
+				break;
+
+			continue;
+		}
+
 		if (queued->type == lwp_stream_queued_begin_marker)
 		{
 			list_elem_remove (queued);
@@ -812,6 +991,9 @@ list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
 
 				lwp_heapbuffer_trim_left(&queued->buffer, written);
 
+				if (back)
+					ctx->back_queue_bytes -= written;
+
 				if (lwp_heapbuffer_length(&queued->buffer) > 0)
 					break; /* couldn't write everything */
 
@@ -822,6 +1004,36 @@ list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
 			continue;
 		}
 
+		if (queued->type == lwp_stream_queued_shared)
+		{
+			lwp_sharedbuffer shared = queued->shared;
+
+			size_t written = lwp_stream_write
+				( ctx,
+					shared->buffer + queued->shared_offset,
+					shared->length - queued->shared_offset,
+					lwp_stream_write_ignore_queue | lwp_stream_write_partial
+						| lwp_stream_write_ignore_busy
+				);
+
+			// As above, queued may be freed if the stream died while writing
+			if (ctx->flags & lwp_stream_flag_dead)
+				break;
+
+			queued->shared_offset += written;
+
+			if (back)
+				ctx->back_queue_bytes -= written;
+
+			if (queued->shared_offset < shared->length)
+				break; /* couldn't write everything */
+
+			lwp_sharedbuffer_release (shared);
+
+			list_elem_remove (queued);
+			continue;
+		}
+
 		if (queued->type == lwp_stream_queued_stream)
 		{
 			lw_stream stream = queued->stream;
@@ -834,6 +1046,9 @@ list_type (struct _lwp_stream_queued) lwp_stream_write_queue(lw_stream ctx,
 
 			list_elem_remove (queued);
 
+			if (back)
+				-- ctx->back_queue_streams;
+
 			lwp_stream_write_stream (ctx, stream, bytes, flags);
 
 			continue;
@@ -858,7 +1073,7 @@ void lwp_stream_write_queued (lw_stream ctx)
 
 	lwp_retain (ctx, "write front queue");
 
-	ctx->front_queue = lwp_stream_write_queue (ctx, ctx->front_queue);
+	ctx->front_queue = lwp_stream_write_queue (ctx, ctx->front_queue, lw_false);
 
 	if (lwp_release(ctx, "write front queue") || ctx->flags & lwp_stream_flag_dead)
 		return;
@@ -872,7 +1087,7 @@ void lwp_stream_write_queued (lw_stream ctx)
 	{
 		lwp_retain (ctx, "write back queue");
 
-		ctx->back_queue = lwp_stream_write_queue (ctx, ctx->back_queue);
+		ctx->back_queue = lwp_stream_write_queue (ctx, ctx->back_queue, lw_true);
 
 		if (lwp_release (ctx, "write back queue") || ctx->flags & lwp_stream_flag_dead)
 			return;
@@ -1101,6 +1316,9 @@ void lw_stream_begin_queue (lw_stream stream)
 
 size_t lw_stream_queued (lw_stream stream)
 {
+	if (stream->back_queue_streams == 0)
+		return stream->back_queue_bytes;
+
 	size_t size = 0, bytes_left;
 
 	list_each (struct _lwp_stream_queued, stream->back_queue, queued)
@@ -1111,6 +1329,12 @@ size_t lw_stream_queued (lw_stream stream)
 			continue;
 		}
 
+		if (queued.type == lwp_stream_queued_shared)
+		{
+			size += queued.shared->length - queued.shared_offset;
+			continue;
+		}
+
 		if (queued.type == lwp_stream_queued_stream)
 		{
 			if (!queued.stream)
@@ -1134,6 +1358,11 @@ size_t lw_stream_queued (lw_stream stream)
 	return size;
 }
 
+size_t lwp_stream_queued_count (lw_stream stream)
+{
+	return list_length (stream->back_queue);
+}
+
 void lw_stream_end_queue_hb (lw_stream ctx, int num_head_buffers,
 	const char ** buffers, size_t * lengths)
 {
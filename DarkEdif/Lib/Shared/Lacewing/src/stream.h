@@ -50,9 +50,36 @@ typedef struct _lwp_stream_close_hook
 
 } * lwp_stream_close_hook;
 
+/* Immutable, refcounted buffer that can sit in many streams' queues at once,
+ * so fanning out the same data doesn't copy it once per stream.
+ */
+typedef struct _lwp_sharedbuffer
+{
+	lwp_refcounted;
+
+	size_t length;
+	char buffer [1];
+
+} * lwp_sharedbuffer;
+
+/* Returns a sharedbuffer with one reference, owned by the caller */
+ lwp_sharedbuffer lwp_sharedbuffer_new (const char * buffer, size_t length);
+ void lwp_sharedbuffer_retain (lwp_sharedbuffer);
+ void lwp_sharedbuffer_release (lwp_sharedbuffer);
+ size_t lwp_sharedbuffer_length (lwp_sharedbuffer);
+
+/* Queued data is kept in chunks of up to this size, so a growing backlog
+ * isn't realloc'd and copied as one buffer.
+ */
+#define lwp_stream_queue_chunk_size  (64 * 1024)
+
+/* Max queued buffers passed to one sink_datav call */
+#define lwp_stream_max_gather  64
+
 #define lwp_stream_queued_data			1
 #define lwp_stream_queued_stream		 2
 #define lwp_stream_queued_begin_marker	3
+#define lwp_stream_queued_shared		 4
 
 typedef struct _lwp_stream_queued
 {
@@ -64,6 +91,10 @@ typedef struct _lwp_stream_queued
 	size_t stream_bytes_left;
 	lw_bool delete_stream;
 
+	/* for lwp_stream_queued_shared; offset is how much has been written */
+	lwp_sharedbuffer shared;
+	size_t shared_offset;
+
 } * lwp_stream_queued;
 
 typedef struct _lwp_stream_filterspec
@@ -130,6 +161,12 @@ struct _lw_stream
 	lw_list (struct _lwp_stream_queued, front_queue);
 	lw_list (struct _lwp_stream_queued, back_queue);
 
+	/* Data and shared bytes in the back queue, and how many stream entries it
+	 * has, so lw_stream_queued doesn't have to walk a queue of many messages.
+	 */
+	size_t back_queue_bytes;
+	int back_queue_streams;
+
 
 	int retry;
 
@@ -180,6 +217,23 @@ void lwp_stream_init (lw_stream, const lw_streamdef *, lw_pump);
 	(lw_stream, const char * buffer, size_t size, int flags);
 
 
+/* As lwp_stream_write with the whole buffer, but if any of it has to be
+ * queued, the queue holds a reference to the sharedbuffer instead of a copy.
+ * Streams with filters or a busy source fall back to copying.
+ */
+
+ void lwp_stream_write_shared
+	(lw_stream, lwp_sharedbuffer, int flags);
+
+
+/* Returns how many entries are in the back queue. Each shared write that had
+ * to be queued is one; other queued data is gathered into chunks of up to
+ * lwp_stream_queue_chunk_size.
+ */
+
+ size_t lwp_stream_queued_count (lw_stream);
+
+
 /* Attempts to write data from PrevDirect, returning false on failure. If
  * successful, DirectBytesLeft will be adjusted.
  */
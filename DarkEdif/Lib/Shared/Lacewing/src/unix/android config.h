@@ -12,6 +12,11 @@
 #if __ANDROID_API__ >= 19
 #define HAVE_SYS_TIMERFD_H
 #endif
+#define HAVE_SYS_EVENTFD_H
+#if __ANDROID_API__ >= 21
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
+#endif
 
 #define HAVE_DECL_PR_SET_NAME
 #define HAVE_DECL_TCP_CORK
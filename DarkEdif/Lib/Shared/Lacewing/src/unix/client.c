@@ -295,7 +295,7 @@ good:
 
 	// Set Nagle. We can't do this in first_time_write_ready(), it causes EPERM on Android
 	{	int b = (ctx->flags & lwp_fdstream_flag_nagle) ? 0 : 1;
-	lwp_setsockopt(ctx->socket, SOL_SOCKET, TCP_NODELAY, (char *)&b, sizeof(b));
+	lwp_setsockopt(ctx->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&b, sizeof(b));
 	}
 
 	ctx->watch = lw_pump_add(ctx->pump, ctx->socket, ctx, 0, first_time_write_ready, lw_true);
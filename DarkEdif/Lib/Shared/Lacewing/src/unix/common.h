@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
 #include <sys/utsname.h>
 #include <netinet/in.h>
@@ -40,6 +41,11 @@
 	#endif
 #endif
 
+#ifdef HAVE_SYS_EVENTFD_H
+	#include <sys/eventfd.h>
+	#define _lacewing_use_eventfd
+#endif
+
 #ifdef HAVE_SYS_SENDFILE_H
 	#include <sys/sendfile.h>
 #endif
@@ -64,6 +70,20 @@
 	#ifndef EPOLLRDHUP
 	  #define EPOLLRDHUP 0x2000
 	#endif
+
+	/* Opt-in: the epoll eventqueue switches to io_uring at runtime if the kernel supports
+	 * it. The headers must be new enough to describe everything it uses (Linux 6.0),
+	 * or it stays on epoll.
+	 */
+	#if defined(ENABLE_IO_URING) && defined(__has_include)
+	  #if __has_include(<linux/io_uring.h>)
+		#include <linux/io_uring.h>
+
+		#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SUBMIT_ALL)
+		  #define _lacewing_use_io_uring
+		#endif
+	  #endif
+	#endif
 #elif defined(USE_KQUEUE)
 	#include <sys/event.h>
 #endif
@@ -14,10 +14,23 @@
 enum
 {
 	sig_exit_eventloop,
-	sig_remove,
-	sig_post
+	sig_remove
 };
 
+/* Event queue tag for the post wake fd; only its address is used */
+static struct _lw_pump_watch postwake_watch;
+
+/* The pump this thread is dispatching events for, if any. Posts to it from its
+ * own callbacks don't need a wake; they run once the current batch of events
+ * is done, saving a wake fd write, read and extra event queue wait per post.
+ */
+static __thread lw_eventpump dispatching_pump = NULL;
+
+/* Posts run per wake before the pump goes back to the event queue, so
+ * posts that keep re-posting themselves can't starve other events.
+ */
+#define max_posts_per_wake  256
+
 #ifdef ENABLE_THREADS
 	static void watcher (lw_eventpump ctx);
 #endif
@@ -38,6 +51,13 @@ lw_eventpump lw_eventpump_new ()
 
 	ctx->sync_signals = lw_sync_new ();
 
+	atomic_init (&ctx->post_stub.next, NULL);
+	atomic_init (&ctx->post_head, &ctx->post_stub);
+	ctx->post_tail = &ctx->post_stub;
+	atomic_init (&ctx->post_wake_pending, lw_false);
+
+	ctx->postwake_read = ctx->postwake_write = -1;
+
 	int signalpipe [2];
 	if (pipe(signalpipe) == -1)
 	{
@@ -58,21 +78,161 @@ lw_eventpump lw_eventpump_new ()
 						lw_true, lw_false, lw_true,
 						NULL);
 
+	#ifdef _lacewing_use_eventfd
+		ctx->postwake_read = ctx->postwake_write = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ctx->postwake_read == -1)
+	#else
+		int postpipe [2];
+		if (pipe (postpipe) == -1)
+	#endif
+	{
+		ctx->postwake_read = ctx->postwake_write = -1;
+		lw_pump_delete (&ctx->pump);
+		return NULL;
+	}
+
+	#ifndef _lacewing_use_eventfd
+		ctx->postwake_read  = postpipe [0];
+		ctx->postwake_write = postpipe [1];
+
+		fcntl (ctx->postwake_read, F_SETFL,
+			fcntl (ctx->postwake_read, F_GETFL, 0) | O_NONBLOCK);
+		fcntl (ctx->postwake_write, F_SETFL,
+			fcntl (ctx->postwake_write, F_GETFL, 0) | O_NONBLOCK);
+	#endif
+
+	lwp_eventqueue_add (ctx->queue, ctx->postwake_read,
+						lw_true, lw_false, lw_true,
+						&postwake_watch);
+
 	return ctx;
 }
 
+/* Removes the oldest post. Only the pump's thread may call this. Returns false if
+ * there's none, or the next is still being pushed; see post_run for how that's caught.
+ */
+static lw_bool post_pop (lw_eventpump ctx, void ** func, void ** param)
+{
+	struct _lwp_eventpump_post * tail = ctx->post_tail,
+		* next = atomic_load_explicit (&tail->next, memory_order_acquire);
+
+	if (tail == &ctx->post_stub)
+	{
+		if (!next)
+			return lw_false;
+
+		ctx->post_tail = tail = next;
+		next = atomic_load_explicit (&next->next, memory_order_acquire);
+	}
+
+	if (!next)
+	{
+		/* tail is the last post, but can't be freed while it's still the head,
+		 * so put the stub back in behind it
+		 */
+		if (tail != atomic_load_explicit (&ctx->post_head, memory_order_acquire))
+			return lw_false;
+
+		atomic_store_explicit (&ctx->post_stub.next, NULL, memory_order_relaxed);
+		struct _lwp_eventpump_post * prev = atomic_exchange_explicit
+			(&ctx->post_head, &ctx->post_stub, memory_order_acq_rel);
+		atomic_store_explicit (&prev->next, &ctx->post_stub, memory_order_release);
+
+		next = atomic_load_explicit (&tail->next, memory_order_acquire);
+
+		if (!next)
+			return lw_false;
+	}
+
+	ctx->post_tail = next;
+
+	*func = tail->func;
+	*param = tail->param;
+	free (tail);
+
+	return lw_true;
+}
+
+static void post_wake (lw_eventpump ctx)
+{
+	#ifdef _lacewing_use_eventfd
+		const lw_ui64 one = 1;
+		if (write (ctx->postwake_write, &one, sizeof (one)) == -1)
+	#else
+		const char one = 1;
+		if (write (ctx->postwake_write, &one, sizeof (one)) == -1 && errno != EAGAIN)
+	#endif
+			always_log ("post wake failed to write with error %d.", errno);
+}
+
+/* Runs up to max_posts_per_wake posts, and wakes the pump again if there's more */
+static void post_drain (lw_eventpump ctx)
+{
+	void * func, * param;
+
+	for (int i = 0; i < max_posts_per_wake; ++ i)
+	{
+		if (!post_pop (ctx, &func, &param))
+			return;
+
+		((void * (*) (void *)) func) (param);
+	}
+
+	/* More to do; come back after the event queue has had a turn */
+	if (!atomic_exchange (&ctx->post_wake_pending, lw_true))
+		post_wake (ctx);
+}
+
+/* Runs the posted functions; called when the post wake fd is readable */
+static void post_run (lw_eventpump ctx)
+{
+	#ifdef _lacewing_use_eventfd
+		lw_ui64 count;
+		if (read (ctx->postwake_read, &count, sizeof (count)) == -1 && errno != EAGAIN)
+			always_log ("post wake failed to read with error %d.", errno);
+	#else
+		char buffer [64];
+		while (read (ctx->postwake_read, buffer, sizeof (buffer)) > 0)
+			;
+	#endif
+
+	/* Cleared before running, so a post that this misses (including one partway
+	 * through being pushed) sees it clear, and wakes the pump again
+	 */
+	atomic_store (&ctx->post_wake_pending, lw_false);
+
+	post_drain (ctx);
+}
+
 static void def_cleanup (lw_pump pump)
 {
 	lw_eventpump ctx = (lw_eventpump) pump;
 
+	/* Stop watching before closing, or epoll_ctl() fails with EBADF */
 	if (ctx->signalpipe_read != -1)
 	{
+		lwp_eventqueue_update(ctx->queue, ctx->signalpipe_read,
+			lw_true, lw_false, lw_false, lw_false, lw_true, lw_false, NULL, NULL);
+
 		close(ctx->signalpipe_read);
 		close(ctx->signalpipe_write);
 	}
 
-	lwp_eventqueue_update(ctx->queue, ctx->signalpipe_read,
-		lw_true, lw_false, lw_false, lw_false, lw_true, lw_false, NULL, NULL);
+	if (ctx->postwake_read != -1)
+	{
+		lwp_eventqueue_update (ctx->queue, ctx->postwake_read,
+			lw_true, lw_false, lw_false, lw_false, lw_true, lw_false, &postwake_watch, &postwake_watch);
+
+		close (ctx->postwake_read);
+		if (ctx->postwake_write != ctx->postwake_read)
+			close (ctx->postwake_write);
+		ctx->postwake_read = ctx->postwake_write = -1;
+	}
+
+	/* Posts that never ran; the pump is going, so they can't */
+	void * func, * param;
+	while (post_pop (ctx, &func, &param))
+		;
 
 	#ifdef ENABLE_THREADS
 		if (lw_thread_started (ctx->watcher.thread))
@@ -97,6 +257,16 @@ lw_bool process_event (lw_eventpump ctx, lwp_eventqueue_event event)
 
 	lw_pump_watch watch = (lw_pump_watch)lwp_eventqueue_event_tag (event);
 
+	#ifdef _lacewing_use_io_uring
+
+		if (lwp_eventqueue_event_op (event))
+		{
+			lwp_eventqueue_complete (ctx->queue, event);
+			return lw_true;
+		}
+
+	#endif
+
 	/* fudge: nothing kqueue specific belongs in this file, but since the
 	* kqueue code doesn't actually look at the events it's the only place
 	* we can put it.
@@ -111,10 +281,20 @@ lw_bool process_event (lw_eventpump ctx, lwp_eventqueue_event event)
 
 	#endif
 
+	if (watch == &postwake_watch)
+	{
+		post_run (ctx);
+		return lw_true;
+	}
+
 	if (watch && watch->tag)
 	{
 		if (read_ready && watch->on_read_ready)
+		{
+			watch->short_read_drains = !lwp_eventqueue_event_hangup (event);
 			watch->on_read_ready (watch->tag);
+			watch->short_read_drains = lw_false;
+		}
 
 		if (write_ready && watch->on_write_ready)
 			watch->on_write_ready (watch->tag);
@@ -168,20 +348,6 @@ lw_bool process_event (lw_eventpump ctx, lwp_eventqueue_event event)
 
 			break; // out of switch
 		}
-
-		case sig_post:
-		{
-			lw_trace("eventpump process_event: signal is post.");
-			void* func = list_front(void*, ctx->signalparams);
-			list_pop_front(void*, ctx->signalparams);
-
-			void* param = list_front(void*, ctx->signalparams);
-			list_pop_front(void*, ctx->signalparams);
-
-			((void* (*) (void*)) func) (param);
-
-			break; // out of switch
-		}
 		};
 
 	} while (ctx->waiting_pipe_bytes > 0);
@@ -195,6 +361,13 @@ lw_error lw_eventpump_tick (lw_eventpump ctx)
 {
 	lw_bool need_watcher_resume = lw_false;
 
+	lw_eventpump outer_pump = dispatching_pump;
+	dispatching_pump = ctx;
+
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue outer_queue = lwp_eventqueue_dispatch (ctx->queue);
+	#endif
+
 	#ifdef ENABLE_THREADS
 
 		if (ctx->watcher.num_events > 0)
@@ -219,6 +392,14 @@ lw_error lw_eventpump_tick (lw_eventpump ctx)
 	for (int i = 0; i < count; ++ i)
 		process_event (ctx, events [i]);
 
+	post_drain (ctx);
+	dispatching_pump = outer_pump;
+
+	/* Submits what the batch held back */
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue_dispatch (outer_queue);
+	#endif
+
 	#ifdef ENABLE_THREADS
 		if (need_watcher_resume)
 			lw_event_signal (ctx->watcher.resume_event);
@@ -231,6 +412,14 @@ lw_error lw_eventpump_start_eventloop (lw_eventpump ctx)
 {
 	int do_loop = 1;
 
+	lw_eventpump outer_pump = dispatching_pump;
+	dispatching_pump = ctx;
+
+	/* Submissions made while dispatching go with the next drain */
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue outer_queue = lwp_eventqueue_dispatch (ctx->queue);
+	#endif
+
 	while (do_loop)
 	{
 	  lwp_eventqueue_event events [max_events];
@@ -254,8 +443,21 @@ lw_error lw_eventpump_start_eventloop (lw_eventpump ctx)
 			break;
 		 }
 	  }
+
+	  if (do_loop)
+		 post_drain (ctx);
 	}
 
+	dispatching_pump = outer_pump;
+
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue_dispatch (outer_queue);
+	#endif
+
+	/* Leave any posts made since the last batch for whoever pumps next */
+	if (!atomic_exchange (&ctx->post_wake_pending, lw_true))
+		post_wake (ctx);
+
 	return 0;
 }
 
@@ -420,20 +622,47 @@ static void def_post (lw_pump pump, void * func, void * param)
 {
 	lw_eventpump ctx = (lw_eventpump) pump;
 
-	lw_sync_lock (ctx->sync_signals);
+	struct _lwp_eventpump_post * post = (struct _lwp_eventpump_post *) malloc (sizeof (*post));
 
-		list_push (void *, ctx->signalparams, func);
-		list_push (void*, ctx->signalparams, param);
+	if (!post)
+	{
+		always_log ("post failed, out of memory.");
+		return;
+	}
 
-		char signal = sig_post;
-		if (write(ctx->signalpipe_write, &signal, sizeof(signal)) == -1)
-			always_log("pipe failed to write with error %d.", errno);
-		else
-			++ctx->waiting_pipe_bytes;
+	post->func = func;
+	post->param = param;
+	atomic_store_explicit (&post->next, NULL, memory_order_relaxed);
 
-	lw_sync_release (ctx->sync_signals);
+	struct _lwp_eventpump_post * prev = atomic_exchange_explicit
+		(&ctx->post_head, post, memory_order_acq_rel);
+
+	/* Until this store, the pump sees the queue as ending at prev */
+	atomic_store_explicit (&prev->next, post, memory_order_release);
+
+	/* Posted from within the pump's own dispatch; it'll run at the end of the batch */
+	if (dispatching_pump == ctx)
+		return;
+
+	/* Only the first post since the pump last started running posts needs to wake it */
+	if (!atomic_exchange (&ctx->post_wake_pending, lw_true))
+		post_wake (ctx);
+}
+
+#ifdef _lacewing_use_io_uring
+
+lwp_eventqueue lwp_eventpump_ring (lw_pump pump)
+{
+	if (pump->def != &def_eventpump)
+		return NULL;
+
+	lwp_eventqueue queue = ((lw_eventpump) pump)->queue;
+
+	return lwp_eventqueue_has_ops (queue) ? queue : NULL;
 }
 
+#endif
+
 const lw_pumpdef def_eventpump =
 {
 	.add				= def_add,
@@ -18,10 +18,23 @@ struct _lw_pump_watch
 	lw_pump_callback on_read_ready, on_write_ready;
 	lw_bool edge_triggered;
 
+	/* Only true while on_read_ready runs for an event without a hangup, see
+	 * lwp_eventqueue_event_hangup. Readers that see it can stop at a short read,
+	 * saving the read() that would only return EAGAIN.
+	 */
+	lw_bool short_read_drains;
+
 	int fd;
 	void * tag;
 };
 
+/* A function posted by lw_pump_post, in the pump's lock-free post queue */
+struct _lwp_eventpump_post
+{
+	void * func, * param;
+	_Atomic(struct _lwp_eventpump_post *) next;
+};
+
 struct _lw_eventpump
 {
 	struct _lw_pump pump;
@@ -30,10 +43,22 @@ struct _lw_eventpump
 
 	lw_sync sync_signals;
 
+	/* sig_exit_eventloop and sig_remove */
 	int signalpipe_read, signalpipe_write;
 	lw_list (void *, signalparams);
 	int waiting_pipe_bytes; // protected by sync_signals
 
+	/* lw_pump_post: any thread pushes on post_head, and the pump pops from post_tail
+	 * (a Vyukov MPSC queue). post_wake_pending is set by the first post after the
+	 * pump starts running posts, so only that post signals the wake fd, which is
+	 * an eventfd where available, otherwise a pipe.
+	 */
+	_Atomic(struct _lwp_eventpump_post *) post_head;
+	struct _lwp_eventpump_post * post_tail;
+	struct _lwp_eventpump_post post_stub;
+	_Atomic(lw_bool) post_wake_pending;
+	int postwake_read, postwake_write;
+
 	#ifndef _lacewing_no_threads
 
 	  /* for start_sleepy_ticking
@@ -56,6 +81,15 @@ struct _lw_eventpump
 
 extern const lw_pumpdef def_eventpump;
 
+#ifdef _lacewing_use_io_uring
+
+	/* The pump's event queue, if it's an eventpump that can run socket operations
+	 * (see lwp_eventqueue_has_ops); NULL otherwise
+	 */
+	lwp_eventqueue lwp_eventpump_ring (lw_pump);
+
+#endif
+
 /* epoll/kqueue/select specific
  */
 int lwp_eventpump_create_queue ();
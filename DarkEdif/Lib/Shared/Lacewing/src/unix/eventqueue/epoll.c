@@ -14,8 +14,18 @@
 lwp_eventqueue lwp_eventqueue_new ()
 {
 	lwp_eventqueue queue = (lwp_eventqueue)malloc(sizeof(_lw_eventqueue));
-	queue->epollFD = epoll_create (32);
 	queue->numFDsWatched = 0;
+
+	#ifdef _lacewing_use_io_uring
+		if ((queue->uring = lwp_uring_new ()))
+		{
+			lwp_trace ("lwp_eventqueue_new: using io_uring");
+			queue->epollFD = -1;
+			return queue;
+		}
+	#endif
+
+	queue->epollFD = epoll_create (32);
 	return queue;
 }
 
@@ -23,6 +33,12 @@ void lwp_eventqueue_delete (lwp_eventqueue queue)
 {
 	if (queue->numFDsWatched > 0)
 		always_log ("lwp_eventqueue_delete warning: had %i FDs left when closing eventqueue.", queue->numFDsWatched);
+
+	#ifdef _lacewing_use_io_uring
+		if (queue->uring)
+			lwp_uring_delete (queue->uring);
+		else
+	#endif
 	close (queue->epollFD);
 	free (queue);
 }
@@ -38,12 +54,17 @@ void lwp_eventqueue_add (lwp_eventqueue queue,
 
 	event.data.ptr = tag;
 
-	event.events = (read != 0 ? EPOLLIN : 0u) |
+	event.events = (read != 0 ? EPOLLIN | EPOLLRDHUP : 0u) |
 				  (write != 0 ? EPOLLOUT : 0u) |
 				  (edge_triggered != 0 ? EPOLLET : 0u);
 	lwp_trace ("lwp_eventqueue_add EPOLL_CTL_ADD: Queuing event with fd %d, read %d, write %d, edge %d, TAG %p.",
 		fd, read ? 1 : 0, write ? 1 : 0, edge_triggered ? 1 : 0, tag);
 
+	#ifdef _lacewing_use_io_uring
+		if (queue->uring)
+			lwp_uring_watch (queue, fd, event.events, tag);
+		else
+	#endif
 	epoll_ctl (queue->epollFD, EPOLL_CTL_ADD, fd, &event);
 	++queue->numFDsWatched;
 }
@@ -63,9 +84,18 @@ void lwp_eventqueue_update (lwp_eventqueue queue,
 	(void)res; // prevent unused warnings
 	if (read || write)
 	{
-		event.events = (read ? EPOLLIN : 0u) |
+		event.events = (read ? EPOLLIN | EPOLLRDHUP : 0u) |
 					   (write ? EPOLLOUT : 0u) |
 					   (edge_triggered ? EPOLLET : 0u);
+
+		#ifdef _lacewing_use_io_uring
+			if (queue->uring)
+			{
+				lwp_uring_watch (queue, fd, event.events, tag);
+				return;
+			}
+		#endif
+
 		res = epoll_ctl(queue->epollFD, EPOLL_CTL_MOD, fd, &event);
 		if (res == -1)
 			always_log("epoll_ctl mod for fd %d, epoll fd %d returned -1, err %d", fd, queue->epollFD, errno);
@@ -76,6 +106,15 @@ void lwp_eventqueue_update (lwp_eventqueue queue,
 	}
 	else // deleting
 	{
+		#ifdef _lacewing_use_io_uring
+			if (queue->uring)
+			{
+				lwp_uring_unwatch (queue, fd);
+				--queue->numFDsWatched;
+				return;
+			}
+		#endif
+
 		// Pump already closed down - this should not happen!
 		// It means the client/server closes after the pump is deleted. Should be before.
 		if (queue->epollFD == -1)
@@ -96,6 +135,11 @@ int lwp_eventqueue_drain (lwp_eventqueue queue,
 						  int max_events,
 						  lwp_eventqueue_event * events)
 {
+	#ifdef _lacewing_use_io_uring
+		if (queue->uring)
+			return lwp_uring_drain (queue, block, max_events, events);
+	#endif
+
 	return epoll_wait (queue->epollFD, events, max_events, block ? -1 : 0);
 }
 
@@ -109,6 +153,11 @@ lw_bool lwp_eventqueue_event_write_ready (lwp_eventqueue_event event)
 	return (event.events & EPOLLOUT) != 0;
 }
 
+lw_bool lwp_eventqueue_event_hangup (lwp_eventqueue_event event)
+{
+	return (event.events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+}
+
 void * lwp_eventqueue_event_tag (lwp_eventqueue_event event)
 {
 	return event.data.ptr;
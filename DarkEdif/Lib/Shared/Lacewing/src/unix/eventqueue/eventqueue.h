@@ -27,9 +27,25 @@
 	{
 		int epollFD;
 		int numFDsWatched;
+
+		#ifdef _lacewing_use_io_uring
+			struct _lwp_uring * uring; /* NULL if using epoll */
+		#endif
 	} _lw_eventqueue;
 	typedef struct epoll_event lwp_eventqueue_event;
 
+	#ifdef _lacewing_use_io_uring
+
+		/* io_uring.c, for epoll.c; lwp_uring_new returns NULL if io_uring can't be used
+		*/
+		struct _lwp_uring * lwp_uring_new ();
+		void lwp_uring_delete (struct _lwp_uring *);
+		void lwp_uring_watch (lwp_eventqueue, int fd, unsigned int events, void * tag);
+		void lwp_uring_unwatch (lwp_eventqueue, int fd);
+		int lwp_uring_drain (lwp_eventqueue, lw_bool block, int max_events, lwp_eventqueue_event *);
+
+	#endif
+
 #elif defined(USE_KQUEUE)
 
 	#include <sys/event.h>
@@ -87,7 +103,76 @@ int lwp_eventqueue_drain (lwp_eventqueue,
 lw_bool lwp_eventqueue_event_read_ready (lwp_eventqueue_event);
 lw_bool lwp_eventqueue_event_write_ready (lwp_eventqueue_event);
 
-void * lwp_eventqueue_event_tag (lwp_eventqueue_event);
+/* hangup: whether the peer may have shut down its end. If not, a read that's
+ * shorter than asked for has emptied the fd, and an edge-triggered watch will
+ * get another event when there's more; otherwise keep reading to EAGAIN, or
+ * the end of the stream can be missed.
+ */
+lw_bool lwp_eventqueue_event_hangup (lwp_eventqueue_event);
 
+void * lwp_eventqueue_event_tag (lwp_eventqueue_event);
 
+#ifdef _lacewing_use_io_uring
+
+	/* ops: socket operations the queue runs itself, when lwp_eventqueue_has_ops.
+	 * Completions come out of drain as events; pass those that lwp_eventqueue_event_op
+	 * to lwp_eventqueue_complete, which calls the op's callback with the result (as a
+	 * syscall would return it, but -errno on failure), and for recv, the data, which
+	 * has a spare byte after it.
+	 *
+	 * accept and recv keep completing until cancelled. A send completes once, and is
+	 * done with after its callback; until sealed, more can be added to its buffer.
+	 * Ops made while dispatching the queue's events go to the kernel together once
+	 * the batch is done, see lwp_eventqueue_dispatch.
+	 */
+	typedef struct _lwp_eventqueue_op * lwp_eventqueue_op;
+	typedef void (* lwp_eventqueue_op_callback) (void * tag, int result, char * buffer);
+
+	lw_bool lwp_eventqueue_has_ops (lwp_eventqueue);
+
+	/* dispatch: marks this thread as dispatching the queue's events (or none, for NULL),
+	 * returning the queue it was dispatching before
+	 */
+	lwp_eventqueue lwp_eventqueue_dispatch (lwp_eventqueue);
+	lw_bool lwp_eventqueue_dispatching (lwp_eventqueue);
+
+	/* flush: submits held back ops now, e.g. before closing an fd they use
+	 */
+	void lwp_eventqueue_flush (lwp_eventqueue);
+
+	lwp_eventqueue_op lwp_eventqueue_accept (lwp_eventqueue, int fd,
+											 lwp_eventqueue_op_callback, void * tag);
+
+	lwp_eventqueue_op lwp_eventqueue_recv (lwp_eventqueue, int fd,
+										   lwp_eventqueue_op_callback, void * tag);
+
+	/* recvfrom: for datagrams; buffer is a struct sockaddr_storage with the sender,
+	 * followed by the datagram of result bytes
+	 */
+	lwp_eventqueue_op lwp_eventqueue_recvfrom (lwp_eventqueue, int fd,
+											   lwp_eventqueue_op_callback, void * tag);
+
+	lwp_eventqueue_op lwp_eventqueue_send (lwp_eventqueue, int fd, lwp_heapbuffer * buffer,
+										   lwp_eventqueue_op_callback, void * tag);
+
+	lw_bool lwp_eventqueue_send_sealed (lwp_eventqueue_op);
+
+	/* sendto: a datagram, copied; has no op to cancel */
+	lw_bool lwp_eventqueue_sendto (lwp_eventqueue, int fd,
+								   const struct sockaddr * address, socklen_t address_length,
+								   const char * buffer, size_t size,
+								   lwp_eventqueue_op_callback, void * tag);
+
+	/* cancel: no more callbacks; a send in progress keeps its buffer and finishes */
+	void lwp_eventqueue_cancel (lwp_eventqueue, lwp_eventqueue_op);
+
+	/* close: finishes send (which may be NULL), sends unsent after it, then shuts down
+	 * and closes fd if close_fd, without waiting. Takes over the buffers.
+	 */
+	void lwp_eventqueue_close (lwp_eventqueue, int fd, lw_bool close_fd,
+							   lwp_eventqueue_op send, lwp_heapbuffer * unsent);
+
+	lw_bool lwp_eventqueue_event_op (lwp_eventqueue_event);
+	void lwp_eventqueue_complete (lwp_eventqueue, lwp_eventqueue_event);
 
+#endif
@@ -0,0 +1,1494 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=c:
+ *
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+/* io_uring for the epoll eventqueue, used when built with ENABLE_IO_URING and the
+ * kernel supports it. fd watches become multishot polls, and the queue can run
+ * socket operations itself (see eventqueue.h), returning their completions from
+ * drain as events. Submissions made while the queue's thread dispatches its events
+ * are held back, then go to the kernel together in one io_uring_enter once the
+ * batch of events is done.
+ *
+ * This uses the system calls directly, so there's no liburing dependency.
+ */
+
+#include "../../common.h"
+#include "eventqueue.h"
+
+#ifdef _lacewing_use_io_uring
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define lwp_uring_sq_entries	256
+#define lwp_uring_cq_entries	4096
+
+/* Provided buffers, which the kernel picks from for multishot recv as data arrives.
+ * The kernel is told they're a byte short, so callbacks have room to terminate the data.
+ */
+#define lwp_uring_buffer_count	128 /* power of 2 */
+#define lwp_uring_buffer_size	lwp_default_buffer_size
+#define lwp_uring_buffer_group	0
+
+/* Set in an SQE's user_data for an op; clear for a poll */
+#define lwp_uring_user_op	1
+
+/* Marks an op's completion in lwp_eventqueue_event.events; not an epoll flag */
+#define lwp_uring_event_op	(1u << 27)
+
+enum
+{
+	lwp_uring_op_accept,
+	lwp_uring_op_recv,
+	lwp_uring_op_recvfrom,
+	lwp_uring_op_send,
+	lwp_uring_op_sendto,
+	lwp_uring_op_close
+};
+
+/* An fd watch, as a multishot poll. lwp_eventqueue_update replaces rather than changes
+ * it, and it's freed once the kernel posts its last completion.
+ */
+struct _lwp_uring_poll
+{
+	int fd;
+	unsigned int events;
+	void * tag;
+	lw_bool removed;
+
+	lw_bool armed;		/* with the kernel, which may post more completions */
+	lw_bool deferred;	/* waiting for an SQE, see deferred_submit */
+	struct _lwp_uring_poll * next_deferred;
+};
+
+struct _lwp_eventqueue_op
+{
+	int type, fd;
+
+	lwp_eventqueue_op_callback callback;
+	void * tag;
+
+	lw_bool armed;			/* with the kernel, which may post more completions */
+	lw_bool final_pending;	/* the last completion has been drained, but not yet run */
+	lw_bool detached;		/* cancelled or handed over; no more callbacks */
+	lw_bool sealed;			/* send: the kernel has the buffer, so it can't be added to */
+	lw_bool deferred;		/* waiting for an SQE, see deferred_submit */
+
+	/* send: the owner's buffer, until detached, when the op takes it over */
+	lwp_heapbuffer * buffer;
+	lwp_heapbuffer owned;
+
+	/* send being closed: what to send once it's done, then the fd to shut down and close */
+	lwp_heapbuffer unsent;
+	int close_fd;
+
+	/* recvfrom and sendto */
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage address;
+
+	lwp_eventqueue_op next_pending, next_deferred;
+};
+
+/* An op's completion, which lwp_eventqueue_event.data.ptr points at until the next drain */
+struct _lwp_uring_completion
+{
+	lwp_eventqueue_op op;
+	int res;
+	unsigned int flags;
+};
+
+struct _lwp_uring
+{
+	int fd;
+
+	/* Guards the submission queue, the pending ops, the polls, and reaping */
+	lw_sync sync;
+
+	void * rings;
+	size_t rings_size;
+
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+
+	unsigned int sq_entries, sq_mask, sq_local_tail;
+	_Atomic(unsigned int) * sq_head, * sq_tail, * sq_flags;
+
+	unsigned int cq_mask;
+	_Atomic(unsigned int) * cq_head, * cq_tail;
+	struct io_uring_cqe * cqes;
+
+	struct io_uring_buf_ring * buffer_ring;
+	size_t buffer_ring_size;
+	char * buffers;
+	unsigned short buffer_tail;
+
+	/* Sends held back until the end of the dispatch batch, oldest first */
+	lwp_eventqueue_op pending;
+
+	/* Polls and ops that found the submission queue full, for the next drain or flush */
+	struct _lwp_uring_poll * deferred_polls;
+	lwp_eventqueue_op deferred_ops;
+
+	struct _lwp_uring_poll ** polls;
+	int num_polls;
+
+	struct _lwp_uring_completion * completions;
+	int num_completions;
+
+	long num_ops;
+};
+
+/* The queue this thread is dispatching events for, if any */
+static __thread lwp_eventqueue dispatching_queue = NULL;
+
+static int uring_setup (unsigned int entries, struct io_uring_params * params)
+{
+	return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter (int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register (int fd, unsigned int opcode, void * arg, unsigned int num_args)
+{
+	return (int) syscall (__NR_io_uring_register, fd, opcode, arg, num_args);
+}
+
+/* Multishot recv, the newest feature used, arrived in 6.0 */
+static lw_bool kernel_supported ()
+{
+	struct utsname name;
+	int major = 0, minor = 0;
+
+	if (uname (&name) == -1 || sscanf (name.release, "%d.%d", &major, &minor) != 2)
+		return lw_false;
+
+	return major >= 6;
+}
+
+static lw_bool ops_supported (int fd)
+{
+	static const lw_ui8 needed [] =
+	{
+		IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ASYNC_CANCEL,
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+		IORING_OP_SHUTDOWN, IORING_OP_CLOSE
+	};
+
+	const int num_probe_ops = 256;
+
+	struct io_uring_probe * probe = (struct io_uring_probe *) calloc
+		(sizeof (*probe) + num_probe_ops * sizeof (struct io_uring_probe_op), 1);
+
+	if (!probe)
+		return lw_false;
+
+	lw_bool supported = uring_register (fd, IORING_REGISTER_PROBE, probe, num_probe_ops) != -1;
+
+	for (size_t i = 0; supported && i < sizeof (needed); ++ i)
+	{
+		if (needed [i] > probe->last_op || !(probe->ops [needed [i]].flags & IO_URING_OP_SUPPORTED))
+			supported = lw_false;
+	}
+
+	free (probe);
+
+	return supported;
+}
+
+/* Gives a provided buffer back to the kernel. Only the thread running completions calls this. */
+static void buffer_recycle (struct _lwp_uring * uring, unsigned short id)
+{
+	struct io_uring_buf * buf = &uring->buffer_ring->bufs [uring->buffer_tail & (lwp_uring_buffer_count - 1)];
+
+	buf->addr = (__u64) (uintptr_t) (uring->buffers + (size_t) id * lwp_uring_buffer_size);
+	buf->len = lwp_uring_buffer_size - 1;
+	buf->bid = id;
+
+	atomic_store_explicit ((_Atomic(unsigned short) *) &uring->buffer_ring->tail,
+		++ uring->buffer_tail, memory_order_release);
+}
+
+void lwp_uring_delete (struct _lwp_uring * uring)
+{
+	if (uring->num_ops > 0)
+		always_log ("lwp_uring_delete warning: had %ld io_uring operations left when closing eventqueue.", uring->num_ops);
+
+	/* Closing the ring cancels everything still with the kernel */
+	if (uring->fd != -1)
+		close (uring->fd);
+
+	while (uring->pending)
+	{
+		lwp_eventqueue_op op = uring->pending;
+		uring->pending = op->next_pending;
+
+		lwp_heapbuffer_free (&op->owned);
+		free (op);
+	}
+
+	while (uring->deferred_ops)
+	{
+		lwp_eventqueue_op op = uring->deferred_ops;
+		uring->deferred_ops = op->next_deferred;
+
+		/* Owners still have the rest */
+		if (op->detached)
+		{
+			if (op->type == lwp_uring_op_close && op->close_fd != -1)
+				close (op->close_fd);
+
+			lwp_heapbuffer_free (&op->owned);
+			free (op);
+		}
+	}
+
+	/* Those not removed are still in polls */
+	while (uring->deferred_polls)
+	{
+		struct _lwp_uring_poll * poll = uring->deferred_polls;
+		uring->deferred_polls = poll->next_deferred;
+
+		if (poll->removed)
+			free (poll);
+	}
+
+	for (int i = 0; i < uring->num_polls; ++ i)
+		free (uring->polls [i]);
+
+	free (uring->polls);
+	free (uring->completions);
+	free (uring->buffers);
+
+	if (uring->buffer_ring)
+		munmap (uring->buffer_ring, uring->buffer_ring_size);
+
+	if (uring->sqes)
+		munmap (uring->sqes, uring->sqes_size);
+
+	if (uring->rings)
+		munmap (uring->rings, uring->rings_size);
+
+	if (uring->sync)
+		lw_sync_delete (uring->sync);
+
+	free (uring);
+}
+
+struct _lwp_uring * lwp_uring_new ()
+{
+	const char * backend = getenv ("LACEWING_EVENTQUEUE");
+
+	if ((backend && !strcmp (backend, "epoll")) || !kernel_supported ())
+		return NULL;
+
+	struct io_uring_params params;
+	memset (&params, 0, sizeof (params));
+
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = lwp_uring_cq_entries;
+
+	int fd = uring_setup (lwp_uring_sq_entries, &params);
+
+	if (fd == -1)
+	{
+		/* Also how a seccomp filter or io_uring_disabled turns it down */
+		lwp_trace ("io_uring_setup failed with error %d, using epoll", errno);
+		return NULL;
+	}
+
+	const unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+		| IORING_FEAT_FAST_POLL | IORING_FEAT_CQE_SKIP;
+
+	if ((params.features & features) != features || !ops_supported (fd))
+	{
+		lwp_trace ("io_uring is missing features, using epoll");
+		close (fd);
+		return NULL;
+	}
+
+	struct _lwp_uring * uring = (struct _lwp_uring *) calloc (sizeof (*uring), 1);
+
+	if (!uring)
+	{
+		close (fd);
+		return NULL;
+	}
+
+	uring->fd = fd;
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int),
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+
+	uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+	uring->rings = mmap (0, uring->rings_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	uring->sqes = (struct io_uring_sqe *) mmap (0, uring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	uring->buffer_ring_size = lwp_uring_buffer_count * sizeof (struct io_uring_buf);
+	uring->buffer_ring = (struct io_uring_buf_ring *) mmap (0, uring->buffer_ring_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	/* Only touched as data comes in, so a queue that never receives costs no memory */
+	uring->buffers = (char *) malloc ((size_t) lwp_uring_buffer_count * lwp_uring_buffer_size);
+
+	if (uring->rings == MAP_FAILED || uring->sqes == MAP_FAILED
+		|| uring->buffer_ring == MAP_FAILED || !uring->buffers)
+	{
+		if (uring->rings == MAP_FAILED)
+			uring->rings = NULL;
+
+		if (uring->sqes == MAP_FAILED)
+			uring->sqes = NULL;
+
+		if (uring->buffer_ring == MAP_FAILED)
+			uring->buffer_ring = NULL;
+
+		lwp_uring_delete (uring);
+		return NULL;
+	}
+
+	char * rings = (char *) uring->rings;
+
+	uring->sq_head = (_Atomic(unsigned int) *) (rings + params.sq_off.head);
+	uring->sq_tail = (_Atomic(unsigned int) *) (rings + params.sq_off.tail);
+	uring->sq_flags = (_Atomic(unsigned int) *) (rings + params.sq_off.flags);
+	uring->sq_mask = *(unsigned int *) (rings + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->sq_local_tail = atomic_load_explicit (uring->sq_tail, memory_order_relaxed);
+
+	/* SQE i always goes in slot i */
+	unsigned int * sq_array = (unsigned int *) (rings + params.sq_off.array);
+
+	for (unsigned int i = 0; i < params.sq_entries; ++ i)
+		sq_array [i] = i;
+
+	uring->cq_head = (_Atomic(unsigned int) *) (rings + params.cq_off.head);
+	uring->cq_tail = (_Atomic(unsigned int) *) (rings + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *) (rings + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+	struct io_uring_buf_reg reg;
+	memset (&reg, 0, sizeof (reg));
+
+	reg.ring_addr = (__u64) (uintptr_t) uring->buffer_ring;
+	reg.ring_entries = lwp_uring_buffer_count;
+	reg.bgid = lwp_uring_buffer_group;
+
+	if (uring_register (fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		lwp_trace ("io_uring buffer ring registration failed with error %d, using epoll", errno);
+
+		lwp_uring_delete (uring);
+		return NULL;
+	}
+
+	for (unsigned short i = 0; i < lwp_uring_buffer_count; ++ i)
+		buffer_recycle (uring, i);
+
+	uring->sync = lw_sync_new ();
+
+	return uring;
+}
+
+/* Submission queue; all of these need the lock */
+
+static unsigned int sq_space (struct _lwp_uring * uring)
+{
+	return uring->sq_entries - (uring->sq_local_tail
+		- atomic_load_explicit (uring->sq_head, memory_order_acquire));
+}
+
+/* The kernel doesn't see the SQE until sq_publish */
+static struct io_uring_sqe * sqe_get (struct _lwp_uring * uring)
+{
+	if (sq_space (uring) == 0)
+		return NULL;
+
+	struct io_uring_sqe * sqe = &uring->sqes [uring->sq_local_tail ++ & uring->sq_mask];
+	memset (sqe, 0, sizeof (*sqe));
+
+	return sqe;
+}
+
+static void sq_publish (struct _lwp_uring * uring)
+{
+	atomic_store_explicit (uring->sq_tail, uring->sq_local_tail, memory_order_release);
+}
+
+static void sq_submit (struct _lwp_uring * uring)
+{
+	sq_publish (uring);
+
+	unsigned int to_submit = uring->sq_local_tail
+		- atomic_load_explicit (uring->sq_head, memory_order_acquire);
+
+	while (to_submit > 0 && uring_enter (uring->fd, to_submit, 0, 0) == -1)
+	{
+		if (errno != EINTR)
+		{
+			/* EBUSY or EAGAIN; they go with the next drain instead */
+			lwp_trace ("io_uring_enter failed to submit with error %d", errno);
+			break;
+		}
+	}
+}
+
+/* Makes room by submitting what's there if the queue is full. That can still leave it
+ * full if the kernel won't take more (EBUSY while the CQ overflows, or EAGAIN), and
+ * then callers defer what they were doing to the next drain, which reaps first.
+ */
+static struct io_uring_sqe * sqe_get_wait (struct _lwp_uring * uring)
+{
+	struct io_uring_sqe * sqe = sqe_get (uring);
+
+	if (!sqe)
+	{
+		sq_submit (uring);
+		sqe = sqe_get (uring);
+	}
+
+	return sqe;
+}
+
+/* Once SQEs are ready: unless this thread is in the middle of dispatching the
+ * queue's events, they go to the kernel now
+ */
+static void sq_done (lwp_eventqueue queue)
+{
+	if (dispatching_queue == queue)
+		sq_publish (queue->uring);
+	else
+		sq_submit (queue->uring);
+}
+
+/* Polls */
+
+static void poll_defer (struct _lwp_uring * uring, struct _lwp_uring_poll * poll)
+{
+	if (poll->deferred)
+		return;
+
+	poll->deferred = lw_true;
+	poll->next_deferred = uring->deferred_polls;
+	uring->deferred_polls = poll;
+}
+
+static void poll_arm (struct _lwp_uring * uring, struct _lwp_uring_poll * poll)
+{
+	struct io_uring_sqe * sqe = sqe_get_wait (uring);
+
+	if (!sqe)
+	{
+		poll_defer (uring, poll);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = poll->fd;
+	sqe->len = IORING_POLL_ADD_MULTI | (poll->events & EPOLLET ? 0 : IORING_POLL_ADD_LEVEL);
+	sqe->poll32_events = poll->events & ~EPOLLET; /* the EPOLL and POLL flags match */
+	sqe->user_data = (__u64) (uintptr_t) poll;
+
+	poll->armed = lw_true;
+}
+
+/* For a removed poll; it's freed when its final completion turns up */
+static void poll_disarm (struct _lwp_uring * uring, struct _lwp_uring_poll * poll)
+{
+	struct io_uring_sqe * sqe = sqe_get_wait (uring);
+
+	if (!sqe)
+	{
+		poll_defer (uring, poll);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (__u64) (uintptr_t) poll;
+}
+
+static void poll_remove (struct _lwp_uring * uring, int fd)
+{
+	if (fd < 0 || fd >= uring->num_polls || !uring->polls [fd])
+		return;
+
+	struct _lwp_uring_poll * poll = uring->polls [fd];
+	uring->polls [fd] = NULL;
+
+	poll->removed = lw_true;
+
+	/* If it's waiting to be armed or removed, deferred_submit sees it's removed */
+	if (poll->deferred)
+		return;
+
+	if (poll->armed)
+		poll_disarm (uring, poll);
+	else
+		free (poll);
+}
+
+void lwp_uring_watch (lwp_eventqueue queue, int fd, unsigned int events, void * tag)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	if (fd < 0)
+		return;
+
+	lw_sync_lock (uring->sync);
+
+	poll_remove (uring, fd);
+
+	if (fd >= uring->num_polls)
+	{
+		int num_polls = uring->num_polls ? uring->num_polls * 2 : 64;
+
+		if (num_polls <= fd)
+			num_polls = fd + 1;
+
+		struct _lwp_uring_poll ** polls = (struct _lwp_uring_poll **) realloc
+			(uring->polls, num_polls * sizeof (*polls));
+
+		if (!polls)
+		{
+			always_log ("Couldn't watch FD %d, out of memory.", fd);
+			lw_sync_release (uring->sync);
+			return;
+		}
+
+		memset (polls + uring->num_polls, 0, (num_polls - uring->num_polls) * sizeof (*polls));
+
+		uring->polls = polls;
+		uring->num_polls = num_polls;
+	}
+
+	struct _lwp_uring_poll * poll = (struct _lwp_uring_poll *) calloc (sizeof (*poll), 1);
+
+	if (poll)
+	{
+		poll->fd = fd;
+		poll->events = events;
+		poll->tag = tag;
+
+		uring->polls [fd] = poll;
+
+		poll_arm (uring, poll);
+	}
+
+	sq_done (queue);
+
+	lw_sync_release (uring->sync);
+}
+
+void lwp_uring_unwatch (lwp_eventqueue queue, int fd)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lw_sync_lock (uring->sync);
+
+	poll_remove (uring, fd);
+	sq_done (queue);
+
+	lw_sync_release (uring->sync);
+}
+
+/* Ops */
+
+static lwp_eventqueue_op op_new (struct _lwp_uring * uring, int type, int fd,
+								 lwp_eventqueue_op_callback callback, void * tag)
+{
+	lwp_eventqueue_op op = (lwp_eventqueue_op) calloc (sizeof (*op), 1);
+
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->fd = fd;
+	op->callback = callback;
+	op->tag = tag;
+	op->close_fd = -1;
+
+	lw_sync_lock (uring->sync);
+	++ uring->num_ops;
+	lw_sync_release (uring->sync);
+
+	return op;
+}
+
+static void op_defer (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	if (op->deferred)
+		return;
+
+	op->deferred = lw_true;
+	op->next_deferred = uring->deferred_ops;
+	uring->deferred_ops = op;
+}
+
+static void op_free (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	-- uring->num_ops;
+
+	if (op->deferred)
+	{
+		lwp_eventqueue_op * link = &uring->deferred_ops;
+
+		while (*link != op)
+			link = &(*link)->next_deferred;
+
+		*link = op->next_deferred;
+	}
+
+	lwp_heapbuffer_free (&op->owned);
+	lwp_heapbuffer_free (&op->unsent);
+
+	free (op);
+}
+
+static void op_prep (lwp_eventqueue_op op, struct io_uring_sqe * sqe)
+{
+	sqe->fd = op->fd;
+	sqe->user_data = (__u64) (uintptr_t) op | lwp_uring_user_op;
+
+	switch (op->type)
+	{
+	case lwp_uring_op_accept:
+
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		break;
+
+	case lwp_uring_op_recv:
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = lwp_uring_buffer_group;
+		break;
+
+	case lwp_uring_op_recvfrom:
+
+		/* Each buffer starts with an io_uring_recvmsg_out, then the address */
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (__u64) (uintptr_t) &op->msg;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = lwp_uring_buffer_group;
+		break;
+
+	case lwp_uring_op_send:
+
+		/* WAITALL, so the kernel keeps at it until everything's gone */
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (__u64) (uintptr_t) lwp_heapbuffer_buffer (op->buffer);
+		sqe->len = (__u32) lwp_heapbuffer_length (op->buffer);
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+		op->sealed = lw_true;
+		break;
+
+	case lwp_uring_op_sendto:
+
+		/* As with sendto, a datagram there's no room for is dropped rather than waited on */
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (__u64) (uintptr_t) &op->msg;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+		break;
+	};
+
+	op->armed = lw_true;
+}
+
+/* For a detached op the kernel has */
+static void op_cancel (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	struct io_uring_sqe * sqe = sqe_get_wait (uring);
+
+	if (!sqe)
+	{
+		op_defer (uring, op);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (__u64) (uintptr_t) op | lwp_uring_user_op;
+}
+
+static lw_bool op_arm (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	struct io_uring_sqe * sqe = sqe_get_wait (uring);
+
+	if (!sqe)
+		return lw_false;
+
+	op_prep (op, sqe);
+
+	return lw_true;
+}
+
+static void pending_push (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	lwp_eventqueue_op * link = &uring->pending;
+
+	while (*link)
+		link = &(*link)->next_pending;
+
+	op->next_pending = NULL;
+	*link = op;
+}
+
+static lw_bool pending_remove (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	for (lwp_eventqueue_op * link = &uring->pending; *link; link = &(*link)->next_pending)
+	{
+		if (*link == op)
+		{
+			*link = op->next_pending;
+			return lw_true;
+		}
+	}
+
+	return lw_false;
+}
+
+/* Prepares the held back sends. A socket's datagrams are linked one behind the
+ * other, so they go in the order they were sent, and the rest are dropped
+ * (as -ECANCELED) if one can't go.
+ */
+static void pending_submit (struct _lwp_uring * uring)
+{
+	while (uring->pending)
+	{
+		lwp_eventqueue_op op = uring->pending;
+
+		struct io_uring_sqe * sqe = sqe_get_wait (uring);
+
+		if (!sqe)
+			return; /* try again at the next drain */
+
+		uring->pending = op->next_pending;
+
+		op_prep (op, sqe);
+
+		if (op->type != lwp_uring_op_sendto)
+			continue;
+
+		for (lwp_eventqueue_op * link = &uring->pending; *link; )
+		{
+			lwp_eventqueue_op next = *link;
+
+			if (next->type != lwp_uring_op_sendto || next->fd != op->fd)
+			{
+				link = &next->next_pending;
+				continue;
+			}
+
+			struct io_uring_sqe * next_sqe = sqe_get (uring);
+
+			/* Out of room, so this chain ends; the next starts after submitting */
+			if (!next_sqe)
+				break;
+
+			*link = next->next_pending;
+
+			sqe->flags |= IOSQE_IO_LINK;
+			op_prep (next, sqe = next_sqe);
+		}
+	}
+}
+
+/* Prepares a close chain's SQEs, if there's room for them all. The SQEs are hard
+ * linked, so the close happens even if the send fails.
+ */
+static lw_bool close_prep (struct _lwp_uring * uring, lwp_eventqueue_op op)
+{
+	size_t size = lwp_heapbuffer_length (&op->owned);
+	unsigned int needed = (size > 0 ? 1 : 0) + (op->close_fd != -1 ? 2 : 0);
+
+	if (sq_space (uring) < needed)
+		sq_submit (uring);
+
+	if (sq_space (uring) < needed)
+		return lw_false;
+
+	const __u64 user_data = (__u64) (uintptr_t) op | lwp_uring_user_op;
+
+	/* Only the last SQE's completion comes back to the op; the others post one only on failure */
+	const __u8 link_flags = IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+
+	struct io_uring_sqe * sqe;
+
+	if (size > 0)
+	{
+		sqe = sqe_get (uring);
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = op->fd;
+		sqe->addr = (__u64) (uintptr_t) lwp_heapbuffer_buffer (&op->owned);
+		sqe->len = (__u32) size;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+		if (op->close_fd != -1)
+			sqe->flags = link_flags;
+		else
+			sqe->user_data = user_data;
+	}
+
+	if (op->close_fd != -1)
+	{
+		sqe = sqe_get (uring);
+
+		sqe->opcode = IORING_OP_SHUTDOWN;
+		sqe->fd = op->close_fd;
+		sqe->len = SHUT_RDWR;
+		sqe->flags = link_flags;
+
+		sqe = sqe_get (uring);
+
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = op->close_fd;
+		sqe->user_data = user_data;
+
+		op->close_fd = -1;
+	}
+
+	op->sealed = op->armed = lw_true;
+
+	return lw_true;
+}
+
+/* Sends op->unsent, then shuts down and closes op->close_fd, without waiting on either */
+static void close_chain (lwp_eventqueue queue, lwp_eventqueue_op op)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lwp_heapbuffer_free (&op->owned);
+
+	op->owned = op->unsent;
+	op->unsent = NULL;
+	op->buffer = &op->owned;
+	op->type = lwp_uring_op_close;
+
+	if (lwp_heapbuffer_length (&op->owned) == 0 && op->close_fd == -1)
+	{
+		op_free (uring, op);
+		return;
+	}
+
+	/* The fd stays open until it gets to the kernel, so its number isn't reused */
+	if (close_prep (uring, op))
+		sq_done (queue);
+	else
+		op_defer (uring, op);
+}
+
+/* Lock held. Has another go at what couldn't get an SQE before; anything that still
+ * can't goes back on the lists for next time.
+ */
+static void deferred_submit (struct _lwp_uring * uring)
+{
+	struct _lwp_uring_poll * polls = uring->deferred_polls;
+	uring->deferred_polls = NULL;
+
+	while (polls)
+	{
+		struct _lwp_uring_poll * poll = polls;
+		polls = poll->next_deferred;
+
+		poll->deferred = lw_false;
+
+		if (!poll->removed)
+			poll_arm (uring, poll);
+		else if (poll->armed)
+			poll_disarm (uring, poll);
+		else
+			free (poll);
+	}
+
+	lwp_eventqueue_op ops = uring->deferred_ops;
+	uring->deferred_ops = NULL;
+
+	while (ops)
+	{
+		lwp_eventqueue_op op = ops;
+		ops = op->next_deferred;
+
+		op->deferred = lw_false;
+
+		if (op->type == lwp_uring_op_close)
+		{
+			if (!close_prep (uring, op))
+				op_defer (uring, op);
+		}
+		else if (op->detached)
+		{
+			/* Otherwise its final completion has turned up, and frees it */
+			if (op->armed)
+				op_cancel (uring, op);
+		}
+		else if (!op_arm (uring, op))
+			op_defer (uring, op);
+	}
+}
+
+lw_bool lwp_eventqueue_has_ops (lwp_eventqueue queue)
+{
+	return queue->uring != NULL;
+}
+
+lw_bool lwp_eventqueue_dispatching (lwp_eventqueue queue)
+{
+	return dispatching_queue == queue;
+}
+
+void lwp_eventqueue_flush (lwp_eventqueue queue)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lw_sync_lock (uring->sync);
+
+	pending_submit (uring);
+	deferred_submit (uring);
+	sq_submit (uring);
+
+	lw_sync_release (uring->sync);
+}
+
+lwp_eventqueue lwp_eventqueue_dispatch (lwp_eventqueue queue)
+{
+	lwp_eventqueue previous = dispatching_queue;
+
+	dispatching_queue = queue;
+
+	if (previous && previous != queue && previous->uring)
+		lwp_eventqueue_flush (previous);
+
+	return previous;
+}
+
+static lwp_eventqueue_op multishot (lwp_eventqueue queue, int type, int fd,
+									lwp_eventqueue_op_callback callback, void * tag)
+{
+	struct _lwp_uring * uring = queue->uring;
+	lwp_eventqueue_op op = op_new (uring, type, fd, callback, tag);
+
+	if (!op)
+		return NULL;
+
+	lw_sync_lock (uring->sync);
+
+	if (op_arm (uring, op))
+		sq_done (queue);
+	else
+		op_defer (uring, op);
+
+	lw_sync_release (uring->sync);
+
+	return op;
+}
+
+lwp_eventqueue_op lwp_eventqueue_accept (lwp_eventqueue queue, int fd,
+										 lwp_eventqueue_op_callback callback, void * tag)
+{
+	return multishot (queue, lwp_uring_op_accept, fd, callback, tag);
+}
+
+lwp_eventqueue_op lwp_eventqueue_recv (lwp_eventqueue queue, int fd,
+									   lwp_eventqueue_op_callback callback, void * tag)
+{
+	return multishot (queue, lwp_uring_op_recv, fd, callback, tag);
+}
+
+lwp_eventqueue_op lwp_eventqueue_recvfrom (lwp_eventqueue queue, int fd,
+										   lwp_eventqueue_op_callback callback, void * tag)
+{
+	struct _lwp_uring * uring = queue->uring;
+	lwp_eventqueue_op op = op_new (uring, lwp_uring_op_recvfrom, fd, callback, tag);
+
+	if (!op)
+		return NULL;
+
+	/* Only the lengths matter; the kernel puts the address in the buffer */
+	op->msg.msg_namelen = sizeof (struct sockaddr_storage);
+
+	lw_sync_lock (uring->sync);
+
+	if (op_arm (uring, op))
+		sq_done (queue);
+	else
+		op_defer (uring, op);
+
+	lw_sync_release (uring->sync);
+
+	return op;
+}
+
+lwp_eventqueue_op lwp_eventqueue_send (lwp_eventqueue queue, int fd, lwp_heapbuffer * buffer,
+									   lwp_eventqueue_op_callback callback, void * tag)
+{
+	struct _lwp_uring * uring = queue->uring;
+	lwp_eventqueue_op op = op_new (uring, lwp_uring_op_send, fd, callback, tag);
+
+	if (!op)
+		return NULL;
+
+	op->buffer = buffer;
+
+	lw_sync_lock (uring->sync);
+
+	if (dispatching_queue == queue || !op_arm (uring, op))
+		pending_push (uring, op);
+	else
+		sq_submit (uring);
+
+	lw_sync_release (uring->sync);
+
+	return op;
+}
+
+lw_bool lwp_eventqueue_send_sealed (lwp_eventqueue_op op)
+{
+	return op->sealed;
+}
+
+lw_bool lwp_eventqueue_sendto (lwp_eventqueue queue, int fd,
+							   const struct sockaddr * address, socklen_t address_length,
+							   const char * buffer, size_t size,
+							   lwp_eventqueue_op_callback callback, void * tag)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	if (address_length > sizeof (struct sockaddr_storage))
+		return lw_false;
+
+	lwp_eventqueue_op op = op_new (uring, lwp_uring_op_sendto, fd, callback, tag);
+
+	if (!op)
+		return lw_false;
+
+	if (!lwp_heapbuffer_add (&op->owned, buffer, size))
+	{
+		lw_sync_lock (uring->sync);
+		op_free (uring, op);
+		lw_sync_release (uring->sync);
+
+		return lw_false;
+	}
+
+	memcpy (&op->address, address, address_length);
+
+	op->iov.iov_base = lwp_heapbuffer_buffer (&op->owned);
+	op->iov.iov_len = size;
+
+	op->msg.msg_name = &op->address;
+	op->msg.msg_namelen = address_length;
+	op->msg.msg_iov = &op->iov;
+	op->msg.msg_iovlen = 1;
+
+	lw_sync_lock (uring->sync);
+
+	if (dispatching_queue == queue || !op_arm (uring, op))
+		pending_push (uring, op);
+	else
+		sq_submit (uring);
+
+	lw_sync_release (uring->sync);
+
+	return lw_true;
+}
+
+/* Lock held. A send the kernel may still be reading from keeps its buffer. */
+static void op_take_buffer (lwp_eventqueue_op op)
+{
+	if (op->buffer == &op->owned)
+		return;
+
+	op->owned = *op->buffer;
+	*op->buffer = NULL;
+	op->buffer = &op->owned;
+}
+
+void lwp_eventqueue_cancel (lwp_eventqueue queue, lwp_eventqueue_op op)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lw_sync_lock (uring->sync);
+
+	op->detached = lw_true;
+
+	if (op->armed)
+	{
+		if (op->type == lwp_uring_op_send)
+			op_take_buffer (op);
+
+		op_cancel (uring, op);
+		sq_done (queue);
+	}
+	else if (!op->final_pending)
+	{
+		/* Never went to the kernel, or it's finished with it */
+		pending_remove (uring, op);
+		op_free (uring, op);
+	}
+
+	lw_sync_release (uring->sync);
+}
+
+void lwp_eventqueue_close (lwp_eventqueue queue, int fd, lw_bool close_fd,
+						   lwp_eventqueue_op send, lwp_heapbuffer * unsent)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lw_sync_lock (uring->sync);
+
+	if (send && (send->armed || send->final_pending))
+	{
+		/* The rest goes once the kernel is done with this; see lwp_eventqueue_complete */
+		op_take_buffer (send);
+
+		send->detached = lw_true;
+		send->unsent = *unsent;
+		send->close_fd = close_fd ? fd : -1;
+
+		*unsent = NULL;
+
+		lw_sync_release (uring->sync);
+		return;
+	}
+
+	lwp_eventqueue_op op = send;
+
+	if (op)
+	{
+		/* Still held back, so its buffer goes first */
+		pending_remove (uring, op);
+		op_take_buffer (op);
+
+		op->unsent = op->owned;
+		op->owned = NULL;
+
+		lwp_heapbuffer_add (&op->unsent, lwp_heapbuffer_buffer (unsent), lwp_heapbuffer_length (unsent));
+		lwp_heapbuffer_free (unsent);
+	}
+	else if (lwp_heapbuffer_length (unsent) > 0)
+	{
+		lw_sync_release (uring->sync);
+
+		if (! (op = op_new (uring, lwp_uring_op_send, fd, NULL, NULL)))
+		{
+			lwp_heapbuffer_free (unsent);
+			lw_sync_lock (uring->sync);
+		}
+		else
+		{
+			lw_sync_lock (uring->sync);
+
+			op->unsent = *unsent;
+			*unsent = NULL;
+		}
+	}
+
+	if (!op)
+	{
+		/* Nothing to wait for; the fd's number mustn't be reused before anything
+		 * using it gets to the kernel
+		 */
+		if (close_fd)
+		{
+			lwp_eventqueue_flush (queue);
+
+			shutdown (fd, SHUT_RDWR);
+			close (fd);
+		}
+
+		lw_sync_release (uring->sync);
+		return;
+	}
+
+	op->detached = lw_true;
+	op->close_fd = close_fd ? fd : -1;
+
+	close_chain (queue, op);
+
+	lw_sync_release (uring->sync);
+}
+
+/* Lock held */
+static int reap (lwp_eventqueue queue, int max_events, lwp_eventqueue_event * events)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	unsigned int head = atomic_load_explicit (uring->cq_head, memory_order_relaxed),
+		tail = atomic_load_explicit (uring->cq_tail, memory_order_acquire);
+
+	int count = 0;
+
+	while (head != tail && count < max_events)
+	{
+		struct io_uring_cqe * cqe = &uring->cqes [head ++ & uring->cq_mask];
+
+		const lw_bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+		if (!cqe->user_data)
+			continue; /* a poll remove, cancel, or failed link in a close chain */
+
+		if (cqe->user_data & lwp_uring_user_op)
+		{
+			lwp_eventqueue_op op = (lwp_eventqueue_op) (uintptr_t) (cqe->user_data & ~ (__u64) lwp_uring_user_op);
+
+			if (!more)
+			{
+				op->armed = lw_false;
+				op->final_pending = lw_true;
+			}
+
+			struct _lwp_uring_completion * completion = &uring->completions [count];
+
+			completion->op = op;
+			completion->res = cqe->res;
+			completion->flags = cqe->flags;
+
+			events [count].events = lwp_uring_event_op;
+			events [count ++].data.ptr = completion;
+
+			continue;
+		}
+
+		struct _lwp_uring_poll * poll = (struct _lwp_uring_poll *) (uintptr_t) cqe->user_data;
+
+		if (!more)
+			poll->armed = lw_false;
+
+		if (poll->removed)
+		{
+			/* If its remove is deferred, deferred_submit frees it instead */
+			if (!more && !poll->deferred)
+				free (poll);
+
+			continue;
+		}
+
+		if (cqe->res < 0 && cqe->res != -ECANCELED)
+		{
+			lwp_trace ("io_uring poll for FD %d failed with error %d", poll->fd, -cqe->res);
+
+			if (!more)
+			{
+				uring->polls [poll->fd] = NULL;
+				free (poll);
+			}
+
+			continue;
+		}
+
+		if (cqe->res > 0)
+		{
+			events [count].events = (unsigned int) cqe->res;
+			events [count ++].data.ptr = poll->tag;
+		}
+
+		/* Ended by the kernel rather than removed, e.g. after the CQ overflowed */
+		if (!more)
+			poll_arm (uring, poll);
+	}
+
+	atomic_store_explicit (uring->cq_head, head, memory_order_release);
+
+	return count;
+}
+
+int lwp_uring_drain (lwp_eventqueue queue, lw_bool block,
+					 int max_events, lwp_eventqueue_event * events)
+{
+	struct _lwp_uring * uring = queue->uring;
+
+	lw_sync_lock (uring->sync);
+
+	if (uring->num_completions < max_events)
+	{
+		struct _lwp_uring_completion * completions = (struct _lwp_uring_completion *) realloc
+			(uring->completions, max_events * sizeof (*completions));
+
+		if (!completions)
+		{
+			lw_sync_release (uring->sync);
+
+			errno = ENOMEM;
+			return -1;
+		}
+
+		uring->completions = completions;
+		uring->num_completions = max_events;
+	}
+
+	/* Only the dispatching thread may seal its sends, as it could still be adding to them */
+	if (dispatching_queue == queue)
+		pending_submit (uring);
+
+	deferred_submit (uring);
+
+	/* Whatever's still held back needs the kernel to take more, so keep coming back to it */
+	if (uring->deferred_polls || uring->deferred_ops
+			|| (dispatching_queue == queue && uring->pending))
+	{
+		block = lw_false;
+	}
+
+	sq_publish (uring);
+
+	unsigned int to_submit = uring->sq_local_tail
+		- atomic_load_explicit (uring->sq_head, memory_order_acquire);
+
+	int count = reap (queue, max_events, events);
+
+	lw_sync_release (uring->sync);
+
+	if (count > 0)
+	{
+		if (to_submit > 0)
+			uring_enter (uring->fd, to_submit, 0, 0);
+
+		return count;
+	}
+
+	unsigned int flags = 0;
+
+	if (block || atomic_load_explicit (uring->sq_flags, memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	if (to_submit == 0 && !flags)
+		return 0;
+
+	if (uring_enter (uring->fd, to_submit, block ? 1 : 0, flags) == -1
+			&& errno != EBUSY && errno != EAGAIN)
+	{
+		return -1;
+	}
+
+	lw_sync_lock (uring->sync);
+	count = reap (queue, max_events, events);
+	lw_sync_release (uring->sync);
+
+	return count;
+}
+
+lw_bool lwp_eventqueue_event_op (lwp_eventqueue_event event)
+{
+	return (event.events & lwp_uring_event_op) != 0;
+}
+
+/* Rearming a multishot op the kernel has ended. It ends it on -ENOBUFS when out of
+ * provided buffers, after a CQ overflow, and with -ECANCELED when the thread that
+ * submitted it exits; the rest are left to the owner.
+ */
+static lw_bool should_rearm (lwp_eventqueue_op op, int res)
+{
+	switch (op->type)
+	{
+	case lwp_uring_op_accept:
+		return res >= 0 || res == -ENOBUFS || res == -ECANCELED;
+
+	case lwp_uring_op_recv:
+		return res > 0 || res == -ENOBUFS || res == -ECANCELED;
+
+	case lwp_uring_op_recvfrom:
+
+		/* A datagram socket's errors are for one datagram, not the socket */
+		return res != -EBADF && res != -EINVAL && res != -ENOTSOCK;
+
+	default:
+		return lw_false;
+	};
+}
+
+void lwp_eventqueue_complete (lwp_eventqueue queue, lwp_eventqueue_event event)
+{
+	struct _lwp_uring * uring = queue->uring;
+	struct _lwp_uring_completion * completion = (struct _lwp_uring_completion *) event.data.ptr;
+
+	lwp_eventqueue_op op = completion->op;
+
+	char * buffer = NULL, * data = NULL;
+	unsigned short buffer_id = 0;
+
+	int res = completion->res;
+
+	if (completion->flags & IORING_CQE_F_BUFFER)
+	{
+		buffer_id = (unsigned short) (completion->flags >> IORING_CQE_BUFFER_SHIFT);
+		data = buffer = uring->buffers + (size_t) buffer_id * lwp_uring_buffer_size;
+	}
+
+	if (op->type == lwp_uring_op_recvfrom && buffer && res >= 0)
+	{
+		/* recvmsg_out, then the address, then the datagram (cut short if it didn't fit) */
+		struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *) buffer;
+
+		const int header = (int) (sizeof (*out) + sizeof (struct sockaddr_storage));
+
+		data = buffer + sizeof (*out);
+
+		res = res < header ? 0 : res - header;
+
+		if (out->payloadlen < (unsigned int) res)
+			res = (int) out->payloadlen;
+	}
+
+	if (!op->detached)
+		op->callback (op->tag, res, data);
+	else if (op->type == lwp_uring_op_accept && completion->res >= 0)
+		close (completion->res); /* accepted before the cancel got there */
+
+	if (buffer)
+		buffer_recycle (uring, buffer_id);
+
+	if (completion->flags & IORING_CQE_F_MORE)
+		return;
+
+	lw_sync_lock (uring->sync);
+
+	op->final_pending = lw_false;
+
+	if (op->detached)
+	{
+		if (op->type == lwp_uring_op_send
+				&& (op->close_fd != -1 || lwp_heapbuffer_length (&op->unsent) > 0))
+		{
+			close_chain (queue, op);
+		}
+		else
+			op_free (uring, op);
+	}
+	else if (should_rearm (op, completion->res))
+	{
+		if (op_arm (uring, op))
+			sq_done (queue);
+		else
+			op_defer (uring, op);
+	}
+	else if (op->type == lwp_uring_op_send || op->type == lwp_uring_op_sendto)
+	{
+		/* Done with; the owner's callback has already forgotten it */
+		op_free (uring, op);
+	}
+
+	/* Otherwise it's a multishot op that's over, and waits for its owner to cancel it */
+
+	lw_sync_release (uring->sync);
+}
+
+#endif
+
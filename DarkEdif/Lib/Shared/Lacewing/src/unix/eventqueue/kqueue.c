@@ -112,6 +112,11 @@ lw_bool lwp_eventqueue_event_write_ready (lwp_eventqueue_event event)
 	return event.filter == EVFILT_WRITE;
 }
 
+lw_bool lwp_eventqueue_event_hangup (lwp_eventqueue_event event)
+{
+	return (event.flags & (EV_EOF | EV_ERROR)) != 0;
+}
+
 void * lwp_eventqueue_event_tag (lwp_eventqueue_event event)
 {
 	return event.udata;
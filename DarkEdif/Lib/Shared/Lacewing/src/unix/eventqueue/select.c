@@ -206,6 +206,12 @@ lw_bool lwp_eventqueue_event_write_ready (lwp_eventqueue_event event)
 	return event.flags & event_flag_write_ready;
 }
 
+lw_bool lwp_eventqueue_event_hangup (lwp_eventqueue_event event)
+{
+	/* select doesn't say, so always read to EAGAIN */
+	return lw_true;
+}
+
 void * lwp_eventqueue_event_tag (lwp_eventqueue_event event)
 {
 	return event.tag;
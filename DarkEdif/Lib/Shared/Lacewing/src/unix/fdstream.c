@@ -87,6 +87,13 @@ static void read_ready (void * tag)
 
 	lw_bool close_stream = lw_false;
 
+	/* Watches are edge-triggered, so reads normally go on until EAGAIN. When the event pump
+	 * says the peer hasn't hung up, a short read from a socket has emptied it, and the
+	 * next data will raise a new event, so the read() that would return EAGAIN is skipped.
+	 */
+	lw_bool stop_on_short_read = (ctx->flags & lwp_fdstream_flag_is_socket) && ctx->stream.watch &&
+		lw_stream_pump ((lw_stream) ctx)->def == &def_eventpump && ctx->stream.watch->short_read_drains;
+
 	while (ctx->reading_size == SIZE_MAX || ctx->reading_size > 0)
 	{
 		if (ctx->fd == -1)
@@ -130,6 +137,9 @@ static void read_ready (void * tag)
 
 		if (! (ctx->flags & lwp_fdstream_flag_reading))
 		 break;
+
+		if (stop_on_short_read && (size_t)bytes < to_read)
+		 break;
 	}
 
 	ctx->flags &= ~ lwp_fdstream_flag_reading;
@@ -141,6 +151,273 @@ static void read_ready (void * tag)
 		lw_stream_close ((lw_stream) ctx, lw_true);
 }
 
+#ifdef _lacewing_use_io_uring
+
+/* How much a socket's writes can gather before sink_data pushes back, so the stream
+ * queues the rest and retries once the send in progress is done. Like the socket's
+ * own send buffer, it's what lets a broadcast go out without queueing in the stream.
+ */
+#define ring_send_limit (1024 * 1024)
+
+/* Writes at least this big are tried on the socket straight away if no send is in
+ * progress, rather than copied for the queue to send at the end of the dispatch.
+ * Batching only pays off for small writes, and saves copying large ones.
+ */
+#define ring_direct_size 4096
+
+static void ring_on_received (void * tag, int result, char * buffer);
+
+/* Passes data on, as far as reading_size allows; returns how much went */
+static size_t ring_deliver (lw_fdstream ctx, const char * buffer, size_t size)
+{
+	if (ctx->fd == -1 || ctx->reading_size == 0 || size == 0)
+		return 0;
+
+	if (ctx->reading_size != SIZE_MAX)
+	{
+		if (size > ctx->reading_size)
+			size = ctx->reading_size;
+
+		ctx->reading_size -= size;
+	}
+
+	lw_stream_data ((lw_stream) ctx, buffer, size);
+
+	return size;
+}
+
+/* read_ready for the ring: passes on what was kept from before, then buffer, keeping
+ * what reading_size doesn't allow. Starts receiving if reading and not already.
+ */
+static void ring_read (lw_fdstream ctx, const char * buffer, size_t size)
+{
+	if (ctx->flags & lwp_fdstream_flag_reading)
+	{
+		/* Already passing data on further up the stack; it'll go after that */
+		lwp_heapbuffer_add (&ctx->received, buffer, size);
+		return;
+	}
+
+	ctx->flags |= lwp_fdstream_flag_reading;
+
+	lwp_retain (ctx, "fdstream ring_read");
+
+	lwp_heapbuffer kept = ctx->received;
+	ctx->received = NULL;
+
+	size_t kept_size = lwp_heapbuffer_length (&kept),
+		kept_done = ring_deliver (ctx, lwp_heapbuffer_buffer (&kept), kept_size),
+		done = 0;
+
+	if (kept_done == kept_size)
+		done = ring_deliver (ctx, buffer, size);
+
+	if (ctx->fd == -1)
+	{
+		/* Closed while passing data on */
+		lwp_heapbuffer_free (&ctx->received);
+	}
+	else if (kept_done < kept_size || done < size || ctx->received)
+	{
+		lwp_heapbuffer rest = NULL;
+
+		if (kept_done < kept_size)
+			lwp_heapbuffer_add (&rest, lwp_heapbuffer_buffer (&kept) + kept_done, kept_size - kept_done);
+
+		if (done < size)
+			lwp_heapbuffer_add (&rest, buffer + done, size - done);
+
+		lwp_heapbuffer_add (&rest, lwp_heapbuffer_buffer (&ctx->received),
+			lwp_heapbuffer_length (&ctx->received));
+
+		lwp_heapbuffer_free (&ctx->received);
+		ctx->received = rest;
+	}
+
+	lwp_heapbuffer_free (&kept);
+
+	ctx->flags &= ~ lwp_fdstream_flag_reading;
+
+	/* Once started, receiving goes on until close; anything that arrives while
+	 * not reading is kept in received
+	 */
+	if (ctx->ring && ctx->fd != -1 && ctx->reading_size > 0 && !ctx->recv_op)
+		ctx->recv_op = lwp_eventqueue_recv (ctx->ring, ctx->fd, ring_on_received, ctx);
+
+	lwp_release (ctx, "fdstream ring_read");
+}
+
+static void ring_on_received (void * tag, int result, char * buffer)
+{
+	lw_fdstream ctx = (lw_fdstream) tag;
+
+	if (result > 0)
+	{
+		ring_read (ctx, buffer, (size_t) result);
+		return;
+	}
+
+	/* The queue receives again for these */
+	if (result == -ENOBUFS || result == -ECANCELED)
+		return;
+
+	lw_trace ("ring_on_received: recv for FD %d returned %d, closing stream", ctx->fd, result);
+
+	lwp_eventqueue_cancel (ctx->ring, ctx->recv_op);
+	ctx->recv_op = NULL;
+
+	lwp_retain (ctx, "fdstream ring_on_received");
+	lw_stream_close ((lw_stream) ctx, lw_true);
+	lwp_release (ctx, "fdstream ring_on_received");
+}
+
+static void ring_on_sent (void * tag, int result, char * buffer)
+{
+	lw_fdstream ctx = (lw_fdstream) tag;
+
+	size_t size = lwp_heapbuffer_length (&ctx->send_buffer);
+
+	ctx->send_op = NULL;
+
+	lwp_retain (ctx, "fdstream ring_on_sent");
+
+	if (result < 0 || (size_t) result < size)
+	{
+		lw_trace ("ring_on_sent: send for FD %d returned %d of " lwp_fmt_size ", closing stream",
+			ctx->fd, result, size);
+
+		lwp_heapbuffer_reset (&ctx->send_buffer);
+		lwp_heapbuffer_reset (&ctx->send_next);
+
+		lw_stream_close ((lw_stream) ctx, lw_true);
+	}
+	else
+	{
+		lwp_heapbuffer_reset (&ctx->send_buffer);
+
+		lwp_heapbuffer next = ctx->send_next;
+		ctx->send_next = ctx->send_buffer;
+		ctx->send_buffer = next;
+
+		if (lwp_heapbuffer_length (&ctx->send_buffer) > 0)
+		{
+			ctx->send_op = lwp_eventqueue_send (ctx->ring, ctx->fd,
+				&ctx->send_buffer, ring_on_sent, ctx);
+		}
+		else
+		{
+			/* All sent; what a backlog grew the buffers to isn't kept */
+			if (ctx->send_buffer && ctx->send_buffer->allocated > lwp_default_buffer_size)
+				lwp_heapbuffer_free (&ctx->send_buffer);
+
+			if (ctx->send_next && ctx->send_next->allocated > lwp_default_buffer_size)
+				lwp_heapbuffer_free (&ctx->send_next);
+		}
+
+		/* There may be data queued that sink_data pushed back */
+		lw_stream_retry ((lw_stream) ctx, lw_stream_retry_now);
+	}
+
+	lwp_release (ctx, "fdstream ring_on_sent");
+}
+
+/* sink_data for the ring; adds to the send in progress if the kernel doesn't have
+ * its buffer yet, or else the next one
+ */
+static size_t ring_sink (lw_fdstream ctx, const char * buffer, size_t size)
+{
+	lwp_heapbuffer * target = ctx->send_op && lwp_eventqueue_send_sealed (ctx->send_op)
+		? &ctx->send_next : &ctx->send_buffer;
+
+	size_t sent = 0, queued;
+
+	if (!ctx->send_op && size >= ring_direct_size)
+	{
+		/* If this fails, the queued send will fail the same way and close the stream */
+		ssize_t written = send (ctx->fd, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (written > 0)
+		{
+			if ((size_t) written == size)
+				return size;
+
+			sent = (size_t) written;
+			buffer += sent;
+			size -= sent;
+		}
+	}
+
+	queued = lwp_heapbuffer_length (target);
+
+	if (queued >= ring_send_limit)
+		return sent;
+
+	if (size > ring_send_limit - queued)
+		size = ring_send_limit - queued;
+
+	if (!lwp_heapbuffer_add (target, buffer, size))
+		return sent;
+
+	if (!ctx->send_op)
+	{
+		ctx->send_op = lwp_eventqueue_send (ctx->ring, ctx->fd,
+			&ctx->send_buffer, ring_on_sent, ctx);
+	}
+
+	return sent + size;
+}
+
+/* close for the ring. A graceful close leaves the queue to finish sending, then
+ * shut down and close the fd; an immediate one stops the send in progress, and sends
+ * what the kernel didn't have yet as far as it can without blocking.
+ */
+static void ring_close (lw_fdstream ctx, int fd, lw_bool immediate)
+{
+	lwp_eventqueue ring = ctx->ring;
+	lw_bool close_fd = fd != -1 && (ctx->flags & lwp_fdstream_flag_autoclose);
+
+	if (ctx->recv_op)
+	{
+		lwp_eventqueue_cancel (ring, ctx->recv_op);
+		ctx->recv_op = NULL;
+	}
+
+	lwp_heapbuffer_free (&ctx->received);
+
+	if (fd == -1)
+		;
+	else if (!immediate || close_fd)
+	{
+		/* What's been sunk is as good as in the socket's send buffer, so even an
+		 * immediate close sends it before shutting down, like close () would
+		 */
+		lwp_eventqueue_close (ring, fd, close_fd, ctx->send_op,
+			ctx->send_op ? &ctx->send_next : &ctx->send_buffer);
+	}
+	else if (ctx->send_op)
+	{
+		/* Not ours to close, and the owner takes it back now */
+		if (!lwp_eventqueue_send_sealed (ctx->send_op))
+		{
+			send (fd, lwp_heapbuffer_buffer (&ctx->send_buffer),
+				lwp_heapbuffer_length (&ctx->send_buffer), MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+
+		lwp_eventqueue_cancel (ring, ctx->send_op);
+	}
+
+	ctx->send_op = NULL;
+
+	lwp_heapbuffer_free (&ctx->send_buffer);
+	lwp_heapbuffer_free (&ctx->send_next);
+
+	ctx->ring = NULL;
+
+	lw_pump_remove_user (lw_stream_pump ((lw_stream) ctx));
+}
+
+#endif
+
 long lw_fdstream_get_fd_debug(lw_fdstream ctx)
 {
 	return ctx->fd;
@@ -158,6 +435,12 @@ void lw_fdstream_set_fd (lw_fdstream ctx, lw_fd fd, lw_pump_watch watch,
 	if ( (ctx->flags & lwp_fdstream_flag_autoclose) && ctx->fd != -1)
 		lw_stream_close ((lw_stream) ctx, lw_true);
 
+	#ifdef _lacewing_use_io_uring
+		/* Wasn't ours to close, but the queue is done with it */
+		if (ctx->ring)
+			ring_close (ctx, ctx->fd, lw_true);
+	#endif
+
 	ctx->fd = fd;
 
 	if (auto_close)
@@ -202,6 +485,22 @@ void lw_fdstream_set_fd (lw_fdstream ctx, lw_fd fd, lw_pump_watch watch,
 
 	lw_pump pump = lw_stream_pump ((lw_stream) ctx);
 
+	#ifdef _lacewing_use_io_uring
+
+		if ((ctx->flags & lwp_fdstream_flag_is_socket) && (ctx->ring = lwp_eventpump_ring (pump)))
+		{
+			/* The pump's event queue does the reads and writes, so no watch is needed */
+			if (watch)
+				lw_pump_remove (pump, watch);
+
+			lw_pump_add_user (pump);
+
+			ring_read (ctx, NULL, 0);
+			return;
+		}
+
+	#endif
+
 	if (watch)
 	{
 		/* Given an existing pump watch - change it to use our callbacks */
@@ -251,7 +550,7 @@ void lw_fdstream_nagle (lw_fdstream ctx, lw_bool enabled)
 	if (ctx->fd != -1)
 	{
 		int b = enabled ? 0 : 1;
-		lwp_setsockopt (ctx->fd, SOL_SOCKET, TCP_NODELAY, (char *) &b, sizeof (b));
+		lwp_setsockopt (ctx->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &b, sizeof (b));
 	}
 }
 
@@ -261,6 +560,11 @@ static size_t def_sink_data (lw_stream stream, const char * buffer, size_t size)
 
 	lwp_trace ("fdstream sink " lwp_fmt_size " bytes", size);
 
+	#ifdef _lacewing_use_io_uring
+		if (ctx->ring)
+			return ring_sink (ctx, buffer, size);
+	#endif
+
 	ssize_t written;
 
 	#ifdef HAVE_DECL_SO_NOSIGPIPE
@@ -284,6 +588,68 @@ static size_t def_sink_data (lw_stream stream, const char * buffer, size_t size)
 	return (size_t)written;
 }
 
+static size_t def_sink_datav (lw_stream stream, const char ** buffers,
+								const size_t * lengths, int count)
+{
+	lw_fdstream ctx = (lw_fdstream) stream;
+
+	#ifdef _lacewing_use_io_uring
+		if (ctx->ring)
+		{
+			size_t sunk = 0;
+
+			for (int i = 0; i < count; ++ i)
+			{
+				size_t sunk_buffer = ring_sink (ctx, buffers [i], lengths [i]);
+				sunk += sunk_buffer;
+
+				if (sunk_buffer < lengths [i])
+					break;
+			}
+
+			return sunk;
+		}
+	#endif
+
+	struct iovec iov [lwp_stream_max_gather];
+
+	if (count > lwp_stream_max_gather)
+		count = lwp_stream_max_gather;
+
+	for (int i = 0; i < count; ++ i)
+	{
+		iov [i].iov_base = (void *) buffers [i];
+		iov [i].iov_len = lengths [i];
+	}
+
+	ssize_t written;
+
+	#ifdef HAVE_DECL_SO_NOSIGPIPE
+		written = writev (ctx->fd, iov, count);
+	#else
+		if (ctx->flags & lwp_fdstream_flag_is_socket)
+		{
+			struct msghdr msg = {0};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+
+			written = sendmsg (ctx->fd, &msg, MSG_NOSIGNAL);
+		}
+		else
+			written = writev (ctx->fd, iov, count);
+	#endif
+
+	if (written == -1)
+	{
+		lwp_trace ("fdstream sank nothing!	writev failed: %d", errno);
+		return 0;
+	}
+
+	lwp_trace ("fdstream sank " lwp_fmt_size " bytes from %d buffers", (size_t)written, count);
+
+	return (size_t)written;
+}
+
 static lw_i64 def_sink_stream (lw_stream _dest,
 								lw_stream _src,
 								size_t size)
@@ -302,6 +668,12 @@ static lw_i64 def_sink_stream (lw_stream _dest,
 	lw_fdstream source = (lw_fdstream) _src;
 	lw_fdstream dest = (lw_fdstream) _dest;
 
+	/* Read and sink_data instead, so it goes in order with the ring's sends */
+	#ifdef _lacewing_use_io_uring
+		if (dest->ring)
+			return -1;
+	#endif
+
 	lw_i64 sent = lwp_sendfile (source->fd, dest->fd, (lw_i64)size);
 
 	lwp_trace ("lwp_sendfile sent " lwp_fmt_size " of " lwp_fmt_size,
@@ -331,7 +703,17 @@ static void def_read (lw_stream _ctx, size_t bytes)
 		ctx->reading_size += bytes;
 
 	if (!was_reading)
+	{
+		#ifdef _lacewing_use_io_uring
+			if (ctx->ring)
+			{
+				ring_read (ctx, NULL, 0);
+				return;
+			}
+		#endif
+
 		read_ready (ctx);
+	}
 }
 
 static size_t def_bytes_left (lw_stream _ctx)
@@ -373,6 +755,11 @@ static lw_bool def_close (lw_stream stream_ctx, lw_bool immediate)
 
 	ctx->fd = -1;
 
+	#ifdef _lacewing_use_io_uring
+		if (ctx->ring)
+			ring_close (ctx, fd, immediate);
+		else
+	#endif
 	if (fd != -1)
 	{
 		if (ctx->flags & lwp_fdstream_flag_autoclose)
@@ -394,7 +781,8 @@ const lw_streamdef def_fdstream =
 	.close		 = def_close,
 	.bytes_left	 = def_bytes_left,
 	.read		 = def_read,
-	.cleanup	 = def_cleanup
+	.cleanup	 = def_cleanup,
+	.sink_datav	 = def_sink_datav
 };
 
 void lwp_fdstream_init (lw_fdstream ctx, lw_pump pump)
@@ -403,6 +791,12 @@ void lwp_fdstream_init (lw_fdstream ctx, lw_pump pump)
 	ctx->flags = lwp_fdstream_flag_nagle;
 	ctx->size = ctx->reading_size = 0;
 
+	#ifdef _lacewing_use_io_uring
+		ctx->ring = NULL;
+		ctx->recv_op = ctx->send_op = NULL;
+		ctx->send_buffer = ctx->send_next = ctx->received = NULL;
+	#endif
+
 	lwp_stream_init (&ctx->stream, &def_fdstream, pump);
 }
 
@@ -25,6 +25,22 @@ struct _lw_fdstream
 
 	size_t size;
 	size_t reading_size;
+
+	#ifdef _lacewing_use_io_uring
+
+		/* Set if the pump's event queue does the socket's reads and writes itself, in
+		 * which case the socket isn't watched. send_buffer is with send_op, and once
+		 * sealed, writes gather in send_next until send_op completes.
+		 */
+		struct _lw_eventqueue * ring;
+		struct _lwp_eventqueue_op * recv_op, * send_op;
+
+		lwp_heapbuffer send_buffer, send_next;
+
+		/* Received, but not yet passed on, as reading_size didn't allow it */
+		lwp_heapbuffer received;
+
+	#endif
 };
 
 #define lwp_fdstream_flag_nagle		((lw_i8)1)
@@ -17,6 +17,7 @@
 #include "../address.h"
 
 #include "fdstream.h"
+#include "eventpump.h"
 
 static void on_client_close (lw_stream, void * tag);
 
@@ -34,6 +35,12 @@ struct _lw_server
 	lw_pump pump;
 	lw_pump_watch pump_watch;
 
+	/* Set if the pump's event queue accepts for the socket instead of it being watched */
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue ring;
+		lwp_eventqueue_op accept_op;
+	#endif
+
 	lw_server_hook_connect on_connect;
 	lw_server_hook_disconnect on_disconnect;
 	lw_server_hook_data on_data;
@@ -201,6 +208,78 @@ void * lw_server_tag (lw_server ctx)
 	return ctx->tag;
 }
 
+/* Sets up a client for an accepted fd. Returns false if accepting should stop for now. */
+static lw_bool accept_client (lw_server ctx, int fd, struct sockaddr * address)
+{
+	lw_server_client client = lwp_server_client_new (ctx, ctx->pump, fd);
+
+	if (!client)
+	{
+	  lwp_trace ("Failed allocating client");
+	  return lw_false;
+	}
+
+	client->address = lwp_addr_new_sockaddr (address);
+
+	lw_bool should_read = lw_false;
+
+	if (ctx->on_data)
+	{
+	  lw_stream_add_hook_data ((lw_stream) client, on_client_data, client);
+	  should_read = lw_true;
+	}
+
+	#ifdef ENABLE_SSL
+	if (!client->ssl)
+	{
+	#endif
+
+	  client->on_connect_called = lw_true;
+
+	  lwp_retain (client, "on_connect");
+
+	  if (ctx->on_connect)
+		 ctx->on_connect (ctx, client);
+
+	  if (lwp_release (client, "on_connect") ||
+			((lw_stream)client)->flags & lwp_stream_flag_dead)
+	  {
+		  if (ctx->on_disconnect)
+			  ctx->on_disconnect(ctx, client);
+		 /* Client was deleted by connect hook
+		  */
+		 return lw_false;
+	  }
+
+	  list_push (lw_server_client, ctx->clients, client);
+	  client->elem = list_elem_back (lw_server_client, ctx->clients);
+
+	#ifdef ENABLE_SSL
+	}
+	else
+	{
+	  should_read = lw_true;
+	}
+	#endif
+
+	if (should_read)
+	{
+	  lwp_retain (client, "client initial read");
+
+	  lw_stream_read ((lw_stream) client, SIZE_MAX);
+
+	  if (lwp_release (client, "client initial read") ||
+			((lw_stream) client)->flags & lwp_stream_flag_dead)
+	  {
+		 /* Client was deleted when performing initial read
+		  */
+		 return lw_false;
+	  }
+	}
+
+	return lw_true;
+}
+
 static void listen_socket_read_ready (void * tag)
 {
 	lw_server ctx = (lw_server)tag;
@@ -223,74 +302,41 @@ static void listen_socket_read_ready (void * tag)
 
 	  lwp_trace ("Accepted FD %d", fd);
 
-	  lw_server_client client = lwp_server_client_new (ctx, ctx->pump, fd);
-
-	  if (!client)
-	  {
-		 lwp_trace ("Failed allocating client");
+	  if (!accept_client (ctx, fd, (struct sockaddr *) &address))
 		 break;
-	  }
-
-	  client->address = lwp_addr_new_sockaddr ((struct sockaddr *) &address);
-
-	  lw_bool should_read = lw_false;
-
-	  if (ctx->on_data)
-	  {
-		 lw_stream_add_hook_data ((lw_stream) client, on_client_data, client);
-		 should_read = lw_true;
-	  }
-
-	  #ifdef ENABLE_SSL
-	  if (!client->ssl)
-	  {
-	  #endif
-
-		 client->on_connect_called = lw_true;
-
-		 lwp_retain (client, "on_connect");
+	}
+}
 
-		 if (ctx->on_connect)
-			ctx->on_connect (ctx, client);
+#ifdef _lacewing_use_io_uring
 
-		 if (lwp_release (client, "on_connect") ||
-				((lw_stream)client)->flags & lwp_stream_flag_dead)
-		 {
-			 if (ctx->on_disconnect)
-				 ctx->on_disconnect(ctx, client);
-			/* Client was deleted by connect hook
-			 */
-			return;
-		 }
-
-		 list_push (lw_server_client, ctx->clients, client);
-		 client->elem = list_elem_back (lw_server_client, ctx->clients);
+/* Multishot accept, completing once for each accepted fd */
+static void on_accepted (void * tag, int result, char * buffer)
+{
+	lw_server ctx = (lw_server)tag;
 
-	  #ifdef ENABLE_SSL
-	  }
-	  else
-	  {
-		 should_read = lw_true;
-	  }
-	  #endif
+	if (result < 0)
+	{
+	  lwp_trace ("Failed to accept: %s", strerror (-result));
+	  return;
+	}
 
-	  if (should_read)
-	  {
-		 lwp_retain (client, "client initial read");
+	lwp_trace ("Accepted FD %d", result);
 
-		 lw_stream_read ((lw_stream) client, SIZE_MAX);
+	struct sockaddr_storage address;
+	socklen_t address_length = sizeof (address);
 
-		 if (lwp_release (client, "client initial read") ||
-				((lw_stream) client)->flags & lwp_stream_flag_dead)
-		 {
-			/* Client was deleted when performing initial read
-			 */
-			return;
-		 }
-	  }
+	if (getpeername (result, (struct sockaddr *) &address, &address_length) == -1)
+	{
+	  /* Gone already */
+	  close (result);
+	  return;
 	}
+
+	accept_client (ctx, result, (struct sockaddr *) &address);
 }
 
+#endif
+
 void lw_server_host (lw_server ctx, long port)
 {
 	lw_filter filter = lw_filter_new ();
@@ -333,6 +379,17 @@ void lw_server_host_filter (lw_server ctx, lw_filter filter)
 
 	lwp_make_nonblocking(ctx->socket);
 
+	#ifdef _lacewing_use_io_uring
+		if ((ctx->ring = lwp_eventpump_ring (ctx->pump))
+			&& (ctx->accept_op = lwp_eventqueue_accept (ctx->ring, ctx->socket, on_accepted, ctx)))
+		{
+			lw_pump_add_user (ctx->pump);
+
+			lw_error_delete (error);
+			return;
+		}
+	#endif
+
 	ctx->pump_watch = lw_pump_add (ctx->pump, ctx->socket, ctx, listen_socket_read_ready, 0, lw_true);
 
 	lw_error_delete (error);
@@ -343,6 +400,16 @@ void lw_server_unhost (lw_server ctx)
 	if (!lw_server_hosting (ctx))
 	  return;
 
+	#ifdef _lacewing_use_io_uring
+		if (ctx->accept_op)
+		{
+			lwp_eventqueue_cancel (ctx->ring, ctx->accept_op);
+			ctx->accept_op = NULL;
+
+			lw_pump_remove_user (ctx->pump);
+		}
+	#endif
+
 	close (ctx->socket);
 	ctx->socket = -1;
 
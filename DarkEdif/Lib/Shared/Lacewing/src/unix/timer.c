@@ -11,6 +11,15 @@
 #include "../common.h"
 #include "eventpump.h"
 
+#ifndef _lacewing_use_timerfd
+	#define lwp_timer_use_service
+
+	/* Without timerfd, timers share one thread per pump, which keeps them in a min-heap by due time
+	 * and posts each tick to the pump as it comes due. (kqueue event pumps use EVFILT_TIMER instead.)
+	 */
+	typedef struct _lwp_timerservice * lwp_timerservice;
+#endif
+
 struct _lw_timer
 {
 	lw_pump pump;
@@ -26,41 +35,289 @@ struct _lw_timer
 	  int fd;
 	#endif
 
-	lw_event stop_event;
 	long interval;
 
-	lw_thread timer_thread;
+	#ifdef lwp_timer_use_service
+	  lwp_timerservice service;
+	  lw_i64 due;			/* microseconds, see timerservice_now */
+	  size_t heap_index;	/* SIZE_MAX if not in the service's heap */
+	#endif
 };
 
 static void timer_tick (lw_timer ctx)
 {
-	if (ctx->on_tick)
-		ctx->on_tick (ctx);
-
 	#ifdef _lacewing_use_timerfd
+		// Read before ticking, as the tick may restart the timer, which clears pending expirations.
+		// If it was restarted while this was already signalled, there's nothing to read; skip the tick.
 		lw_i64 expirations;
-		ssize_t s = read (ctx->fd, &expirations, sizeof (lw_i64));
-		(void)s;
-		assert(s > 0);
-		// TODO: why was expirations read here? Is there an abort?
+		if (read (ctx->fd, &expirations, sizeof (lw_i64)) <= 0)
+			return;
 	#endif
+
+	if (ctx->on_tick)
+		ctx->on_tick (ctx);
 }
 
-static void timer_thread (void * ptr)
+#ifdef lwp_timer_use_service
+
+struct _lwp_timerservice
 {
-	lw_timer ctx = (lw_timer)ptr;
+	lw_pump pump;
+	long ref_count;
+	lwp_timerservice next;
+
+	lw_thread thread;
+	lw_bool stopping;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+
+	lw_timer * heap;
+	size_t heap_count, heap_size;
+};
 
+/* One service per pump, created by the first timer and freed with the last */
+static pthread_mutex_t timerservices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lwp_timerservice timerservices = NULL;
+
+static lw_i64 timerservice_now ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (lw_i64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void timerservice_swap (lwp_timerservice ctx, size_t a, size_t b)
+{
+	lw_timer t = ctx->heap [a];
+	ctx->heap [a] = ctx->heap [b];
+	ctx->heap [b] = t;
+	ctx->heap [a]->heap_index = a;
+	ctx->heap [b]->heap_index = b;
+}
+
+static void timerservice_sift_up (lwp_timerservice ctx, size_t i)
+{
+	while (i > 0 && ctx->heap [(i - 1) / 2]->due > ctx->heap [i]->due)
+	{
+		timerservice_swap (ctx, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timerservice_sift_down (lwp_timerservice ctx, size_t i)
+{
 	for (;;)
 	{
-		lw_event_wait (ctx->stop_event, ctx->interval);
+		size_t smallest = i, l = i * 2 + 1, r = l + 1;
 
-		if (lw_event_signalled (ctx->stop_event))
-			break;
+		if (l < ctx->heap_count && ctx->heap [l]->due < ctx->heap [smallest]->due)
+			smallest = l;
+		if (r < ctx->heap_count && ctx->heap [r]->due < ctx->heap [smallest]->due)
+			smallest = r;
+		if (smallest == i)
+			return;
+
+		timerservice_swap (ctx, i, smallest);
+		i = smallest;
+	}
+}
+
+/* Expects ctx->mutex */
+static lw_bool timerservice_insert (lwp_timerservice ctx, lw_timer timer)
+{
+	if (ctx->heap_count == ctx->heap_size)
+	{
+		size_t new_size = ctx->heap_size ? ctx->heap_size * 2 : 8;
+		lw_timer * new_heap = (lw_timer *) realloc (ctx->heap, new_size * sizeof (lw_timer));
+
+		if (!new_heap)
+			return lw_false;
+
+		ctx->heap = new_heap;
+		ctx->heap_size = new_size;
+	}
+
+	timer->heap_index = ctx->heap_count ++;
+	ctx->heap [timer->heap_index] = timer;
+	timerservice_sift_up (ctx, timer->heap_index);
+
+	return lw_true;
+}
+
+/* Expects ctx->mutex */
+static void timerservice_remove (lwp_timerservice ctx, lw_timer timer)
+{
+	size_t i = timer->heap_index;
+
+	if (i == SIZE_MAX)
+		return;
+
+	timer->heap_index = SIZE_MAX;
+
+	if (i != -- ctx->heap_count)
+	{
+		ctx->heap [i] = ctx->heap [ctx->heap_count];
+		ctx->heap [i]->heap_index = i;
+		timerservice_sift_up (ctx, i);
+		timerservice_sift_down (ctx, ctx->heap [i]->heap_index);
+	}
+}
+
+static void timerservice_thread (void * ptr)
+{
+	lwp_timerservice ctx = (lwp_timerservice) ptr;
+
+	pthread_mutex_lock (&ctx->mutex);
+
+	while (!ctx->stopping)
+	{
+		if (ctx->heap_count == 0)
+		{
+			pthread_cond_wait (&ctx->wake, &ctx->mutex);
+			continue;
+		}
+
+		lw_timer timer = ctx->heap [0];
+		lw_i64 now = timerservice_now ();
+
+		if (timer->due > now)
+		{
+			/* Timed waits take a realtime deadline, so convert from the monotonic clock */
+			struct timespec deadline;
+			lw_i64 wait = timer->due - now;
+
+			clock_gettime (CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += wait / 1000000;
+			deadline.tv_nsec += (wait % 1000000) * 1000;
+
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				++ deadline.tv_sec;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait (&ctx->wake, &ctx->mutex, &deadline);
+			continue;
+		}
 
-		lw_pump_post (ctx->pump, (void *)timer_tick, ctx);
+		/* Posted under the mutex, so a tick can't be posted after lw_timer_stop returns */
+		lw_pump_post (ctx->pump, (void *) timer_tick, timer);
+
+		/* Keep to the original schedule, unless it's fallen a whole interval behind */
+		timer->due += (lw_i64) timer->interval * 1000;
+
+		if (timer->due <= now)
+			timer->due = now + (lw_i64) timer->interval * 1000;
+
+		timerservice_sift_down (ctx, 0);
 	}
+
+	pthread_mutex_unlock (&ctx->mutex);
 }
 
+static lwp_timerservice timerservice_acquire (lw_pump pump)
+{
+	lwp_timerservice ctx;
+
+	pthread_mutex_lock (&timerservices_mutex);
+
+	for (ctx = timerservices; ctx; ctx = ctx->next)
+	{
+		if (ctx->pump == pump)
+		{
+			++ ctx->ref_count;
+			pthread_mutex_unlock (&timerservices_mutex);
+			return ctx;
+		}
+	}
+
+	if (!(ctx = (lwp_timerservice) calloc (sizeof (*ctx), 1)))
+	{
+		pthread_mutex_unlock (&timerservices_mutex);
+		return NULL;
+	}
+
+	ctx->pump = pump;
+	ctx->ref_count = 1;
+
+	pthread_mutex_init (&ctx->mutex, NULL);
+	pthread_cond_init (&ctx->wake, NULL);
+
+	ctx->thread = lw_thread_new ("timer_thread", (void *) timerservice_thread);
+	lw_thread_start (ctx->thread, ctx);
+
+	ctx->next = timerservices;
+	timerservices = ctx;
+
+	pthread_mutex_unlock (&timerservices_mutex);
+
+	return ctx;
+}
+
+static void timerservice_release (lwp_timerservice ctx)
+{
+	lwp_timerservice * it;
+
+	pthread_mutex_lock (&timerservices_mutex);
+
+	if (-- ctx->ref_count > 0)
+	{
+		pthread_mutex_unlock (&timerservices_mutex);
+		return;
+	}
+
+	for (it = &timerservices; *it; it = &(*it)->next)
+	{
+		if (*it == ctx)
+		{
+			*it = ctx->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock (&timerservices_mutex);
+
+	pthread_mutex_lock (&ctx->mutex);
+	ctx->stopping = lw_true;
+	pthread_cond_signal (&ctx->wake);
+	pthread_mutex_unlock (&ctx->mutex);
+
+	lw_thread_join (ctx->thread);
+	lw_thread_delete (ctx->thread);
+
+	pthread_cond_destroy (&ctx->wake);
+	pthread_mutex_destroy (&ctx->mutex);
+
+	free (ctx->heap);
+	free (ctx);
+}
+
+static void timerservice_start (lw_timer timer)
+{
+	lwp_timerservice ctx = timer->service;
+
+	pthread_mutex_lock (&ctx->mutex);
+
+	timer->due = timerservice_now () + (lw_i64) timer->interval * 1000;
+
+	if (!timerservice_insert (ctx, timer))
+		lwp_trace ("Timer: Failed to add timer to timer service, out of memory");
+	else if (ctx->heap [0] == timer)
+		pthread_cond_signal (&ctx->wake); /* due before what the thread is waiting on */
+
+	pthread_mutex_unlock (&ctx->mutex);
+}
+
+static void timerservice_stop (lw_timer timer)
+{
+	pthread_mutex_lock (&timer->service->mutex);
+	timerservice_remove (timer->service, timer);
+	pthread_mutex_unlock (&timer->service->mutex);
+}
+
+#endif
+
 lw_timer lw_timer_new (lw_pump pump)
 {
 	lw_timer ctx = (lw_timer)calloc (sizeof (*ctx), 1);
@@ -69,28 +326,43 @@ lw_timer lw_timer_new (lw_pump pump)
 		return 0;
 
 	ctx->pump = pump;
-	ctx->timer_thread = lw_thread_new ("timer_thread", (void *)timer_thread);
-	ctx->stop_event = lw_event_new ();
 
 	#ifdef _lacewing_use_timerfd
 		ctx->fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
 		ctx->pump_watch = lw_pump_add (ctx->pump, ctx->fd, ctx, (lw_pump_callback) timer_tick, 0, lw_true);
 	#endif
 
+	#ifdef lwp_timer_use_service
+		ctx->heap_index = SIZE_MAX;
+
+		#ifdef USE_KQUEUE
+		  if (pump->def != &def_eventpump)
+		#endif
+		{
+			if (!(ctx->service = timerservice_acquire (pump)))
+			{
+				free (ctx);
+				return 0;
+			}
+		}
+	#endif
+
 	return ctx;
 }
 
 void lw_timer_delete (lw_timer ctx)
 {
 	lw_timer_stop (ctx);
-	lw_event_delete (ctx->stop_event);
 
 	#ifdef _lacewing_use_timerfd
-		close (ctx->fd);
 		lw_pump_remove(ctx->pump, ctx->pump_watch);
+		close (ctx->fd);
 	#endif
 
-	lw_thread_delete(ctx->timer_thread);
+	#ifdef lwp_timer_use_service
+		if (ctx->service)
+			timerservice_release (ctx->service);
+	#endif
 
 	free (ctx);
 }
@@ -124,8 +396,7 @@ void lw_timer_start (lw_timer ctx, long interval)
 	  }
 	  else
 	  {
-		 ctx->interval = interval;
-		 lw_thread_start (ctx->timer_thread, ctx);
+		 timerservice_start (ctx);
 	  }
 
 	#else
@@ -139,8 +410,7 @@ void lw_timer_start (lw_timer ctx, long interval)
 			timerfd_settime (ctx->fd, 0, &spec, 0);
 
 	  #else
-			ctx->interval = interval;
-			lw_thread_start (ctx->timer_thread, ctx);
+			timerservice_start (ctx);
 	  #endif
 	#endif
 }
@@ -152,14 +422,6 @@ void lw_timer_stop (lw_timer ctx)
 
 	/* TODO: What if a tick has been posted and this gets destructed? */
 
-	#ifndef _lacewing_use_timerfd
-
-	  lw_event_signal (ctx->stop_event);
-	  lw_thread_join (ctx->timer_thread);
-	  lw_event_unsignal (ctx->stop_event);
-
-	#endif
-
 	#ifdef USE_KQUEUE
 
 	  if (ctx->pump->def == &def_eventpump)
@@ -179,13 +441,15 @@ void lw_timer_stop (lw_timer ctx)
 	  }
 	  else
 	  {
-		 /* TODO */
+		 timerservice_stop (ctx);
 	  }
 
 	#else
 		#ifdef _lacewing_use_timerfd
 			struct itimerspec spec = {0};
 			timerfd_settime (ctx->fd, 0, &spec, 0);
+		#else
+			timerservice_stop (ctx);
 		#endif
 	#endif
 
@@ -10,6 +10,7 @@
 
 #include "../common.h"
 #include "../address.h"
+#include "eventpump.h"
 
 struct _lw_udp
 {
@@ -22,14 +23,139 @@ struct _lw_udp
 	lw_filter filter;
 	lw_pump_watch pump_watch;
 
+	// Set if the pump's event queue receives for the socket instead of it being watched
+	#ifdef _lacewing_use_io_uring
+		lwp_eventqueue ring;
+		lwp_eventqueue_op recv_op;
+	#endif
+
 	int fd;
 
 	long receives_posted;
 	int writes_posted;
 
+	#ifdef HAVE_RECVMMSG
+		struct _lw_udp_batch * batch;
+	#endif
+
 	void * tag;
 };
 
+// Max datagrams per recvmmsg/sendmmsg call
+#define lwp_udp_batch_size 16
+
+#ifdef HAVE_RECVMMSG
+
+	/* Reused by every read_ready, so a batch of datagrams costs one syscall and
+	 * no allocations. Only the pump thread watching the FD reads into it.
+	 */
+	struct _lw_udp_batch
+	{
+		struct mmsghdr msgs [lwp_udp_batch_size];
+		struct iovec iov [lwp_udp_batch_size];
+
+		// recvmmsg writes the sender straight into each address's inline sockaddr
+		struct _lw_addr addr [lwp_udp_batch_size];
+
+		char buffers [lwp_udp_batch_size][lwp_default_buffer_size + 1];
+	};
+
+	static struct _lw_udp_batch * batch_new ()
+	{
+		struct _lw_udp_batch * batch = (struct _lw_udp_batch *) calloc (sizeof (*batch), 1);
+
+		if (!batch)
+			return NULL;
+
+		for (int i = 0; i < lwp_udp_batch_size; ++ i)
+		{
+			batch->iov [i].iov_base = batch->buffers [i];
+			batch->iov [i].iov_len = lwp_default_buffer_size;
+
+			lw_addr addr = &batch->addr [i];
+			addr->info = &addr->info_inline;
+			addr->info->ai_addr = (struct sockaddr *) &addr->sockaddr_inline;
+			addr->info->ai_socktype = SOCK_DGRAM;
+			addr->info->ai_protocol = IPPROTO_UDP;
+		}
+
+		return batch;
+	}
+
+	static void batch_reset_msgs (struct _lw_udp_batch * batch)
+	{
+		for (int i = 0; i < lwp_udp_batch_size; ++ i)
+		{
+			struct msghdr * hdr = &batch->msgs [i].msg_hdr;
+
+			hdr->msg_name = &batch->addr [i].sockaddr_inline;
+			hdr->msg_namelen = sizeof (batch->addr [i].sockaddr_inline);
+			hdr->msg_iov = &batch->iov [i];
+			hdr->msg_iovlen = 1;
+			hdr->msg_control = NULL;
+			hdr->msg_controllen = 0;
+			hdr->msg_flags = 0;
+		}
+	}
+
+#endif
+
+#ifdef HAVE_RECVMMSG
+
+static void read_ready (void * ptr)
+{
+	lw_udp ctx = (lw_udp)ptr;
+
+	if (!ctx->batch && !(ctx->batch = batch_new ()))
+	{
+		always_log ("Couldn't allocate UDP receive batch, out of memory.");
+		return;
+	}
+
+	struct _lw_udp_batch * batch = ctx->batch;
+
+	lwp_retain(ctx, "udp read");
+
+	lw_addr filter_addr = lw_filter_remote (ctx->filter);
+
+	for (;;)
+	{
+		batch_reset_msgs (batch);
+
+		int count = recvmmsg (ctx->fd, batch->msgs, lwp_udp_batch_size, 0, NULL);
+
+		if (count <= 0)
+			break;
+
+		for (int i = 0; i < count; ++ i)
+		{
+			lw_addr addr = &batch->addr [i];
+
+			addr->info->ai_family = addr->sockaddr_inline.ss_family;
+			addr->info->ai_addrlen = batch->msgs [i].msg_hdr.msg_namelen;
+			addr->buffer [0] = '\0'; // clear to_string
+
+			if (filter_addr && !lw_addr_equal(addr, filter_addr))
+				continue;
+
+			const size_t bytes = batch->msgs [i].msg_len;
+			batch->buffers [i][bytes] = 0;
+
+			// See the note on the same check in the recvfrom() read_ready below
+			if (ctx->fd != -1 && ctx->on_data)
+				ctx->on_data (ctx, addr, batch->buffers [i], bytes);
+		}
+
+		// Short batch, so the socket's been drained
+		if (count < lwp_udp_batch_size)
+			break;
+	}
+
+	lwp_release(ctx, "udp read");
+}
+
+#else
+
 static void read_ready (void * ptr)
 {
 	lw_udp ctx = (lw_udp)ptr;
@@ -53,16 +179,10 @@ static void read_ready (void * ptr)
 		if (bytes == -1)
 			break;
 
-		lwp_addr_set_sockaddr (&addr, (struct sockaddr *) &from);
+		lwp_addr_set_sockaddr (&addr, (struct sockaddr *) &from); // no allocation, uses addr's inline storage
 
 		if (filter_addr && !lw_addr_equal(&addr, filter_addr))
-		{
-			free(addr.info->ai_addr);  // alloc'd by lwp_addr_set_sockaddr
-			addr.info->ai_addr = NULL;
-			free(addr.info);
-			addr.info = NULL;
 			break;
-		}
 
 		buffer [bytes] = 0;
 
@@ -74,16 +194,48 @@ static void read_ready (void * ptr)
 		// we'll keep it.
 		if (ctx->fd != -1 && ctx->on_data)
 			ctx->on_data (ctx, &addr, buffer, (size_t)bytes);
+	}
+
+	lwp_release(ctx, "udp read");
+}
+
+#endif
+
+#ifdef _lacewing_use_io_uring
+
+// Multishot recvmsg, completing once for each datagram
+static void ring_received (void * tag, int result, char * buffer)
+{
+	lw_udp ctx = (lw_udp)tag;
+
+	if (result < 0)
+	{
+		lwp_trace ("UDP receive failed with error %d", -result);
+		return;
+	}
+
+	lwp_retain(ctx, "udp read");
+
+	struct _lw_addr addr = {0};
+	lwp_addr_set_sockaddr (&addr, (struct sockaddr *) buffer); // no allocation, uses addr's inline storage
+
+	lw_addr filter_addr = lw_filter_remote (ctx->filter);
+
+	if (!filter_addr || lw_addr_equal(&addr, filter_addr))
+	{
+		char * data = buffer + sizeof (struct sockaddr_storage);
+		data [result] = 0;
 
-		free(addr.info->ai_addr); // alloc'd by lwp_addr_set_sockaddr
-		addr.info->ai_addr = NULL;
-		free(addr.info);
-		addr.info = NULL;
+		// See the note on the same check in the recvfrom() read_ready
+		if (ctx->fd != -1 && ctx->on_data)
+			ctx->on_data (ctx, &addr, data, (size_t)result);
 	}
 
 	lwp_release(ctx, "udp read");
 }
 
+#endif
+
 void lw_udp_host (lw_udp ctx, lw_ui16 port)
 {
 	lw_filter filter = lw_filter_new ();
@@ -128,6 +280,15 @@ void lw_udp_host_filter (lw_udp ctx, lw_filter filter)
 
 	ctx->filter = lw_filter_clone (filter);
 
+	#ifdef _lacewing_use_io_uring
+		if ((ctx->ring = lwp_eventpump_ring (ctx->pump))
+			&& (ctx->recv_op = lwp_eventqueue_recvfrom (ctx->ring, ctx->fd, ring_received, ctx)))
+		{
+			lw_pump_add_user (ctx->pump);
+			return;
+		}
+	#endif
+
 	ctx->pump_watch = lw_pump_add (ctx->pump, ctx->fd, ctx, read_ready, 0, lw_true);
 }
 
@@ -143,6 +304,20 @@ lw_ui16 lw_udp_port (lw_udp ctx)
 
 void lw_udp_unhost (lw_udp ctx)
 {
+	#ifdef _lacewing_use_io_uring
+		if (ctx->recv_op)
+		{
+			lwp_eventqueue_cancel (ctx->ring, ctx->recv_op);
+			ctx->recv_op = NULL;
+
+			lw_pump_remove_user (ctx->pump);
+		}
+
+		// Datagrams held back for the end of the pump's batch go before the FD does
+		if (ctx->fd != -1 && lwp_eventpump_ring (ctx->pump))
+			lwp_eventqueue_flush (lwp_eventpump_ring (ctx->pump));
+	#endif
+
 	// pump_watch has an FD, used to cancel pending events, so we don't use close_socket until it's used
 	if (ctx->fd != -1)
 		shutdown(ctx->fd, SHUT_RDWR);
@@ -157,6 +332,15 @@ void lw_udp_unhost (lw_udp ctx)
 	ctx->filter = 0;
 }
 
+static void on_dealloc (lw_udp ctx)
+{
+	#ifdef HAVE_RECVMMSG
+		free (ctx->batch);
+	#endif
+
+	free (ctx);
+}
+
 lw_udp lw_udp_new (lw_pump pump)
 {
 	lw_udp ctx = (lw_udp)calloc (sizeof (*ctx), 1);
@@ -166,6 +350,7 @@ lw_udp lw_udp_new (lw_pump pump)
 
 	lwp_init ();
 	lwp_enable_refcount_logging(ctx, "udp");
+	lwp_set_dealloc_proc(ctx, on_dealloc);
 	lwp_retain(ctx, "udp_new");
 
 	ctx->pump = pump;
@@ -183,9 +368,35 @@ void lw_udp_delete (lw_udp ctx)
 
 	// We should test if it's freed? But there's not really much the app can do to prevent it,
 	// and the better behaviour is to let whatever's using it free it by itself.
-	lwp_release(ctx, "udp_new"); // calls free (ctx)
+	lwp_release(ctx, "udp_new"); // calls on_dealloc (ctx)
 }
 
+#ifdef _lacewing_use_io_uring
+
+static void ring_sent (void * tag, int result, char * buffer)
+{
+	lw_udp ctx = (lw_udp) tag;
+
+	// As with sendto, EAGAIN means no room and the datagram was discarded; ECANCELED
+	// is one linked behind a datagram that failed
+	if (result < 0 && result != -EAGAIN && result != -ECANCELED && ctx->fd != -1)
+	{
+		lw_error error = lw_error_new ();
+
+		lw_error_add (error, -result);
+		lw_error_addf (error, "Error sending");
+
+		if (ctx->on_error)
+			ctx->on_error (ctx, error);
+
+		lw_error_delete (error);
+	}
+
+	lwp_release(ctx, "udp write");
+}
+
+#endif
+
 void lw_udp_send (lw_udp ctx, lw_addr addr, const char * data, size_t size)
 {
 	if (!lw_addr_ready (addr))
@@ -215,6 +426,21 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * data, size_t size)
 	lwp_retain(ctx, "udp write");
 	++ctx->writes_posted;
 
+	#ifdef _lacewing_use_io_uring
+	{
+		// From the pump's own thread, the datagram goes to the kernel along with the
+		// rest of the batch's sends; ring_sent releases
+		lwp_eventqueue ring = lwp_eventpump_ring (ctx->pump);
+
+		if (ring && lwp_eventqueue_dispatching (ring)
+			&& lwp_eventqueue_sendto (ring, ctx->fd, (struct sockaddr *) addr->info->ai_addr,
+				addr->info->ai_addrlen, data, size, ring_sent, ctx))
+		{
+			return;
+		}
+	}
+	#endif
+
 	// Ignore EAGAIN since we're sending UDP; if there's not outgoing room to send, just discard
 	if (sendto (ctx->fd, data, size, 0, (struct sockaddr *) addr->info->ai_addr,
 				addr->info->ai_addrlen) == -1 && errno != EAGAIN)
@@ -234,6 +460,80 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * data, size_t size)
 	lwp_release(ctx, "udp write");
 }
 
+void lw_udp_send_batch (lw_udp ctx, lw_addr * addrs, size_t count, const char * data, size_t size)
+{
+	if (size == SIZE_MAX)
+		size = strlen (data);
+
+	if (sizeof(size) > 4)
+		assert(size < 0xFFFFFFFF);
+
+	#ifdef HAVE_SENDMMSG
+
+		lwp_retain(ctx, "udp write");
+
+		struct iovec iov = { (void *) data, size };
+		struct mmsghdr msgs [lwp_udp_batch_size];
+
+		for (size_t i = 0; i < count; )
+		{
+			int num_msgs = 0;
+
+			for (; i < count && num_msgs < lwp_udp_batch_size; ++ i)
+			{
+				if (!lw_addr_ready (addrs [i]) || !addrs [i]->info)
+					continue;
+
+				struct msghdr * hdr = &msgs [num_msgs ++].msg_hdr;
+				memset (hdr, 0, sizeof (*hdr));
+
+				hdr->msg_name = addrs [i]->info->ai_addr;
+				hdr->msg_namelen = addrs [i]->info->ai_addrlen;
+				hdr->msg_iov = &iov;
+				hdr->msg_iovlen = 1;
+			}
+
+			++ctx->writes_posted;
+
+			// As with sendto, EAGAIN means no outgoing room, so the rest of the batch is discarded
+			for (int sent = 0; sent < num_msgs; )
+			{
+				int res = sendmmsg (ctx->fd, msgs + sent, num_msgs - sent, 0);
+
+				if (res == -1)
+				{
+					if (errno == EAGAIN)
+						break;
+
+					lw_error error = lw_error_new ();
+
+					lw_error_add (error, errno);
+					lw_error_addf (error, "Error sending");
+
+					if (ctx->on_error)
+						ctx->on_error (ctx, error);
+
+					lw_error_delete (error);
+
+					// Skip the message that failed; the others may still be fine
+					++ sent;
+					continue;
+				}
+
+				sent += res;
+			}
+		}
+
+		lwp_release(ctx, "udp write");
+
+	#else
+
+		for (size_t i = 0; i < count; ++ i)
+			lw_udp_send (ctx, addrs [i], data, size);
+
+	#endif
+}
+
 void lw_udp_set_tag (lw_udp ctx, void * tag)
 {
 	ctx->tag = tag;
@@ -10,6 +10,10 @@
 #define HAVE_SYS_PRCTL_H
 #define HAVE_SYS_SENDFILE_H
 #define HAVE_SYS_TIMERFD_H
+#define HAVE_SYS_EVENTFD_H
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
+// #define ENABLE_IO_URING // define in project settings to use io_uring where the kernel supports it; needs Linux 6.0+ headers
 
 #define HAVE_DECL_PR_SET_NAME
 #define HAVE_DECL_TCP_CORK
@@ -355,7 +355,7 @@ void lw_fdstream_set_fd (lw_fdstream ctx, HANDLE fd,
 
 		int b = (ctx->flags & lwp_fdstream_flag_nagle) ? 0 : 1;
 
-		setsockopt ((SOCKET) ctx->fd, SOL_SOCKET, TCP_NODELAY,
+		setsockopt ((SOCKET) ctx->fd, IPPROTO_TCP, TCP_NODELAY,
 					(char *) &b, sizeof (b));
 	}
 	else
@@ -638,7 +638,7 @@ void lw_fdstream_nagle (lw_fdstream ctx, lw_bool enabled)
 	{
 		int b = enabled ? 0 : 1;
 
-		setsockopt ((SOCKET) ctx->fd, SOL_SOCKET,
+		setsockopt ((SOCKET) ctx->fd, IPPROTO_TCP,
 				TCP_NODELAY, (char *) &b, sizeof (b));
 	}
 }
@@ -390,6 +390,13 @@ void lw_udp_send (lw_udp ctx, lw_addr addr, const char * buffer, size_t size)
 	// else no error, completed as sync already (IOCP still has posted completion status)
 }
 
+void lw_udp_send_batch (lw_udp ctx, lw_addr * addrs, size_t count, const char * buffer, size_t size)
+{
+	// No sendmmsg equivalent; each WSASendTo is already overlapped
+	for (size_t i = 0; i < count; ++ i)
+		lw_udp_send (ctx, addrs [i], buffer, size);
+}
+
 void lw_udp_set_tag (lw_udp ctx, void * tag)
 {
 	ctx->tag = tag;
@@ -0,0 +1,250 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2021-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+// allowlist: checks codepointsallowlist's compiled tables against the lists they're compiled from.
+//
+// setcodepointsallowedlist compiles the category, code point and range lists into a BMP bitmap and a
+// table of ranges past the BMP, and checkcodepointsallowed looks code points up in those, rather than
+// searching the lists. For fixed and random lists, this checks isallowed() against a search of the
+// lists, as checkcodepointsallowed used to do, for every valid code point; then checks
+// checkcodepointsallowed() against the search-based version it replaced, on random strings of ASCII,
+// Latin, CJK, astral, control, invalid, overlong and surrogate sequences, down to the index and
+// code point rejected.
+//
+// Usage: allowlist [lists] [seed]
+
+#include "Lacewing.h"
+#include "deps/utf8proc.h"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// isallowed is protected
+struct allowlistprobe : lacewing::codepointsallowlist
+{
+	using codepointsallowlist::isallowed;
+};
+
+// As codepointsallowlist::checkcodepointsallowed searched the lists for each code point, before they
+// were compiled
+static bool searchlists(const lacewing::codepointsallowlist & list, utf8proc_int32_t codePoint)
+{
+	if (std::find(list.specificCodePoints.cbegin(), list.specificCodePoints.cend(), codePoint) != list.specificCodePoints.cend())
+		return true;
+	if (std::find_if(list.codePointRanges.cbegin(), list.codePointRanges.cend(),
+		[=](const std::pair<std::int32_t, std::int32_t> & range) {
+			return codePoint >= range.first && codePoint <= range.second;
+		}) != list.codePointRanges.cend())
+	{
+		return true;
+	}
+	const utf8proc_category_t category = utf8proc_category(codePoint);
+	return std::find(list.codePointCategories.cbegin(), list.codePointCategories.cend(), category) != list.codePointCategories.cend();
+}
+
+static int searchcheck(const lacewing::codepointsallowlist & list, const std::string_view toTest, int * const rejectedUTF32CodePoint)
+{
+	if (list.allAllowed)
+		return -1;
+
+	const utf8proc_uint8_t * str = (const utf8proc_uint8_t *)toTest.data();
+	utf8proc_int32_t thisChar;
+	utf8proc_ssize_t numBytesInCodePoint, remainingBytes = toTest.size();
+	int codePointIndex = 0;
+	while (remainingBytes > 0)
+	{
+		numBytesInCodePoint = utf8proc_iterate(str, remainingBytes, &thisChar);
+		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar) || !searchlists(list, thisChar))
+		{
+			if (rejectedUTF32CodePoint != NULL)
+				*rejectedUTF32CodePoint = thisChar;
+			return codePointIndex;
+		}
+
+		++codePointIndex;
+		str += numBytesInCodePoint;
+		remainingBytes -= numBytesInCodePoint;
+	}
+
+	return -1;
+}
+
+static std::mt19937 rng;
+
+static const char * const categories[] = {
+	"Lu","Ll","Lt","Lm","Lo","Mn","Mc","Me","Nd","Nl","No","Pc","Pd","Ps","Pe","Pi","Pf","Po",
+	"Sm","Sc","Sk","So","Zs","Zl","Zp","Cc","Cf","Cs","Co","Cn",
+	"L*","M*","N*","P*","S*","Z*","C*"
+};
+
+static std::int32_t randomcodepoint()
+{
+	switch (rng() % 6)
+	{
+	case 0: return 1 + rng() % 0x7F;
+	case 1: return 0x80 + rng() % 0x780;
+	case 2: return 0x800 + rng() % 0xF800;
+	case 3: return 0xFF00 + rng() % 0x200; // both sides of the BMP's end
+	case 4: return 0x10000 + rng() % 0x100000;
+	default: return 0x10FF00 + rng() % 0x200; // both sides of U+10FFFF
+	}
+}
+
+// A list in setcodepointsallowedlist's format; categories and wildcards aren't repeated, nor
+// are code points or ranges, as those are errors
+static std::string randomlist()
+{
+	std::vector<std::string> entries;
+
+	const int numCategories = rng() % 4;
+	std::vector<int> used;
+	for (int i = 0; i < numCategories; ++i)
+	{
+		// A wildcard can't be mixed with its own categories
+		const int c = rng() % (int)std::size(categories);
+		bool clash = false;
+		for (int u : used)
+			clash = clash || categories[u][0] == categories[c][0];
+		if (clash)
+			continue;
+		used.push_back(c);
+		entries.push_back(categories[c]);
+	}
+
+	const int numCodePoints = rng() % 6;
+	for (int i = 0; i < numCodePoints; ++i)
+		entries.push_back(std::to_string(randomcodepoint()));
+
+	const int numRanges = rng() % 5;
+	for (int i = 0; i < numRanges; ++i)
+	{
+		std::int32_t first = randomcodepoint(), last = randomcodepoint();
+		if (last < first)
+			std::swap(first, last);
+		if (rng() % 8 == 0)
+			last = INT32_MAX;
+		entries.push_back(std::to_string(first) + "-" + std::to_string(last));
+	}
+
+	std::string list;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		// Drop repeats, and separate with commas and the odd space
+		if (std::find(entries.cbegin(), entries.cbegin() + i, entries[i]) != entries.cbegin() + i)
+			continue;
+		if (!list.empty())
+			list += rng() % 4 ? "," : ", ";
+		list += entries[i];
+	}
+	return list;
+}
+
+static void appendutf8(std::string & str, std::int32_t codePoint)
+{
+	utf8proc_uint8_t encoded[4];
+	str.append((const char *)encoded, utf8proc_encode_char(codePoint, encoded));
+}
+
+static std::string randomstring()
+{
+	std::string str;
+	const int parts = rng() % 24;
+	for (int i = 0; i < parts; ++i)
+	{
+		switch (rng() % 12)
+		{
+		case 0: case 1: case 2:
+			// Printable ASCII run, long enough for the block skip
+			for (int n = rng() % 40; n > 0; --n)
+				str += (char)(0x20 + rng() % 0x5F);
+			break;
+		case 3: str += (char)(rng() % 0x20); break; // control
+		case 4: str += '\x7F'; break;
+		case 5: appendutf8(str, 0xA0 + rng() % 0x200); break; // Latin
+		case 6: appendutf8(str, 0x4E00 + rng() % 0x5200); break; // CJK
+		case 7: appendutf8(str, 0x10000 + rng() % 0x100000); break; // astral
+		case 8: appendutf8(str, randomcodepoint() & 0x1FFFFF); break;
+		case 9: str += "\xED\xA0\x80"; break; // surrogate
+		case 10: str += rng() % 2 ? "\xC0\x80" : "\xE0\x80\xBF"; break; // overlong
+		default:
+			if (rng() % 2)
+				str += "\xF4\x90\x80\x80"; // past U+10FFFF
+			else
+				str += (char)(0x80 + rng() % 0x80); // stray or truncated
+			break;
+		}
+	}
+	return str;
+}
+
+int main(int argc, char ** argv)
+{
+	const int numLists = argc > 1 ? atoi(argv[1]) : 200;
+	rng.seed(argc > 2 ? (unsigned int)strtoul(argv[2], nullptr, 0) : 1);
+
+	std::vector<std::string> lists = {
+		"L*,N*,P*,Zs,So",
+		"Lu,Ll,Nd,32,95",
+		"32-126",
+		"0x20-0x7E,0x4E00-0x9FFF",
+		"65536-1114111",
+		"1-1114111",
+		"Co,Cs,Cn",
+		"127,128-255,65535,65536",
+		"Zs,Ll,48-57,1000000-2147483647",
+	};
+	while ((int)lists.size() < numLists)
+		lists.push_back(randomlist());
+
+	size_t stringsChecked = 0;
+	for (const std::string & text : lists)
+	{
+		allowlistprobe list;
+		const std::string error = list.setcodepointsallowedlist(text);
+		if (!error.empty())
+		{
+			printf("list \"%s\" was refused: %s\n", text.c_str(), error.c_str());
+			return 1;
+		}
+
+		for (std::int32_t c = 1; c <= 0x10FFFF; ++c)
+		{
+			if (!utf8proc_codepoint_valid(c))
+				continue;
+			if (list.isallowed(c) != searchlists(list, c))
+			{
+				printf("list \"%s\": U+%04X is %s by the compiled list, but not the search\n",
+					text.c_str(), (unsigned int)c, list.isallowed(c) ? "allowed" : "refused");
+				return 1;
+			}
+		}
+
+		for (int i = 0; i < 500; ++i, ++stringsChecked)
+		{
+			const std::string str = randomstring();
+			int rejected = 0, searchRejected = 0;
+			const int index = list.checkcodepointsallowed(str, &rejected),
+				searchIndex = searchcheck(list, str, &searchRejected);
+			if (index != searchIndex || (index != -1 && rejected != searchRejected))
+			{
+				printf("list \"%s\": checkcodepointsallowed gave %d (U+%04X), the search gave %d (U+%04X), for:",
+					text.c_str(), index, (unsigned int)rejected, searchIndex, (unsigned int)searchRejected);
+				for (unsigned char ch : str)
+					printf(" %02X", ch);
+				printf("\n");
+				return 1;
+			}
+		}
+	}
+
+	printf("allowlist: %zu lists, every code point, %zu strings, all the same\n", lists.size(), stringsChecked);
+	return 0;
+}
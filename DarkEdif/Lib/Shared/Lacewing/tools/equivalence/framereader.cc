@@ -0,0 +1,269 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+// framereader: checks framereader's one-pass header decoder against its byte-by-byte one.
+//
+// framereader::process decodes a header in one go when the whole of it is in the data it's given, and
+// falls back to a byte-wise state machine when it's split over reads. Random streams of messages are
+// fed in whole (every header takes the one-pass path), a byte at a time (every header takes the
+// byte-wise path), and split at random points, weighted to cut headers short, including at the end
+// of the data. Every way must give back exactly the messages encoded, null terminated, and leave the
+// data as it was.
+// Message sizes cluster around the header form boundaries (254, 0xFFFF) and the framereader's
+// partialPreallocMax, and headers use every form, including longer forms than the size needs.
+//
+// Usage: framereader [streams] [seed]
+
+#include "FrameReader.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// partialPreallocMax is protected
+struct framereaderprobe : framereader
+{
+	static constexpr lw_ui32 prealloc = partialPreallocMax;
+};
+
+struct message
+{
+	lw_ui8 type;
+	std::string data;
+
+	bool operator == (const message & other) const
+	{
+		return type == other.type && data == other.data;
+	}
+};
+
+struct encoded
+{
+	std::string stream;
+	std::vector<message> messages;
+	std::vector<size_t> headerstarts, headersizes;
+};
+
+static std::mt19937 rng;
+
+static size_t randomsize()
+{
+	const size_t p = framereaderprobe::prealloc;
+	static const size_t boundaries[] = {
+		0, 1, 2, 252, 253, 254, 255, 256,
+		0xFFFE, 0xFFFF, 0x10000, 0x10001,
+		p - 2, p - 1, p, p + 1, p + 2, p * 2 + 3
+	};
+
+	switch (rng() % 4)
+	{
+	case 0:
+		return boundaries[rng() % (sizeof(boundaries) / sizeof(*boundaries))];
+	case 1:
+		return rng() % 1024;
+	default:
+		return rng() % 64;
+	}
+}
+
+static void encode(encoded & e, lw_ui8 type, const std::string & data)
+{
+	const lw_ui32 size = (lw_ui32)data.size();
+
+	// Shortest form the size fits, as framebuilder writes, or sometimes a longer one
+	int form = size < 254 ? 0 : size <= 0xFFFF ? 1 : 2;
+	if (rng() % 8 == 0 && form < 2)
+		form += 1 + rng() % (2 - form);
+
+	e.headerstarts.push_back(e.stream.size());
+	e.stream += (char)type;
+
+	if (form == 0)
+		e.stream += (char)size;
+	else if (form == 1)
+	{
+		const lw_ui16 size16 = (lw_ui16)size;
+		e.stream += (char)254;
+		e.stream.append((const char *)&size16, sizeof(size16));
+	}
+	else
+	{
+		e.stream += (char)255;
+		e.stream.append((const char *)&size, sizeof(size));
+	}
+
+	e.headersizes.push_back(e.stream.size() - e.headerstarts.back());
+	e.stream += data;
+	e.messages.push_back({ type, data });
+}
+
+static encoded randomstream()
+{
+	encoded e;
+	const int count = 1 + rng() % 12;
+
+	for (int i = 0; i < count; ++i)
+	{
+		std::string data(randomsize(), '\0');
+		for (char & c : data)
+			c = (char)rng();
+		encode(e, (lw_ui8)rng(), data);
+	}
+
+	return e;
+}
+
+struct receiver
+{
+	std::vector<message> messages;
+	int unterminated = 0;
+
+	static bool handler(void * tag, unsigned char type, const char * data, size_t size)
+	{
+		receiver & r = *(receiver *)tag;
+		if (data[size] != '\0')
+			++r.unterminated;
+		r.messages.push_back({ type, std::string(data, size) });
+		return true;
+	}
+};
+
+// Feeds stream to a new framereader in pieces ending at cuts, each in its own buffer, null terminated as
+// stream data handlers get it, so reading further is caught by ASan or valgrind
+static bool feed(const encoded & e, const std::vector<size_t> & cuts, const char * mode)
+{
+	receiver r;
+	framereader reader;
+	reader.tag = &r;
+	reader.messagehandler = receiver::handler;
+
+	size_t start = 0;
+	for (size_t i = 0; i <= cuts.size(); ++i)
+	{
+		const size_t end = i < cuts.size() ? cuts[i] : e.stream.size();
+		if (end <= start)
+			continue;
+
+		char * const piece = (char *)malloc(end - start + 1);
+		memcpy(piece, e.stream.data() + start, end - start);
+		piece[end - start] = '\0';
+
+		const char * data = piece;
+		size_t size = end - start;
+		while (reader.process(&data, &size))
+			/* next message in the same piece */;
+
+		const bool unchanged = !memcmp(piece, e.stream.data() + start, end - start) && piece[end - start] == '\0';
+		free(piece);
+
+		if (!unchanged)
+		{
+			printf("%s: data changed by process()\n", mode);
+			return false;
+		}
+
+		// Cut short inside a header: nothing from that message may have come out yet
+		for (size_t m = 0; m < e.headerstarts.size(); ++m)
+		{
+			if (end > e.headerstarts[m] && end < e.headerstarts[m] + e.headersizes[m] && r.messages.size() != m)
+			{
+				printf("%s: %zu messages out with message %zu's header cut short\n", mode, r.messages.size(), m);
+				return false;
+			}
+		}
+
+		start = end;
+	}
+
+	if (r.unterminated > 0)
+	{
+		printf("%s: %d messages without a null terminator\n", mode, r.unterminated);
+		return false;
+	}
+	if (r.messages.size() != e.messages.size())
+	{
+		printf("%s: got %zu messages, expected %zu\n", mode, r.messages.size(), e.messages.size());
+		return false;
+	}
+	for (size_t m = 0; m < e.messages.size(); ++m)
+	{
+		if (!(r.messages[m] == e.messages[m]))
+		{
+			printf("%s: message %zu differs (type %u size %zu, expected type %u size %zu)\n", mode, m,
+				r.messages[m].type, r.messages[m].data.size(), e.messages[m].type, e.messages[m].data.size());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	const int streams = argc > 1 ? atoi(argv[1]) : 2000;
+	rng.seed(argc > 2 ? (unsigned int)strtoul(argv[2], nullptr, 0) : 1);
+
+	size_t messages = 0, headercuts = 0;
+
+	for (int n = 0; n < streams; ++n)
+	{
+		const encoded e = randomstream();
+		messages += e.messages.size();
+
+		// Whole: every header goes through the one-pass decoder
+		if (!feed(e, {}, "whole"))
+			return 1;
+
+		// A byte at a time: every header goes through the byte-wise decoder. Slow for the big ones.
+		if (e.stream.size() < 0x40000 || n % 8 == 0)
+		{
+			std::vector<size_t> cuts(e.stream.size());
+			for (size_t i = 0; i < cuts.size(); ++i)
+				cuts[i] = i + 1;
+			if (!feed(e, cuts, "bytewise"))
+				return 1;
+		}
+
+		// Every header cut short at every point in it, one header at a time, so the one-pass decoder
+		// sees a piece that has part of a header with at least two bytes of it
+		for (size_t m = 0; m < e.headerstarts.size(); ++m)
+		{
+			for (size_t at = 1; at < e.headersizes[m]; ++at)
+			{
+				++headercuts;
+				if (!feed(e, { e.headerstarts[m] + at }, "header cut"))
+					return 1;
+
+				// ...and also where the data ends, before the rest of it arrives
+				if (!feed(e, { e.headerstarts[m], e.headerstarts[m] + at }, "header cut at end"))
+					return 1;
+			}
+		}
+
+		// Random cuts, half of them inside headers
+		std::vector<size_t> cuts;
+		for (size_t m = 0; m < e.headerstarts.size(); ++m)
+		{
+			if (rng() % 2)
+				cuts.push_back(e.headerstarts[m] + rng() % (e.headersizes[m] + 1));
+			if (rng() % 2)
+				cuts.push_back(rng() % (e.stream.size() + 1));
+		}
+		std::sort(cuts.begin(), cuts.end());
+		if (!feed(e, cuts, "random cuts"))
+			return 1;
+	}
+
+	printf("framereader: %d streams, %zu messages, %zu header cuts, all decoded the same\n",
+		streams, messages, headercuts);
+	return 0;
+}
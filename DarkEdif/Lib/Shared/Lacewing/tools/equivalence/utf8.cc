@@ -0,0 +1,183 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2017-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+// utf8: checks lw_u8str_asciiprefix and lw_u8str_validate against the byte-at-a-time code they stand in for.
+//
+// lw_u8str_asciiprefix checks a block at a time: 16 bytes with SSE2, or 8 with 64-bit masks elsewhere.
+// The Makefile builds this twice, as utf8 with PhiAddress.cc as normal, and as utf8-nosse2 with
+// LACEWING_NO_SSE2, so on x86 both block versions get checked against the same byte-wise scan.
+// Every byte value is tried at every position in a block, at every alignment.
+//
+// lw_u8str_validate checks byte ranges instead of decoding; it's checked against utf8proc_iterate() and
+// utf8proc_codepoint_valid(), as it was before, on every 1 to 3 byte string, 4 byte strings with
+// every lead and second byte, known overlong, surrogate and past-U+10FFFF forms, and random text with
+// those after ASCII runs of every length around the block sizes.
+//
+// Usage: utf8 [random strings] [seed]
+
+#include "Lacewing.h"
+#include "deps/utf8proc.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static size_t bytewiseprefix(const std::string_view str, bool printableOnly)
+{
+	size_t i = 0;
+	for (; i < str.size(); ++i)
+	{
+		const unsigned char c = (unsigned char)str[i];
+		if (c >= 0x80 || (printableOnly && (c < 0x20 || c == 0x7F)))
+			break;
+	}
+	return i;
+}
+
+// lw_u8str_validate before it stopped decoding
+static bool decodevalidate(const std::string_view toValidate)
+{
+	const utf8proc_uint8_t * str = (const utf8proc_uint8_t *)toValidate.data();
+	utf8proc_int32_t thisChar;
+	utf8proc_ssize_t numBytesInCodePoint, remainder = toValidate.size();
+	while (remainder > 0)
+	{
+		numBytesInCodePoint = utf8proc_iterate(str, remainder, &thisChar);
+		if (numBytesInCodePoint <= 0 || !utf8proc_codepoint_valid(thisChar))
+			return false;
+
+		str += numBytesInCodePoint;
+		remainder -= numBytesInCodePoint;
+	}
+	return true;
+}
+
+static void printbytes(const std::string_view str)
+{
+	for (unsigned char c : str)
+		printf(" %02X", c);
+	printf("\n");
+}
+
+static bool checkprefix(const std::string_view str)
+{
+	for (bool printableOnly : { false, true })
+	{
+		const size_t got = lw_u8str_asciiprefix(str, printableOnly), expected = bytewiseprefix(str, printableOnly);
+		if (got != expected)
+		{
+			printf("lw_u8str_asciiprefix(printableOnly %d) gave %zu, expected %zu, for:", printableOnly, got, expected);
+			printbytes(str);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool checkvalidate(const std::string_view str)
+{
+	const bool got = lw_u8str_validate(str), expected = decodevalidate(str);
+	if (got != expected)
+	{
+		printf("lw_u8str_validate gave %d, expected %d, for:", got, expected);
+		printbytes(str);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	const int numRandom = argc > 1 ? atoi(argv[1]) : 200000;
+	std::mt19937 rng(argc > 2 ? (unsigned int)strtoul(argv[2], nullptr, 0) : 1);
+
+	// asciiprefix: every byte at every position of two blocks, at every alignment, in printable ASCII
+	// and in control characters (ASCII, but not printable)
+	std::vector<char> backing(64);
+	size_t prefixChecks = 0;
+	for (char fill : { 'a', '\x01' })
+	{
+		for (size_t align = 0; align < 16; ++align)
+		{
+			for (size_t length = 0; length <= 40; ++length)
+			{
+				for (size_t at = 0; at <= length; ++at)
+				{
+					for (int byte = 0; byte < 256; ++byte, ++prefixChecks)
+					{
+						std::fill(backing.begin(), backing.end(), fill);
+						if (at < length)
+							backing[align + at] = (char)byte;
+						if (!checkprefix(std::string_view(backing.data() + align, length)))
+							return 1;
+					}
+				}
+			}
+		}
+	}
+
+	// validate: every 1 to 3 byte string
+	size_t validateChecks = 0;
+	for (unsigned int i = 0; i < 0x1000000; ++i, ++validateChecks)
+	{
+		const char bytes[3] = { (char)(i >> 16), (char)(i >> 8), (char)i };
+		if ((i < 0x100 && !checkvalidate(std::string_view(bytes + 2, 1))) ||
+			(i < 0x10000 && !checkvalidate(std::string_view(bytes + 1, 2))) ||
+			!checkvalidate(std::string_view(bytes, 3)))
+		{
+			return 1;
+		}
+	}
+
+	// 4 byte strings with every lead and second byte, and the edges of each range for the rest
+	static const unsigned char edges[] = { 0x00, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xFF };
+	for (int lead = 0xC0; lead < 0x100; ++lead)
+	{
+		for (int second = 0; second < 0x100; ++second)
+		{
+			for (unsigned char third : edges)
+			{
+				for (unsigned char fourth : edges)
+				{
+					++validateChecks;
+					const char bytes[4] = { (char)lead, (char)second, (char)third, (char)fourth };
+					if (!checkvalidate(std::string_view(bytes, 4)))
+						return 1;
+				}
+			}
+		}
+	}
+
+	// Random text: ASCII runs of around a block or two, then a sequence that may be bad
+	static const char * const sequences[] = {
+		"\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\xF4\x8F\xBF\xBF", "\xEF\xBF\xBF",	// valid, up to U+10FFFF
+		"\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", // overlong
+		"\xED\xA0\x80", "\xED\xBF\xBF",											// surrogates
+		"\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF7\xBF\xBF\xBF", "\xF8\x88\x80\x80\x80", // past U+10FFFF
+		"\x80", "\xBF", "\xC3", "\xE4\xB8", "\xF0\x9F\x98", "\xFE", "\xFF",				// stray or cut short
+	};
+	for (int n = 0; n < numRandom; ++n, ++validateChecks, ++prefixChecks)
+	{
+		std::string str;
+		for (int parts = 1 + rng() % 4; parts > 0; --parts)
+		{
+			for (size_t run = rng() % 34; run > 0; --run)
+				str += (char)(rng() % 8 ? 0x20 + rng() % 0x5F : rng() % 0x80);
+			if (rng() % 4)
+				str += sequences[rng() % std::size(sequences)];
+		}
+		if (!checkvalidate(str) || !checkprefix(str))
+			return 1;
+	}
+
+	printf("%s: %zu asciiprefix and %zu validate checks, all the same\n", argv[0], prefixChecks, validateChecks);
+	return 0;
+}
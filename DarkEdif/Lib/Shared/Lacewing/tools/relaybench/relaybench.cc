@@ -0,0 +1,1519 @@
+/* vim: set noet ts=4 sw=4 sts=4 ft=cpp:
+ *
+ * liblacewing and Lacewing Relay/Blue source code are available under MIT license.
+ * Copyright (C) 2012-2022 Darkwire Software.
+ * All rights reserved.
+ *
+ * https://opensource.org/licenses/mit-license.php
+*/
+
+// relaybench: a Linux load generator and throughput benchmark for lacewing::relayserver.
+//
+// Forks a relayserver on loopback (or uses one already running, with -H), connects a swarm of
+// lacewing::relayclient to it spread over a few client eventpumps, then scripts:
+//	connect storm, channel join storm, channel text and binary broadcast at each message size,
+//	peer messages, UDP channel blasts, channel join/leave churn, name changes, and a server at rest.
+// Each scenario reports completed operations per second (connects, joins, or messages received, so a
+// channel message counts once per receiver), p50/p99/p999 latency, the server's and
+// the benchmark's own CPU use, and the server's resident memory; and with a forked server, how many
+// heap allocations it made per operation, counted by wrapping malloc (see the Makefile).
+//
+// Channel and peer traffic is closed-loop: each client keeps -w messages in flight, and sends the
+// next once every receiver has it, so the rate reported is what the server sustains, not what was
+// offered. Blasts are UDP, so they're sent at a fixed rate (-r) instead, and loss is reported.
+// -i connects that many more clients once the swarm has joined, named but in no channel, so the
+// scenarios can be compared at a few and at thousands of clients on the server; with blast, that
+// shows UDP dispatch costs the same however many clients there are.
+// Churn has each client join a channel of its own and leave it again, so the server makes and closes
+// a channel each time, closed-loop; for each count in -c, a few more clients first hold that many
+// other channels open, to show joins don't slow as the channel list grows.
+// Name has each client change its name to one no client has had, and again once the server agrees,
+// closed-loop; the server checks each against every name it has, so run it with thousands of -i too.
+// Quiet sends nothing but a probe peer message every 2ms, for 10 seconds or -d if longer, so it takes
+// in two rounds of pings; its CPU is what the server costs at rest, and the probe latency's tail shows
+// any stall from the ping timer. Run it with a few and with thousands of -i to compare.
+//
+// It also has micro-benchmarks of parts of liblacewing, run in this process; with only those named,
+// there's no server or swarm:
+//	timer: how far a timer's ticks stray from its interval, at 1ms and 10ms, on a pump of its own.
+//	post: pump posts run per second, posted from -t other threads, and from the pump's own thread,
+//		with how long a post took to run, for one in 256.
+//	simplify: lw_u8str_simplify calls per second on -t threads, on ASCII, Latin and CJK names picked
+//		at random from pools smaller and larger than its cache, and utf8proc_map() alone for comparison.
+//	allowlist: codepointsallowlist checks per second on -t threads, of ASCII, Latin and CJK text at
+//		each -s size, against a list that allows all printable ASCII, and one that doesn't, so
+//		ASCII runs are checked a code point at a time.
+//	validate: lw_u8str_validate calls per second on -t threads, on ASCII, Latin and CJK text at each
+//		-s size, and decoding with utf8proc_iterate() as it used to, for comparison; try 16 to 65536.
+// Build with the Makefile alongside; run with -h for the options.
+
+#include "Lacewing.h"
+#include "deps/utf8proc.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// liblacewing leaves these to the application
+extern "C" void always_log(const char * c, ...)
+{
+	va_list v;
+	va_start(v, c);
+	vfprintf(stderr, c, v);
+	va_end(v);
+	fputc('\n', stderr);
+}
+// Only used for websocket handshakes, which the benchmark doesn't make
+extern "C" void lw_sha1(char * output, const char * input, size_t length)
+{
+	memset(output, 0, 20);
+}
+
+/** Allocation counting **/
+
+// The forked server's count of allocations, in memory shared with this process; null with -H
+static std::atomic<lw_ui64> * serverallocs = nullptr;
+// Only set in the forked server, so the benchmark's own allocations aren't counted
+static bool countingallocs = false;
+
+// The Makefile links with --wrap for these, so liblacewing's C code calls them instead of the real ones
+extern "C" void * __real_malloc(size_t size);
+extern "C" void * __real_calloc(size_t count, size_t size);
+extern "C" void * __real_realloc(void * ptr, size_t size);
+
+extern "C" void * __wrap_malloc(size_t size)
+{
+	if (countingallocs)
+		serverallocs->fetch_add(1, std::memory_order_relaxed);
+	return __real_malloc(size);
+}
+extern "C" void * __wrap_calloc(size_t count, size_t size)
+{
+	if (countingallocs)
+		serverallocs->fetch_add(1, std::memory_order_relaxed);
+	return __real_calloc(count, size);
+}
+extern "C" void * __wrap_realloc(void * ptr, size_t size)
+{
+	if (countingallocs)
+		serverallocs->fetch_add(1, std::memory_order_relaxed);
+	return __real_realloc(ptr, size);
+}
+
+// libstdc++'s own operator new calls malloc from inside the shared library, which --wrap can't reach;
+// this one's malloc is wrapped. The other forms of new, and delete, all end up at this or at free().
+void * operator new(size_t size)
+{
+	if (void * ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+static struct
+{
+	const char * host = nullptr; // server already running elsewhere; if null, one is forked
+	lw_ui16 port = 16121;
+	int clients = 50;
+	int idle = 0;
+	int threads = 2;
+	double seconds = 3;
+	int window = 2;
+	int blastrate = 2000;
+	std::vector<size_t> sizes = { 64, 1024, 16384 };
+	std::vector<int> channelcounts = { 1000, 10000, 50000 };
+	std::vector<std::string> scenarios;
+	std::string queue = "io_uring"; // the forked server's event queue; the swarm always uses epoll
+} opt;
+
+// The event queue the forked server ended up with, as io_uring falls back to epoll if unsupported
+static const char * serverqueue = "unknown";
+
+static lw_ui64 nowns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (lw_ui64)ts.tv_sec * 1000000000ull + (lw_ui64)ts.tv_nsec;
+}
+
+struct client;
+
+// One client eventpump and its thread; clients are spread over these round-robin
+struct worker
+{
+	int index = 0;
+	lacewing::eventpump pump = nullptr;
+	std::thread thread;
+	std::vector<client *> clients;
+
+	lacewing::timer blasttimer = nullptr;
+	double blastcarry = 0;
+	size_t blastnext = 0;
+
+	// Microseconds; only touched on this worker's thread, or after a oneach() barrier
+	std::vector<float> latencies;
+};
+
+// A message a client has in flight, and how many receivers haven't got it yet
+struct slot
+{
+	client * owner = nullptr;
+	lw_ui32 index = 0;
+	std::atomic<int> outstanding { 0 };
+};
+
+struct client
+{
+	int index = 0;
+	worker * w = nullptr;
+	lacewing::relayclient * relay = nullptr;
+	lw_ui64 started = 0;
+	bool idle = false;
+	int holding = 0; // channels held open for churn, by holders
+	int renames = 0;
+	std::shared_ptr<lacewing::relayclient::channel> channel;
+	std::shared_ptr<lacewing::relayclient::channel::peer> target;
+	std::unique_ptr<slot[]> slots;
+};
+
+static std::vector<std::unique_ptr<worker>> workers;
+static std::vector<std::unique_ptr<client>> clients;
+// Clients that only connect and set a name, connected with -i; not in any worker's clients
+static std::vector<std::unique_ptr<client>> idlers;
+// Idle clients that hold channels open for churn, connected when it first runs
+static std::vector<std::unique_ptr<client>> holders;
+static const int holdercount = 16;
+static pid_t serverpid = 0;
+static bool findingport = false;
+
+enum class traffic { text, binary, peer, blast, quiet };
+static traffic mode;
+static size_t msgsize;
+
+// Stamped into each message, so stragglers from an earlier run aren't counted in the next
+static std::atomic<lw_ui32> run { 0 };
+static std::atomic<bool> sending { false }, finished { false }, churning { false }, renaming { false };
+static std::atomic<lw_ui64> sent { 0 }, delivered { 0 }, churned { 0 }, renamed { 0 };
+static std::atomic<int> connected { 0 }, named { 0 }, joined { 0 }, peersknown { 0 }, held { 0 };
+static std::atomic<int> idleconnected { 0 }, idlenamed { 0 };
+
+/** Message stamps **/
+
+struct stamp
+{
+	lw_ui32 sender, slot, run, unused;
+	lw_ui64 sentns;
+};
+
+// Text messages carry the stamp as hex, so they stay printable ASCII
+static const size_t textstampsize = 40;
+
+static std::string_view makemessage(const client & c, lw_ui32 slotindex)
+{
+	thread_local std::string buffer;
+	const stamp s = { (lw_ui32)c.index, slotindex, run, 0, nowns() };
+
+	if (mode == traffic::text)
+	{
+		char head[textstampsize + 1];
+		snprintf(head, sizeof(head), "%08x%08x%08x%016llx", s.sender, s.slot, s.run, (unsigned long long)s.sentns);
+		buffer.assign(std::max(msgsize, textstampsize), 'a');
+		memcpy(&buffer[0], head, textstampsize);
+	}
+	else
+	{
+		buffer.assign(std::max(msgsize, sizeof(s)), '\xA5');
+		memcpy(&buffer[0], &s, sizeof(s));
+	}
+	return buffer;
+}
+
+static bool readstamp(std::string_view message, lw_ui8 variant, stamp & s)
+{
+	if (variant == 0)
+	{
+		if (message.size() < textstampsize)
+			return false;
+		const std::string head(message.substr(0, textstampsize));
+		unsigned long long sentns;
+		if (sscanf(head.c_str(), "%8x%8x%8x%16llx", &s.sender, &s.slot, &s.run, &sentns) != 4)
+			return false;
+		s.sentns = sentns;
+		return true;
+	}
+	if (message.size() < sizeof(s))
+		return false;
+	memcpy(&s, message.data(), sizeof(s));
+	return true;
+}
+
+/** Sending and receiving **/
+
+static void sendfrom(slot & s)
+{
+	if (!sending)
+		return;
+
+	client & c = *s.owner;
+	s.outstanding = mode == traffic::peer ? 1 : (int)clients.size() - 1;
+
+	const std::string_view message = makemessage(c, s.index);
+	if (mode == traffic::peer)
+		c.target->send(0, message, 2);
+	else
+		c.channel->send(0, message, mode == traffic::text ? 0 : 2);
+	++sent;
+}
+
+static void lw_callback sendposted(void * param)
+{
+	sendfrom(*(slot *)param);
+}
+
+static void received(client & c, std::string_view message, lw_ui8 variant)
+{
+	stamp s;
+	if (!readstamp(message, variant, s) || s.run != run || s.sender >= clients.size())
+		return;
+
+	c.w->latencies.push_back((float)((nowns() - s.sentns) / 1000.0));
+	++delivered;
+
+	if (mode == traffic::blast || mode == traffic::quiet || s.slot >= (lw_ui32)opt.window)
+		return;
+
+	// Last receiver of this message lets the sender send its next, on the sender's own thread
+	client & sender = *clients[s.sender];
+	slot & done = sender.slots[s.slot];
+	if (--done.outstanding == 0)
+		sender.w->pump->post((void *)sendposted, &done);
+}
+
+static void lw_callback blasttick(lacewing::timer timer)
+{
+	worker & w = *(worker *)timer->tag();
+	if (!sending || w.clients.empty())
+		return;
+
+	// One probe a tick, from the first client to the next
+	if (mode == traffic::quiet)
+	{
+		client & c = *clients[0];
+		c.target->send(0, makemessage(c, 0), 2);
+		++sent;
+		return;
+	}
+
+	// Share the swarm-wide rate between workers by how many clients each has; timer ticks every 10ms
+	w.blastcarry += opt.blastrate * 0.01 * w.clients.size() / clients.size();
+	for (; w.blastcarry >= 1; w.blastcarry -= 1)
+	{
+		client & c = *w.clients[w.blastnext++ % w.clients.size()];
+		c.channel->blast(0, makemessage(c, 0), 2);
+		++sent;
+	}
+}
+
+/** Client handlers **/
+
+static client & of(lacewing::relayclient & relay)
+{
+	return *(client *)relay.tag;
+}
+
+static void onconnect(lacewing::relayclient & relay)
+{
+	client & c = of(relay);
+	if (c.idle)
+	{
+		++idleconnected;
+		relay.name("idle" + std::to_string(c.index));
+		return;
+	}
+	c.w->latencies.push_back((float)((nowns() - c.started) / 1000.0));
+	++connected;
+	relay.name("bench" + std::to_string(c.index));
+}
+
+static void onconnectiondenied(lacewing::relayclient & relay, std::string_view reason)
+{
+	fprintf(stderr, "client %d: connection denied: %.*s\n", of(relay).index, (int)reason.size(), reason.data());
+}
+
+static void ondisconnect(lacewing::relayclient & relay)
+{
+	if (!finished)
+		fprintf(stderr, "client %d: disconnected\n", of(relay).index);
+}
+
+static void onerror(lacewing::relayclient & relay, lacewing::error error)
+{
+	fprintf(stderr, "client %d: error: %s\n", of(relay).index, error->tostring());
+}
+
+// Names are unique by their index and how many times they've changed, so the server never refuses one
+static void rename(client & c)
+{
+	c.started = nowns();
+	c.relay->name("bench" + std::to_string(c.index) + "_" + std::to_string(++c.renames));
+}
+
+static void onname_set(lacewing::relayclient & relay)
+{
+	++(of(relay).idle ? idlenamed : named);
+}
+
+static void onname_changed(lacewing::relayclient & relay, std::string_view oldname)
+{
+	client & c = of(relay);
+	c.w->latencies.push_back((float)((nowns() - c.started) / 1000.0));
+	++renamed;
+	if (renaming)
+		rename(c);
+}
+
+static void onname_denied(lacewing::relayclient & relay, std::string_view name, std::string_view reason)
+{
+	fprintf(stderr, "client %d: name denied: %.*s\n", of(relay).index, (int)reason.size(), reason.data());
+}
+
+static void onchannel_join(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel)
+{
+	client & c = of(relay);
+	const std::string name = channel->name();
+	if (!name.compare(0, 4, "hold"))
+	{
+		++held;
+		return;
+	}
+	if (!name.compare(0, 5, "churn"))
+	{
+		// Straight back out; the server closes it, as it's empty
+		channel->leave();
+		return;
+	}
+	c.w->latencies.push_back((float)((nowns() - c.started) / 1000.0));
+	c.channel = channel;
+	peersknown += channel->peercount();
+	++joined;
+}
+
+static void onchannel_joindenied(lacewing::relayclient & relay, std::string_view channelname, std::string_view reason)
+{
+	fprintf(stderr, "client %d: join denied: %.*s\n", of(relay).index, (int)reason.size(), reason.data());
+}
+
+static void onchannel_leave(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel)
+{
+	client & c = of(relay);
+	c.w->latencies.push_back((float)((nowns() - c.started) / 1000.0));
+	++churned;
+	if (churning)
+	{
+		c.started = nowns();
+		relay.join("churn" + std::to_string(c.index));
+	}
+}
+
+static void onchannel_leavedenied(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel,
+	std::string_view reason)
+{
+	fprintf(stderr, "client %d: leave denied: %.*s\n", of(relay).index, (int)reason.size(), reason.data());
+}
+
+static void onpeer_connect(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel,
+	std::shared_ptr<lacewing::relayclient::channel::peer> peer)
+{
+	++peersknown;
+}
+
+static void onmessage_channel(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel,
+	std::shared_ptr<lacewing::relayclient::channel::peer> peer, bool blasted, lw_ui8 subchannel, std::string_view message, lw_ui8 variant)
+{
+	received(of(relay), message, variant);
+}
+
+static void onmessage_peer(lacewing::relayclient & relay, std::shared_ptr<lacewing::relayclient::channel> channel,
+	std::shared_ptr<lacewing::relayclient::channel::peer> peer, bool blasted, lw_ui8 subchannel, std::string_view message, lw_ui8 variant)
+{
+	received(of(relay), message, variant);
+}
+
+/** Running things on the client threads **/
+
+static void lw_callback runtask(void * param)
+{
+	auto task = (std::packaged_task<void()> *)param;
+	(*task)();
+	delete task;
+}
+
+// Runs fn on pump's thread
+static std::future<void> postto(lacewing::eventpump pump, std::function<void()> fn)
+{
+	auto task = new std::packaged_task<void()>(std::move(fn));
+	std::future<void> done = task->get_future();
+	pump->post((void *)runtask, task);
+	return done;
+}
+
+// Runs fn on every worker's thread, and waits for all of them
+static void oneach(const std::function<void(worker &)> & fn)
+{
+	std::vector<std::future<void>> done;
+	for (auto & w : workers)
+	{
+		worker * wp = w.get();
+		done.push_back(postto(w->pump, [&fn, wp] { fn(*wp); }));
+	}
+	for (auto & f : done)
+		f.wait();
+}
+
+static bool waitfor(const std::atomic<int> & counter, int target, double timeoutsec)
+{
+	const lw_ui64 end = nowns() + (lw_ui64)(timeoutsec * 1e9);
+	while (counter < target)
+	{
+		if (nowns() > end)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+/** Measurement **/
+
+struct procusage
+{
+	double cpuseconds = 0;
+	long rsskb = 0, peakrsskb = 0;
+};
+
+static procusage readusage(pid_t pid)
+{
+	procusage u;
+	char path[64], buf[1024];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (FILE * f = fopen(path, "r"))
+	{
+		const size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+		buf[n] = '\0';
+		fclose(f);
+
+		// The command name can contain spaces, so count fields from its closing bracket;
+		// utime and stime are fields 14 and 15, in clock ticks
+		const char * p = strrchr(buf, ')');
+		unsigned long utime, stime;
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+			u.cpuseconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if (FILE * f = fopen(path, "r"))
+	{
+		while (fgets(buf, sizeof(buf), f))
+		{
+			sscanf(buf, "VmRSS: %ld", &u.rsskb);
+			sscanf(buf, "VmHWM: %ld", &u.peakrsskb);
+		}
+		fclose(f);
+	}
+	return u;
+}
+
+// CPU and time over a scenario, from start() to stop()
+struct measurement
+{
+	lw_ui64 startns = 0, endns = 0;
+	procusage server, self, serverend, selfend;
+	lw_ui64 allocs = 0, allocsend = 0;
+
+	void start()
+	{
+		if (serverpid)
+			server = readusage(serverpid);
+		self = readusage(getpid());
+		if (serverallocs)
+			allocs = *serverallocs;
+		startns = nowns();
+	}
+	void stop()
+	{
+		endns = nowns();
+		if (serverallocs)
+			allocsend = *serverallocs;
+		if (serverpid)
+			serverend = readusage(serverpid);
+		selfend = readusage(getpid());
+	}
+};
+
+static std::vector<float> collectlatencies()
+{
+	std::vector<float> all;
+	oneach([&](worker & w) {
+		// Workers run this at the same time
+		static std::mutex m;
+		std::lock_guard<std::mutex> lock(m);
+		all.insert(all.end(), w.latencies.begin(), w.latencies.end());
+		w.latencies.clear();
+	});
+	std::sort(all.begin(), all.end());
+	return all;
+}
+
+static float percentile(const std::vector<float> & sorted, double q)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+static void printheader()
+{
+	printf("%-10s %6s %11s %9s %9s %9s %8s %8s %9s  %s\n",
+		"scenario", "size", "ops/sec", "p50 us", "p99 us", "p999 us", "srv cpu", "cli cpu", "srv rss", "notes");
+}
+
+// Latencies must be sorted; the server columns are left blank for micro-benchmarks, which don't use it
+static void printrow(const char * name, size_t size, const measurement & m, lw_ui64 ops,
+	const std::vector<float> & latencies, bool server, const std::string & notes)
+{
+	const double elapsed = (m.endns - m.startns) / 1e9;
+
+	char sizestr[16] = "-", p50[16] = "-", p99[16] = "-", p999[16] = "-", srvcpu[16] = "-", srvrss[16] = "-", allocs[48] = "";
+	if (size)
+		snprintf(sizestr, sizeof(sizestr), "%zu", size);
+	if (!latencies.empty())
+	{
+		snprintf(p50, sizeof(p50), "%.0f", percentile(latencies, 0.50));
+		snprintf(p99, sizeof(p99), "%.0f", percentile(latencies, 0.99));
+		snprintf(p999, sizeof(p999), "%.0f", percentile(latencies, 0.999));
+	}
+	if (server && serverpid)
+	{
+		snprintf(srvcpu, sizeof(srvcpu), "%.0f%%", 100 * (m.serverend.cpuseconds - m.server.cpuseconds) / elapsed);
+		snprintf(srvrss, sizeof(srvrss), "%.1fMB", m.serverend.rsskb / 1024.0);
+	}
+	if (server && serverallocs && ops)
+	{
+		snprintf(allocs, sizeof(allocs), "%s%.2f srv allocs/op", notes.empty() ? "" : ", ",
+			(double)(m.allocsend - m.allocs) / ops);
+	}
+	printf("%-10s %6s %11.0f %9s %9s %9s %8s %7.0f%% %9s  %s%s\n", name, sizestr, ops / elapsed, p50, p99, p999,
+		srvcpu, 100 * (m.selfend.cpuseconds - m.self.cpuseconds) / elapsed, srvrss, notes.c_str(), allocs);
+	fflush(stdout);
+}
+
+static void report(const char * name, size_t size, const measurement & m, lw_ui64 ops, const std::string & notes = std::string())
+{
+	printrow(name, size, m, ops, collectlatencies(), true, notes);
+}
+
+/** Scenarios **/
+
+// Makes c's relayclient on w's thread, and starts it connecting
+static void connectclient(worker & w, client & c)
+{
+	c.relay = new lacewing::relayclient(w.pump);
+	lacewing::relayclient & relay = *c.relay;
+	relay.tag = &c;
+	relay.onconnect(onconnect);
+	relay.onconnectiondenied(onconnectiondenied);
+	relay.ondisconnect(ondisconnect);
+	relay.onerror(onerror);
+	relay.onname_set(onname_set);
+	relay.onname_changed(onname_changed);
+	relay.onname_denied(onname_denied);
+	relay.onchannel_join(onchannel_join);
+	relay.onchannel_joindenied(onchannel_joindenied);
+	relay.onchannel_leave(onchannel_leave);
+	relay.onchannel_leavedenied(onchannel_leavedenied);
+	relay.onpeer_connect(onpeer_connect);
+	relay.onmessage_channel(onmessage_channel);
+	relay.onmessage_peer(onmessage_peer);
+
+	c.started = nowns();
+	relay.connect(opt.host ? opt.host : "127.0.0.1", opt.port);
+}
+
+static bool connectstorm()
+{
+	measurement m;
+	m.start();
+
+	oneach([](worker & w) {
+		for (client * c : w.clients)
+			connectclient(w, *c);
+	});
+
+	// Connected includes the UDP handshake; names are set after, and needed before joining
+	const bool ok = waitfor(connected, (int)clients.size(), 60);
+	m.stop();
+	if (!ok || !waitfor(named, (int)clients.size(), 60))
+	{
+		fprintf(stderr, "connect storm: only %d of %zu clients connected, %d named\n", (int)connected, clients.size(), (int)named);
+		return false;
+	}
+	report("connect", 0, m, clients.size());
+	return true;
+}
+
+static bool joinstorm()
+{
+	measurement m;
+	m.start();
+
+	oneach([](worker & w) {
+		for (client * c : w.clients)
+		{
+			c->started = nowns();
+			c->relay->join("bench");
+		}
+	});
+
+	const bool ok = waitfor(joined, (int)clients.size(), 60);
+	m.stop();
+
+	// Messages from a peer a client hasn't heard of yet are dropped, so wait for every peer list to fill
+	const int everypeer = (int)(clients.size() * (clients.size() - 1));
+	if (!ok || !waitfor(peersknown, everypeer, 60))
+	{
+		fprintf(stderr, "join storm: %d of %zu clients joined, %d of %d peers known\n", (int)joined, clients.size(), (int)peersknown, everypeer);
+		return false;
+	}
+	report("join", 0, m, clients.size());
+
+	// Peer messages go from each client to the next one along
+	bool targetsfound = true;
+	oneach([&](worker & w) {
+		for (client * c : w.clients)
+		{
+			const lw_ui16 id = clients[(c->index + 1) % clients.size()]->relay->id();
+			auto rl = c->channel->lock.createReadLock();
+			for (auto & p : c->channel->getpeers())
+				if (p->id() == id)
+					c->target = p;
+			if (!c->target)
+				targetsfound = false;
+		}
+	});
+	if (!targetsfound)
+		fprintf(stderr, "join storm: a client didn't have its peer message target in its channel\n");
+	return targetsfound;
+}
+
+static bool connectidle()
+{
+	if (opt.idle == 0)
+		return true;
+
+	// In batches, as thousands of connects at once overflow the server's listen backlog, and the
+	// dropped SYNs are retried a second or more later
+	const int batch = 256;
+
+	measurement m;
+	m.start();
+	for (int first = 0; first < opt.idle; first += batch)
+	{
+		const int last = std::min(opt.idle, first + batch);
+		oneach([first, last](worker & w) {
+			for (int i = first; i < last; ++i)
+				if (idlers[i]->w == &w)
+					connectclient(w, *idlers[i]);
+		});
+		if (!waitfor(idlenamed, last, 60))
+		{
+			fprintf(stderr, "idle clients: only %d of %d connected, %d named\n", (int)idleconnected, opt.idle, (int)idlenamed);
+			return false;
+		}
+	}
+	m.stop();
+	report("idleconn", 0, m, opt.idle, "named, in no channel");
+	return true;
+}
+
+static void runtraffic(const char * name, traffic kind, size_t size)
+{
+	mode = kind;
+	msgsize = size;
+	++run;
+	sent = 0;
+	delivered = 0;
+
+	measurement m;
+	m.start();
+	sending = true;
+
+	if (mode == traffic::blast)
+	{
+		oneach([](worker & w) {
+			w.blastcarry = 0;
+			w.blasttimer->start(10);
+		});
+	}
+	else if (mode == traffic::quiet)
+		clients[0]->w->blasttimer->start(2);
+	else
+	{
+		oneach([](worker & w) {
+			for (client * c : w.clients)
+				for (int i = 0; i < opt.window; ++i)
+					sendfrom(c->slots[i]);
+		});
+	}
+
+	// Clients are pinged every 5 seconds, so quiet takes in two rounds of it
+	usleep((useconds_t)((mode == traffic::quiet ? std::max(opt.seconds, 10.0) : opt.seconds) * 1e6));
+	sending = false;
+	m.stop();
+	const lw_ui64 deliveredatstop = delivered, sentatstop = sent;
+
+	if (mode == traffic::blast || mode == traffic::quiet)
+		oneach([](worker & w) { w.blasttimer->stop(); });
+
+	// Let what's in flight land, so the next run starts from a quiet server
+	usleep(300 * 1000);
+
+	std::string notes;
+	if (mode == traffic::blast)
+	{
+		const double expected = (double)sent * (clients.size() - 1);
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%llu sent, %.2f%% lost", (unsigned long long)sentatstop,
+			expected ? 100 * (1 - delivered / expected) : 0.0);
+		notes = buf;
+	}
+	else if (mode == traffic::quiet)
+		notes = "probes among " + std::to_string(clients.size() + idlers.size() + holders.size()) + " clients";
+	report(name, size, m, deliveredatstop, notes);
+}
+
+static bool runchurn(int channels)
+{
+	if (holders.empty())
+	{
+		for (int i = 0; i < holdercount; ++i)
+		{
+			auto c = std::make_unique<client>();
+			c->index = opt.clients + opt.idle + i;
+			c->w = workers[i % workers.size()].get();
+			c->idle = true;
+			holders.push_back(std::move(c));
+		}
+		oneach([](worker & w) {
+			for (auto & c : holders)
+				if (c->w == &w)
+					connectclient(w, *c);
+		});
+		if (!waitfor(idlenamed, opt.idle + holdercount, 60))
+		{
+			fprintf(stderr, "churn: only %d of %d channel holders named\n", (int)idlenamed - opt.idle, holdercount);
+			return false;
+		}
+	}
+
+	// Hold channels open up to the count, each holder taking every holdercount'th one, so the
+	// churning clients' own channel lists stay empty. A hundred each at a time, as both ends drop
+	// a connection that has 300 messages for them in one go.
+	while (held < channels)
+	{
+		const int target = std::min(channels, held + 100 * holdercount);
+		oneach([target](worker & w) {
+			for (auto & c : holders)
+			{
+				if (c->w != &w)
+					continue;
+				for (int j; (j = (c->index - holders[0]->index) + c->holding * holdercount) < target; ++c->holding)
+					c->relay->join("hold" + std::to_string(j));
+			}
+		});
+		if (!waitfor(held, target, 60))
+		{
+			fprintf(stderr, "churn: only %d of %d channels held open\n", (int)held, channels);
+			return false;
+		}
+	}
+
+	churned = 0;
+	measurement m;
+	m.start();
+	churning = true;
+	oneach([](worker & w) {
+		for (client * c : w.clients)
+		{
+			c->started = nowns();
+			c->relay->join("churn" + std::to_string(c->index));
+		}
+	});
+
+	usleep((useconds_t)(opt.seconds * 1e6));
+	churning = false;
+	m.stop();
+	const lw_ui64 churnedatstop = churned;
+
+	// Let the last joins and leaves land
+	usleep(300 * 1000);
+
+	report("churn", 0, m, churnedatstop, "join+leave, " + std::to_string(channels) + " channels");
+	return true;
+}
+
+static void runname()
+{
+	renamed = 0;
+	measurement m;
+	m.start();
+	renaming = true;
+	oneach([](worker & w) {
+		for (client * c : w.clients)
+			rename(*c);
+	});
+
+	usleep((useconds_t)(opt.seconds * 1e6));
+	renaming = false;
+	m.stop();
+	const lw_ui64 renamedatstop = renamed;
+
+	// Let the last name changes land
+	usleep(300 * 1000);
+
+	report("name", 0, m, renamedatstop, "among " + std::to_string(clients.size() + idlers.size() + holders.size()) + " names");
+}
+
+/** Micro-benchmarks **/
+
+static const char * const micros[] = { "timer", "post", "simplify", "allowlist", "validate" };
+
+static bool ismicro(const std::string & name)
+{
+	return std::find(std::begin(micros), std::end(micros), name) != std::end(micros);
+}
+
+// An eventpump on a thread of its own, so nothing else runs on it
+struct micropump
+{
+	lacewing::eventpump pump = lacewing::eventpump_new();
+	std::thread thread { [pump = pump] { pump->start_eventloop(); } };
+
+	~micropump()
+	{
+		pump->post_eventloop_exit();
+		thread.join();
+		lacewing::pump_delete(pump);
+	}
+};
+
+struct ticks
+{
+	long interval = 0;
+	lw_ui64 lastns = 0;
+	// Microseconds each gap between ticks was off the interval by, either way
+	std::vector<float> strays;
+};
+
+static void lw_callback jittertick(lacewing::timer timer)
+{
+	ticks & t = *(ticks *)timer->tag();
+	const lw_ui64 now = nowns();
+	if (t.lastns)
+		t.strays.push_back((float)fabs((now - t.lastns) / 1000.0 - t.interval * 1000.0));
+	t.lastns = now;
+}
+
+static void runtimer()
+{
+	for (long interval : { 1L, 10L })
+	{
+		micropump p;
+		ticks t;
+		t.interval = interval;
+		lacewing::timer timer = nullptr;
+
+		measurement m;
+		m.start();
+		postto(p.pump, [&] {
+			timer = lacewing::timer_new(p.pump);
+			timer->tag(&t);
+			timer->on_tick(jittertick);
+			timer->start(interval);
+		}).wait();
+		usleep((useconds_t)(opt.seconds * 1e6));
+		postto(p.pump, [&] {
+			timer->stop();
+			lacewing::timer_delete(timer);
+		}).wait();
+		m.stop();
+
+		std::sort(t.strays.begin(), t.strays.end());
+		printrow("timer", 0, m, t.strays.size() + 1, t.strays, false,
+			std::to_string(interval) + "ms interval; latency is how far off it each tick was");
+	}
+}
+
+struct posts
+{
+	lacewing::eventpump pump = nullptr;
+	std::atomic<bool> stop { false };
+	std::atomic<lw_ui64> posted { 0 }, ran { 0 };
+	// Only touched on the pump's thread
+	std::vector<float> latencies;
+};
+static posts * postbench = nullptr;
+
+static void lw_callback postran(void * param)
+{
+	posts & p = *postbench;
+	++p.ran;
+	if (param)
+	{
+		p.latencies.push_back((float)((nowns() - *(lw_ui64 *)param) / 1000.0));
+		delete (lw_ui64 *)param;
+	}
+}
+
+// Every 256th post carries when it was posted
+static void post(posts & p, void (lw_callback * func)(void *))
+{
+	const lw_ui64 n = p.posted++;
+	p.pump->post((void *)func, n % 256 ? nullptr : new lw_ui64(nowns()));
+}
+
+// Reposts itself, from the pump's thread, until stopped
+static void lw_callback postself(void * param)
+{
+	postran(param);
+	if (!postbench->stop)
+		post(*postbench, postself);
+}
+
+static void runpost()
+{
+	for (bool fromself : { false, true })
+	{
+		micropump mp;
+		posts p;
+		p.pump = mp.pump;
+		postbench = &p;
+
+		measurement m;
+		m.start();
+		std::vector<std::thread> producers;
+		if (fromself)
+		{
+			// Keep 64 going, so the pump always has some queued
+			postto(mp.pump, [&] {
+				for (int i = 0; i < 64; ++i)
+					post(p, postself);
+			}).wait();
+		}
+		else
+		{
+			for (int i = 0; i < opt.threads; ++i)
+			{
+				producers.emplace_back([&] {
+					while (!p.stop)
+					{
+						// Don't let the queue grow without bound if the pump can't keep up; the latencies
+						// include waiting behind up to this many
+						if (p.posted - p.ran > 8192)
+							std::this_thread::yield();
+						else
+							post(p, postran);
+					}
+				});
+			}
+		}
+		usleep((useconds_t)(opt.seconds * 1e6));
+		p.stop = true;
+		for (std::thread & t : producers)
+			t.join();
+		m.stop();
+		const lw_ui64 ran = p.ran;
+
+		// Let the rest run before the pump goes
+		postto(mp.pump, [] {}).wait();
+		std::sort(p.latencies.begin(), p.latencies.end());
+		printrow("post", 0, m, ran, p.latencies, false, fromself ? "from the pump's own thread" :
+			"from " + std::to_string(opt.threads) + " other threads");
+		postbench = nullptr;
+	}
+}
+
+// Runs fn over and over on -t threads for -d seconds, giving each thread its own random numbers, and
+// returns how many times it ran in all
+template <typename fn>
+static lw_ui64 spin(measurement & m, fn f)
+{
+	std::atomic<bool> stop { false };
+	std::atomic<lw_ui64> total { 0 };
+	std::vector<std::thread> threads;
+
+	m.start();
+	for (int i = 0; i < opt.threads; ++i)
+	{
+		threads.emplace_back([&, i] {
+			std::minstd_rand rng(i + 1);
+			lw_ui64 n = 0;
+			for (; !stop; ++n)
+				f(rng);
+			total += n;
+		});
+	}
+	usleep((useconds_t)(opt.seconds * 1e6));
+	stop = true;
+	for (std::thread & t : threads)
+		t.join();
+	m.stop();
+	return total;
+}
+
+static const struct
+{
+	const char * name, * prefix;
+} scripts[] = {
+	{ "ascii", "Player" },
+	{ "latin", "Zo\xC3\xAB \xC3\x85ngstr\xC3\xB6m" },
+	{ "cjk", "\xE7\x8E\xA9\xE5\xAE\xB6" },
+};
+
+static void runsimplify()
+{
+	for (const auto & script : scripts)
+	{
+		std::vector<std::string> names(50000);
+		for (size_t i = 0; i < names.size(); ++i)
+			names[i] = script.prefix + std::to_string(i);
+
+		// Pools up to the cache's 2048 entries stay in it; 50000 mostly misses. ASCII isn't cached.
+		const bool ascii = script.name == scripts[0].name;
+		for (size_t pool : ascii ? std::vector<size_t> { 100 } : std::vector<size_t> { 100, 2048, 50000 })
+		{
+			for (size_t i = 0; i < pool; ++i)
+				lw_u8str_simplify(names[i]);
+
+			measurement m;
+			const lw_ui64 calls = spin(m, [&](std::minstd_rand & rng) {
+				lw_u8str_simplify(names[rng() % pool]);
+			});
+			printrow("simplify", 0, m, calls, {}, false,
+				std::string(script.name) + ", " + std::to_string(pool) + " names" + (ascii ? ", not cached" : ""));
+		}
+		if (ascii)
+			continue;
+
+		// What every call cost before the cache: the same utf8proc pass lw_u8str_simplify makes
+		const utf8proc_option_t options = (utf8proc_option_t)(UTF8PROC_STABLE | UTF8PROC_COMPOSE | UTF8PROC_COMPAT |
+			UTF8PROC_NLF2LS | UTF8PROC_STRIPCC | UTF8PROC_REJECTNA | UTF8PROC_CASEFOLD | UTF8PROC_LUMP | UTF8PROC_STRIPMARK);
+		measurement m;
+		const lw_ui64 calls = spin(m, [&](std::minstd_rand & rng) {
+			const std::string & name = names[rng() % names.size()];
+			utf8proc_uint8_t * mapped;
+			if (utf8proc_map((const utf8proc_uint8_t *)name.data(), name.size(), &mapped, options) > 0)
+				free(mapped);
+		});
+		printrow("simplify", 0, m, calls, {}, false, std::string(script.name) + ", utf8proc_map() alone");
+	}
+}
+
+// The script's prefix and a space over and over, cut back to size at the end of a code point
+static std::string maketext(const char * prefix, size_t size)
+{
+	std::string text;
+	while (text.size() < size)
+		text = text + prefix + " ";
+	text.resize(size);
+	while (!text.empty() && ((unsigned char)text.back() & 0xC0) == 0x80)
+		text.pop_back();
+	if (!text.empty() && (unsigned char)text.back() >= 0xC0)
+		text.pop_back();
+	return text;
+}
+
+static std::string throughput(const measurement & m, lw_ui64 bytes)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.0f MB/s", bytes / ((m.endns - m.startns) / 1e9) / 1e6);
+	return buf;
+}
+
+static void runallowlist()
+{
+	// Both allow all the text; the first leaves out ASCII symbols, as Bluewing Server's default name list does
+	for (const char * allowed : { "L*,M*,N*,P*,Zs", "32-126,L*,M*,N*,P*,Zs" })
+	{
+		lacewing::codepointsallowlist list;
+		const std::string error = list.setcodepointsallowedlist(allowed);
+		if (!error.empty())
+		{
+			fprintf(stderr, "allowlist: list refused: %s\n", error.c_str());
+			return;
+		}
+		for (const auto & script : scripts)
+		{
+			for (size_t size : opt.sizes)
+			{
+				const std::string text = maketext(script.prefix, size);
+				measurement m;
+				const lw_ui64 checks = spin(m, [&](std::minstd_rand &) {
+					if (list.checkcodepointsallowed(text) != -1)
+						abort();
+				});
+				printrow("allowlist", size, m, checks, {}, false, std::string(script.name) + ", " +
+					throughput(m, checks * text.size()) + ", list " + allowed);
+			}
+		}
+	}
+}
+
+// lw_u8str_validate as it was, decoding every code point
+static bool decodevalidate(const std::string_view text)
+{
+	const utf8proc_uint8_t * str = (const utf8proc_uint8_t *)text.data();
+	utf8proc_int32_t codePoint;
+	for (utf8proc_ssize_t remaining = text.size(), length; remaining > 0; str += length, remaining -= length)
+	{
+		length = utf8proc_iterate(str, remaining, &codePoint);
+		if (length <= 0 || !utf8proc_codepoint_valid(codePoint))
+			return false;
+	}
+	return true;
+}
+
+static void runvalidate()
+{
+	for (bool decode : { false, true })
+	{
+		for (const auto & script : scripts)
+		{
+			for (size_t size : opt.sizes)
+			{
+				const std::string text = maketext(script.prefix, size);
+				measurement m;
+				const lw_ui64 checks = spin(m, [&](std::minstd_rand &) {
+					if (!(decode ? decodevalidate(text) : lw_u8str_validate(text)))
+						abort();
+				});
+				printrow("validate", size, m, checks, {}, false, std::string(script.name) + ", " +
+					throughput(m, checks * text.size()) + (decode ? ", utf8proc_iterate() alone" : ""));
+			}
+		}
+	}
+}
+
+// Whether this process has an io_uring open, which an eventpump made instead of an epoll fd
+static bool usingiouring()
+{
+	DIR * dir = opendir("/proc/self/fd");
+	if (!dir)
+		return false;
+	bool found = false;
+	char path[64], target[64];
+	for (dirent * entry; !found && (entry = readdir(dir));)
+	{
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+		const ssize_t length = readlink(path, target, sizeof(target) - 1);
+		found = length > 0 && std::string_view(target, (size_t)length) == "anon_inode:[io_uring]";
+	}
+	closedir(dir);
+	return found;
+}
+
+static bool startserver()
+{
+	int ready[2];
+	if (pipe(ready) != 0)
+		return false;
+
+	void * shared = mmap(nullptr, sizeof(*serverallocs), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared != MAP_FAILED)
+		serverallocs = new (shared) std::atomic<lw_ui64>(0);
+
+	serverpid = fork();
+	if (serverpid == -1)
+		return false;
+
+	if (serverpid == 0)
+	{
+		countingallocs = serverallocs != nullptr;
+		close(ready[0]);
+		if (opt.queue == "epoll")
+			setenv("LACEWING_EVENTQUEUE", "epoll", 1);
+		else
+			unsetenv("LACEWING_EVENTQUEUE");
+		lacewing::eventpump pump = lacewing::eventpump_new();
+		lacewing::relayserver server(pump);
+		server.onerror([](lacewing::relayserver &, lacewing::error error) {
+			// relayclient on desktop Linux names its platform from uname(), which relayserver doesn't know
+			if (!findingport && strncmp(error->tostring(), "Failed to recognise platform", 28))
+				fprintf(stderr, "server: error: %s\n", error->tostring());
+		});
+		// relayserver won't reuse a port with TIME_WAIT sockets from an earlier run on it, so try the next few
+		findingport = true;
+		for (int i = 0; i < 32 && !server.hosting(); ++i)
+			server.host((lw_ui16)(opt.port + i));
+		findingport = false;
+		if (!server.hosting())
+			_exit(1);
+
+		const lw_ui16 reply[2] = { server.port(), (lw_ui16)usingiouring() };
+		if (write(ready[1], reply, sizeof(reply)) != sizeof(reply))
+			_exit(1);
+		close(ready[1]);
+
+		pump->start_eventloop();
+		_exit(0);
+	}
+
+	close(ready[1]);
+	lw_ui16 reply[2];
+	const bool ok = read(ready[0], reply, sizeof(reply)) == sizeof(reply);
+	close(ready[0]);
+	if (ok)
+	{
+		opt.port = reply[0];
+		serverqueue = reply[1] ? "io_uring" : "epoll";
+
+		// relayserver queues join responses until its action timer first ticks, 100ms after hosting, and
+		// joins it looks up before then can each create the channel; so don't storm it before that
+		usleep(250 * 1000);
+	}
+	else
+	{
+		fprintf(stderr, "server: couldn't host on ports %d to %d\n", (int)opt.port, opt.port + 31);
+		waitpid(serverpid, nullptr, 0);
+		serverpid = 0;
+	}
+	return ok;
+}
+
+static void stopserver()
+{
+	if (!serverpid)
+		return;
+	kill(serverpid, SIGTERM);
+	waitpid(serverpid, nullptr, 0);
+}
+
+static void usage(const char * self)
+{
+	fprintf(stderr,
+		"usage: %s [options] [text] [binary] [peer] [blast] [churn] [name] [quiet]\n"
+		"       [timer] [post] [simplify] [allowlist] [validate]\n"
+		"Connect and join storms run first, unless only micro-benchmarks are named; the scenarios\n"
+		"default to the four message ones.\n"
+		"  -H host    benchmark a relay server already running there, instead of forking one\n"
+		"  -p port    port to host on, or the next free one after it; or to connect to with -H (%d)\n"
+		"  -n count   clients in the swarm (%d)\n"
+		"  -i count   idle clients to connect after the join storm, named but in no channel (%d)\n"
+		"  -t count   client eventpump threads; or threads for the micro-benchmarks (%d)\n"
+		"  -d secs    duration of each scenario (%g)\n"
+		"  -w count   messages each client keeps in flight (%d)\n"
+		"  -s sizes   comma-separated message sizes in bytes (64,1024,16384)\n"
+		"  -r rate    UDP blasts per second, across the swarm (%d)\n"
+		"  -c counts  comma-separated counts of channels held open during churn (1000,10000,50000)\n"
+		"  -q queue   event queue for the forked server: io_uring (falling back to epoll if the\n"
+		"             kernel can't), or epoll; the swarm always uses epoll (%s)\n",
+		self, (int)opt.port, opt.clients, opt.idle, opt.threads, opt.seconds, opt.window, opt.blastrate, opt.queue.c_str());
+}
+
+int main(int argc, char ** argv)
+{
+	for (int o; (o = getopt(argc, argv, "H:p:n:i:t:d:w:s:r:c:q:h")) != -1;)
+	{
+		switch (o)
+		{
+		case 'H': opt.host = optarg; break;
+		case 'p': opt.port = (lw_ui16)atoi(optarg); break;
+		case 'n': opt.clients = atoi(optarg); break;
+		case 'i': opt.idle = atoi(optarg); break;
+		case 't': opt.threads = atoi(optarg); break;
+		case 'd': opt.seconds = atof(optarg); break;
+		case 'w': opt.window = atoi(optarg); break;
+		case 'r': opt.blastrate = atoi(optarg); break;
+		case 'q': opt.queue = optarg; break;
+		case 's':
+			opt.sizes.clear();
+			for (char * s = strtok(optarg, ","); s; s = strtok(nullptr, ","))
+				opt.sizes.push_back((size_t)atol(s));
+			break;
+		case 'c':
+			opt.channelcounts.clear();
+			for (char * s = strtok(optarg, ","); s; s = strtok(nullptr, ","))
+				opt.channelcounts.push_back(atoi(s));
+			break;
+		default:
+			usage(argv[0]);
+			return o == 'h' ? 0 : 2;
+		}
+	}
+	for (int i = optind; i < argc; ++i)
+	{
+		const std::string s = argv[i];
+		if (s != "text" && s != "binary" && s != "peer" && s != "blast" && s != "churn" && s != "name" && s != "quiet" && !ismicro(s))
+		{
+			usage(argv[0]);
+			return 2;
+		}
+		opt.scenarios.push_back(s);
+	}
+	if (opt.scenarios.empty())
+		opt.scenarios = { "text", "binary", "peer", "blast" };
+	if (opt.clients < 2 || opt.idle < 0 || opt.threads < 1 || opt.window < 1 || opt.sizes.empty() || opt.channelcounts.empty()
+		|| (opt.queue != "io_uring" && opt.queue != "epoll"))
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// Micro-benchmarks don't need the server or the swarm
+	const bool swarm = std::any_of(opt.scenarios.begin(), opt.scenarios.end(),
+		[](const std::string & s) { return !ismicro(s); });
+
+	// Each relayclient has a TCP and a UDP socket, and a timerfd for each of its two timers; the
+	// forked server inherits the raised limit too
+	rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+	const bool churn = std::find(opt.scenarios.begin(), opt.scenarios.end(), "churn") != opt.scenarios.end();
+	const rlim_t needed = 4 * (rlim_t)(opt.clients + opt.idle + (churn ? holdercount : 0)) + 64;
+	if (swarm && needed > files.rlim_cur)
+	{
+		fprintf(stderr, "%d clients and %d idle need about %llu file descriptors, but the limit is %llu\n",
+			opt.clients, opt.idle, (unsigned long long)needed, (unsigned long long)files.rlim_cur);
+		return 1;
+	}
+
+	// Fork before any threads exist
+	if (swarm && !opt.host && !startserver())
+		return 1;
+
+	// Only the server's event queue changes between runs
+	setenv("LACEWING_EVENTQUEUE", "epoll", 1);
+
+	for (int i = 0; i < opt.threads; ++i)
+	{
+		auto w = std::make_unique<worker>();
+		w->index = i;
+		w->pump = lacewing::eventpump_new();
+		lacewing::eventpump pump = w->pump;
+		w->thread = std::thread([pump] { pump->start_eventloop(); });
+		workers.push_back(std::move(w));
+	}
+	for (int i = 0; swarm && i < opt.clients; ++i)
+	{
+		auto c = std::make_unique<client>();
+		c->index = i;
+		c->w = workers[i % workers.size()].get();
+		c->w->clients.push_back(c.get());
+		c->slots = std::make_unique<slot[]>(opt.window);
+		for (int j = 0; j < opt.window; ++j)
+		{
+			c->slots[j].owner = c.get();
+			c->slots[j].index = (lw_ui32)j;
+		}
+		clients.push_back(std::move(c));
+	}
+	for (int i = 0; swarm && i < opt.idle; ++i)
+	{
+		auto c = std::make_unique<client>();
+		c->index = opt.clients + i;
+		c->w = workers[i % workers.size()].get();
+		c->idle = true;
+		idlers.push_back(std::move(c));
+	}
+	oneach([](worker & w) {
+		w.blasttimer = lacewing::timer_new(w.pump);
+		w.blasttimer->tag(&w);
+		w.blasttimer->on_tick(blasttick);
+	});
+
+	if (swarm)
+	{
+		printf("relaybench: port %d, server on %s, %d clients and %d idle on %d threads, window %d, %gs per scenario\n",
+			(int)opt.port, serverqueue, opt.clients, opt.idle, opt.threads, opt.window, opt.seconds);
+	}
+	else
+		printf("relaybench: micro-benchmarks on %d threads, %gs each\n", opt.threads, opt.seconds);
+	printheader();
+
+	int status = 1;
+	if (!swarm || (connectstorm() && joinstorm() && connectidle()))
+	{
+		for (const std::string & s : opt.scenarios)
+		{
+			if (s == "timer")
+				runtimer();
+			else if (s == "post")
+				runpost();
+			else if (s == "simplify")
+				runsimplify();
+			else if (s == "allowlist")
+				runallowlist();
+			else if (s == "validate")
+				runvalidate();
+			else if (s == "blast")
+				runtraffic("blast", traffic::blast, opt.sizes.front());
+			else if (s == "name")
+				runname();
+			else if (s == "quiet")
+				runtraffic("quiet", traffic::quiet, opt.sizes.front());
+			else if (s == "churn")
+			{
+				// Counts only go up, as held channels stay open
+				std::vector<int> counts = opt.channelcounts;
+				std::sort(counts.begin(), counts.end());
+				for (int channels : counts)
+					if (!runchurn(channels))
+						break;
+			}
+			else if (s == "peer")
+			{
+				for (size_t size : opt.sizes)
+					runtraffic("peer", traffic::peer, size);
+			}
+			else
+			{
+				for (size_t size : opt.sizes)
+					runtraffic(s.c_str(), s == "text" ? traffic::text : traffic::binary, size);
+			}
+		}
+		status = 0;
+	}
+
+	finished = true;
+	if (serverpid)
+	{
+		const procusage server = readusage(serverpid);
+		printf("server peak rss %.1fMB\n", server.peakrsskb / 1024.0);
+	}
+	stopserver();
+
+	// The clients are still connected with their pumps running; skip tearing them down
+	fflush(stdout);
+	_exit(status);
+}